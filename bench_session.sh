@@ -0,0 +1,44 @@
+#!/bin/bash
+# Timing benchmark: build the simulation, run sim_session.txt on the real clock (about
+# five minutes) and compare tick timing, command latency and log throughput with the
+# baseline of this machine in bench_baselines/<machine>.json. Fails on a regression and
+# when this machine has no baseline yet. The machine is named by its host name, or by
+# BENCH_MACHINE where the host name changes from run to run (CI runners); the baseline
+# still has to come from the same CPU and core count. bench_baselines/ci.json is the
+# reference: BENCH_MACHINE=ci ./bench_session.sh on the gate machine.
+# usage: ./bench_session.sh            compare with the baseline of this machine
+#        ./bench_session.sh --record   run once and store the result as this machine's baseline
+set -u
+
+src="$(cd "$(dirname "$0")" && pwd)"
+baselines="$src/bench_baselines"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+mkdir -p "$work/log"
+
+echo "Building $work/bmi_exercise_sim"
+g++ -std=c++17 -O2 -DSIM_BACKEND "$src/bmi_exercise.cpp" -o "$work/bmi_exercise_sim" -pthread || exit 1
+
+machine="${BENCH_MACHINE:-$(hostname)}"
+options=(--script "$src/sim_session.txt" --feedback off --metrics-port 0 --subject 1 --online 0 --session 1 --run 1 --side r
+    --bench-machine "$machine")
+if [ "${1:-}" = "--record" ]; then
+    mkdir -p "$baselines"
+    baseline="$baselines/$machine.json"
+    echo "Recording $baseline"
+    (cd "$work" && ./bmi_exercise_sim "${options[@]}" --bench "$baseline" </dev/null >"$work/bench.out" 2>&1)
+    status=$?
+    [ $status -eq 0 ] || { tail -20 "$work/bench.out"; echo "Benchmark session failed (exit status $status)"; exit 1; }
+    echo "Baseline recorded, review its thresholds and commit it"
+    exit 0
+fi
+
+echo "Running the benchmark session against $baselines"
+(cd "$work" && ./bmi_exercise_sim "${options[@]}" --bench "$work/bench.json" --bench-baseline "$baselines" </dev/null >"$work/bench.out" 2>&1)
+status=$?
+sed -n '/^metric /,$p' "$work/bench.out"
+case $status in
+    0) echo "Benchmark passed" ;;
+    4) echo "Benchmark FAILED: timing regression"; exit 1 ;;
+    *) tail -5 "$work/bench.out"; echo "Benchmark FAILED (exit status $status)"; exit 1 ;;
+esac
@@ -7,65 +7,2238 @@
 /******************************************************************************************
  * INCLUDES
  *****************************************************************************************/
+#ifdef SIM_BACKEND
+#include "sim_research_interface.h"
+#else
 #include "research_interface.h"
+#endif
+#include "log_codec.h"
+#include "joint_trajectory.h"
+#include "json_reader.h"
+#include "log_segment.h"
+#include "command_relay.h"
+#include "metrics_server.h"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <memory>
 #include <iomanip>
+#include <map>
 #include <string>
 #include <thread>
+#include <vector>
 #include <ctime>
+#include <mutex>
 #include <sstream>
+#include <type_traits>
+
+// UDP include
+#include <cstdlib>
+#include <cstring>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <termios.h>
+#include <cstdarg>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <cerrno>
+#include <time.h>
+#include <unistd.h>
+
+#define PI 3.141592653
+#define DEG_2_RAD PI / 180
+#define RAD_2_DEG 180 / PI
+
+// UDP define
+#define PORT 8080
+#define MAX_BUFFER_SIZE 1024
+#define FEEDBACK_PORT 8081 // port on the command sender that feedback goes to by default
+#define METRICS_PORT 9464 // loopback port of the metrics endpoint
+#define COMMAND_CHARS "xyzdgsepncXYZ" // movement x/y/z/d, go, stop, exit, pause, next trial, change side, redirect to X/Y/Z
+
+#define s400Stiffness_Nm_p_rad 15.0 // desired joint stiffness for series 400 [shoulder] motors(max is 50)
+#define s600Stiffness_Nm_p_rad 15.0 // desired joint stiffness for series 600 [elbow] motors (max is 30)
+#define s700Stiffness_Nm_p_rad 1.5 // desired joint stiffness for series 700 [wrist] motors(max is 3)
+
+#define s400MaxStiffness_Nm_p_rad 50.0 // stiffness limit for series 400 [shoulder] motors
+#define s600MaxStiffness_Nm_p_rad 30.0 // stiffness limit for series 600 [elbow] motors
+#define s700MaxStiffness_Nm_p_rad 3.0 // stiffness limit for series 700 [wrist] motors
+
+#define WD_SCALING 1.0 // wrist abduction stiffness relative to series 700 (wrist mods)
+#define WF_SCALING 0.33 // wrist flexion stiffness relative to series 700 (wrist mods)
+
+// joint configuration used when --joints is not given
+#if defined(TORSO_MODS) && defined(WRIST_MODS)
+#define DEFAULT_JOINT_CONFIG "torso-wrist"
+#elif defined(TORSO_MODS)
+#define DEFAULT_JOINT_CONFIG "torso"
+#elif defined(WRIST_MODS)
+#define DEFAULT_JOINT_CONFIG "wrist"
+#else
+#define DEFAULT_JOINT_CONFIG "arms"
+#endif
+
+// fully unroll a fixed size per joint loop
+#define UNROLL _Pragma("GCC unroll 32")
+
+// Buffer Times 
+int ImpedenceBufferTime_s = 4;
+int startPosBufferTime_s = 5;
+int beginExBufferTime_s = 6; 
+int waitBufferTime_s = 3;
+int back2StartBufferTime_s = 2;
+int waitBufferTime2_s = waitBufferTime_s;
+
+// Assist as needed impedance (see ImpedanceEngine)
+bool adaptiveImpedance = true; // adapt stiffness every tick, otherwise hold the nominal stiffness
+double aanErrorGain = 10.0; // stiffness increase per second per rad of tracking error, relative to nominal [1/(rad s)]
+double aanRelaxRate = 0.5; // rate at which stiffness returns to nominal [1/s]
+double aanEffortGain = 0.25; // rate at which patient torque lowers stiffness towards the floor [1/(Nm s)]
+double aanFloorFraction = 0.5; // lowest stiffness, relative to nominal
+
+// Command safety limits (see SafetyStage)
+double maxJointVelocity_rad_s = 1.0; // lowest per joint speed limit of the command, raised to fit the planned moves
+double maxJointAcceleration_rad_s2 = 20.0; // lowest per joint acceleration limit of the command, likewise
+double safetyMoveMargin = 1.25; // limits stay this factor above the fastest planned move (SafetyStage::allowMove)
+double upperArmLength_mm = 300.0; // coarse arm model used to precompute the workspace table
+double forearmLength_mm = 280.0;
+double workspaceMin_mm[3] = {-200.0, -650.0, -650.0}; // hand position bounds relative to the shoulder
+double workspaceMax_mm[3] = {650.0, 650.0, 350.0}; // x forward, y lateral (outwards), z up
+bool workspaceCheck = true; // false: run without the workspace check (--no-workspace-check), joint limits stay
+
+// Feedback stream to the EEG PC (see FeedbackChannel)
+std::string feedbackDestination = ""; // "host:port", empty: sender of the last command on FEEDBACK_PORT, "off": none
+double feedbackRate_Hz = 50.0; // periodic feedback packets per second, state changes are sent at once
+
+// Command stream distribution (see openCommandSocket, command_relay.h)
+std::string commandGroup = ""; // multicast group (IPv4 or IPv6) joined on the command socket, empty: unicast only
+std::vector<std::string> commandSources; // take the group's packets only from these senders (source-specific multicast)
+std::string commandInterface = ""; // interface the group is joined on, empty: chosen by the kernel
+std::vector<std::string> relayDestinations; // local consumers every received datagram is forwarded to, "host:port"
+
+// Metrics endpoint (see MetricsServer)
+int metricsPort = METRICS_PORT; // serve http://127.0.0.1:<port>/metrics, 0: off
+
+// Teach by demonstration (see DemoArena, Demonstration)
+std::string demoRecordPath = ""; // record a demonstration to this file instead of running trials
+std::string demoPlaybackPath = ""; // demonstration played back as movement class 'd'
+double demoMaxLength_s = 120.0; // longest recording, the arena is allocated for this length up front
+double demoRecordCompliance = 0.2; // stiffness of the guided arm while recording, relative to nominal
+double demoTolerance_deg = 0.5; // largest joint deviation the simplification may introduce
+double demoBlendTime_s = 1.0; // playback fades from the hold pose onto the demonstration over this time
+
+// Mirror therapy (see MirrorMap)
+bool mirrorMode = false; // drive the exercising arm from the other arm instead of running trials
+double mirrorRate_Hz = 500.0; // control rate of a mirror session (whole milliseconds per tick)
+int mirrorSource[harmony::armJointCount] = {0, 1, 2, 3, 4, 5, 6}; // healthy arm joint each exercising arm joint follows
+double mirrorSign[harmony::armJointCount] = {-1, -1, -1, -1, -1, -1, -1}; // joint axes of the two arms are mirrored
+double mirrorGain[harmony::armJointCount] = {1, 1, 1, 1, 1, 1, 1}; // motion scale around the start pose
+double mirrorCutoff_Hz = 4.0; // low pass on the mirrored command, 0: none
+double mirrorHealthyCompliance = 0.0; // stiffness of the healthy arm while mirroring, relative to nominal
+
+// Joint state filtering (see JointFilter)
+double jointFilterCutoff_Hz = 20.0; // position low pass, 0: raw positions
+double torqueFilterCutoff_Hz = 10.0; // torque low pass, 0: raw torques
+char velocityEstimator = 'k'; // 'k': Kalman filter, 'd': low passed finite difference
+double velocityCutoff_Hz = 15.0; // low pass of the finite difference velocity
+double kalmanPositionNoise_rad = 0.0005; // joint position measurement noise (1 sigma)
+double kalmanAccelNoise_rad_s2 = 50.0; // process noise, white joint acceleration (1 sigma)
+
+// Trajectory cache (see TrajectoryCache)
+int trajectoryCacheSlots = 6; // trajectories kept, each holds beginExBufferTime_s * fs poses
+int trajectoryPrecomputeRows = 240; // trajectory poses computed per control tick while the patient rests
+
+// Trajectory blending (see TrajectoryBlender)
+double stopBlendTime_s = 0.3; // s during a movement brings the arms to rest over this time instead of freezing them
+double redirectMinTime_s = 1.5; // shortest movement to a goal given in flight with X, Y or Z
+
+// Launch (see readConfigFile, StartupTimer)
+std::map<std::string, std::string> startupPresets; // startup answers given up front: subject, online, session, run, side
+double startMoveSpeed_rad_s = 0.0; // > 0: move to start at this joint speed, at most startPosBufferTime_s
+
+// Input journal (see InputJournal, JournalReplay)
+bool journalInput = true; // write every received packet and the startup answers to _input.bmj next to the log
+std::string replayPath = ""; // replay this journal instead of listening for UDP commands
+
+// Log encoding
+bool compressLog = false; // write a delta/varint compressed _log.bmz instead of _log.txt (see log_decode.cpp)
+double logJointResolution_deg = 0.001; // joint column resolution in the compressed log
+double logPoseResolution_mm = 0.01; // end effector column resolution in the compressed log
+double logVelocityResolution_deg_s = 0.01; // joint velocity column resolution in the compressed log
+double logTorqueResolution_Nm = 0.001; // filtered torque column resolution in the compressed log
+int logBlockFrames = 2000; // frames per independently decodable block
+bool segmentedLog = false; // write crash safe, preallocated log segments (see log_recover.cpp)
+int logSegmentSize_MB = 16; // size of one preallocated segment file
+int logSyncInterval_ms = 1000; // how often segments are flushed to disk with fdatasync
+
+// Operator console (see OperatorConsole)
+double consoleRate_Hz = 4; // status line redraws per second on a terminal
+
+// Real-time allocation check (build with -DRT_ALLOC_CHECK, see RtScope)
+bool rtAllocFail = false; // abort on the first allocation inside a real-time scope instead of counting it
+
+/******************************************************************************************
+ * Real-time allocation check
+ *  The work of a control tick runs inside an RtScope and must not touch the heap. Built
+ *  with -DRT_ALLOC_CHECK, malloc and its relatives (which operator new ends up in) are
+ *  replaced by versions that count every allocation made while the calling thread is
+ *  inside a scope and keep the call stacks of the first RT_ALLOC_TRACES of them. With
+ *  --alloc-fail the first one aborts the program instead. Without RT_ALLOC_CHECK an
+ *  RtScope does nothing. rt_alloc_check.sh builds this way and fails if a scripted
+ *  session allocates in a tick.
+ *****************************************************************************************/
+#ifdef RT_ALLOC_CHECK
+#include <execinfo.h>
+
+#define RT_ALLOC_TRACES 8 // call stacks kept for the report
+#define RT_ALLOC_DEPTH 24 // frames per call stack
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+namespace rtalloc {
+thread_local int depth = 0; // > 0 while this thread is inside an RtScope
+thread_local bool inCheck = false; // backtrace() may allocate itself
+std::atomic<uint64_t> allocations{0};
+std::mutex traceMutex;
+int traced = 0; // distinct call stacks seen, only the first RT_ALLOC_TRACES are kept
+void* traces[RT_ALLOC_TRACES][RT_ALLOC_DEPTH];
+int traceDepth[RT_ALLOC_TRACES];
+size_t traceBytes[RT_ALLOC_TRACES];
+uint64_t traceCount[RT_ALLOC_TRACES];
+
+inline void check(size_t size) {
+    if (depth == 0 || inCheck) { return; }
+    inCheck = true;
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* frames[RT_ALLOC_DEPTH];
+    int n = backtrace(frames, RT_ALLOC_DEPTH);
+    if (rtAllocFail) {
+        static const char message[] = "Heap allocation inside a real-time scope:\n";
+        if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) {}
+        backtrace_symbols_fd(frames, n, STDERR_FILENO);
+        abort();
+    }
+    std::lock_guard<std::mutex> lock(traceMutex);
+    int k = 0;
+    while (k < std::min(traced, RT_ALLOC_TRACES) &&
+           (traceDepth[k] != n || memcmp(traces[k], frames, n * sizeof(void*)) != 0)) {
+        k++;
+    }
+    if (k == traced && k < RT_ALLOC_TRACES) {
+        memcpy(traces[k], frames, n * sizeof(void*));
+        traceDepth[k] = n;
+        traceBytes[k] = size;
+        traceCount[k] = 0;
+    }
+    if (k == traced) { traced++; }
+    if (k < RT_ALLOC_TRACES) { traceCount[k]++; }
+    inCheck = false;
+}
+
+/**
+ * @brief Resolve the symbols once at start-up, the first backtrace() loads libgcc
+ */
+inline void prime() {
+    void* frames[2];
+    backtrace(frames, 2);
+}
+} // namespace rtalloc
+
+extern "C" {
+void* malloc(size_t size) {
+    rtalloc::check(size);
+    return __libc_malloc(size);
+}
+void* calloc(size_t n, size_t size) {
+    rtalloc::check(n * size);
+    return __libc_calloc(n, size);
+}
+void* realloc(void* ptr, size_t size) {
+    rtalloc::check(size);
+    return __libc_realloc(ptr, size);
+}
+void* memalign(size_t alignment, size_t size) {
+    rtalloc::check(size);
+    return __libc_memalign(alignment, size);
+}
+void* aligned_alloc(size_t alignment, size_t size) {
+    rtalloc::check(size);
+    return __libc_memalign(alignment, size);
+}
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    rtalloc::check(size);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr != nullptr ? 0 : ENOMEM;
+}
+}
+#endif
+
+/**
+ * @brief Marks the enclosing block as real-time: no heap allocation allowed (see RT_ALLOC_CHECK)
+ */
+struct RtScope {
+#ifdef RT_ALLOC_CHECK
+    RtScope() { rtalloc::depth++; }
+    ~RtScope() { rtalloc::depth--; }
+#else
+    RtScope() {}
+#endif
+};
+
+/**
+ * @brief Print what the allocation check found
+ * @return number of allocations made inside real-time scopes, 0 if the check is not built in
+ */
+uint64_t rtAllocReport(std::ostream& out) {
+#ifdef RT_ALLOC_CHECK
+    uint64_t allocations = rtalloc::allocations.load();
+    out << "Real-time allocation check: " << allocations << " heap allocations inside real-time scopes" << std::endl;
+    std::lock_guard<std::mutex> lock(rtalloc::traceMutex);
+    if (rtalloc::traced > RT_ALLOC_TRACES) { out << rtalloc::traced << " call sites, the first " << RT_ALLOC_TRACES << ":" << std::endl; }
+    for (int k = 0; k < std::min(rtalloc::traced, RT_ALLOC_TRACES); k++) {
+        out << rtalloc::traceCount[k] << " x " << rtalloc::traceBytes[k] << " bytes from" << std::endl;
+        backtrace_symbols_fd(rtalloc::traces[k], rtalloc::traceDepth[k], STDOUT_FILENO);
+    }
+    return allocations;
+#else
+    (void)out;
+    return 0;
+#endif
+}
+ 
+/******************************************************************************************
+ * Joint configurations
+ *****************************************************************************************/
+/**
+ * @brief true if the SDK's joint enum has the extra joints of the wrist mods
+ */
+template <typename E, typename = void>
+struct HasWristModJoints : std::false_type {};
+template <typename E>
+struct HasWristModJoints<E, std::void_t<decltype(E::wristAbduction), decltype(E::wristFlexion)>> : std::true_type {};
+
+template <typename E>
+constexpr int wristAbductionIndex() {
+    if constexpr (HasWristModJoints<E>::value) { return int(E::wristAbduction); } else { return -1; }
+}
+
+template <typename E>
+constexpr int wristFlexionIndex() {
+    if constexpr (HasWristModJoints<E>::value) { return int(E::wristFlexion); } else { return -1; }
+}
+
+/**
+ * @brief returns the position limit of a joint, symmetric about zero
+ * Conservative envelope around the home, transfer and exercise poses of this file.
+ * @param joint_idx current index for joint
+ * @return double the joint limit in degrees
+ */
+constexpr double jointLimit_deg(int joint_idx) {
+    switch (joint_idx) {
+        case 0: return 45.0;
+        case 1: return 30.0;
+        case 2: return 60.0;
+        case 3: return 100.0;
+        case 4: return 110.0;
+        case 5: return 130.0; // elbow
+        default: return 90.0; // wrist
+    }
+}
+
+/**
+ * @brief Joint layout and per joint tables of one robot configuration
+ * A data line holds one value per driven joint: index 0 is unused, then the left arm,
+ * the right arm and, with the torso, the torso joints. Sizes and tables are constexpr,
+ * so every per joint loop of the controller runs over a fixed size known at compile time.
+ * Torso joints use the table entries of the first arm joints.
+ *
+ * Stiffness by actuator: joints <5 are series 400, joint 5 is the elbow series 600,
+ * joint 6 (and the wrist mod joints) series 700.
+ *
+ * @tparam Torso drive the torso joints as well
+ * @tparam WristMods arms carry the modified wrist (wristAbduction, wristFlexion)
+ */
+template <bool Torso, bool WristMods>
+struct JointConfig {
+    static constexpr bool hasTorso = Torso;
+    static constexpr bool hasWristMods = WristMods;
+    // the SDK this is built against knows the joints this configuration drives
+    static constexpr bool available = !WristMods || HasWristModJoints<harmony::ArmJoint>::value;
+
+    static constexpr int armJoints = harmony::armJointCount;
+    static constexpr int torsoJoints = Torso ? harmony::torsoJointCount : 0;
+    static constexpr int leftOffset = 1;
+    static constexpr int rightOffset = 1 + armJoints;
+    static constexpr int torsoOffset = 1 + 2 * armJoints;
+    static constexpr int nCols = 1 + 2 * armJoints + torsoJoints; // number of columns in dataset
+    static constexpr int nLogCols = 3 * (2 * armJoints + torsoJoints) + 6; // joint, end effector, velocity and torque columns of a log row
+
+    using DataLine = std::array<double, nCols>;
+
+    static constexpr double armStiffness(int joint_idx) {
+        if (joint_idx == int(harmony::ArmJoint::elbowFlexion)) { return s600Stiffness_Nm_p_rad; }
+        if (joint_idx == int(harmony::ArmJoint::wristPronation)) { return s700Stiffness_Nm_p_rad; }
+        if (WristMods && joint_idx == wristAbductionIndex<harmony::ArmJoint>()) { return WD_SCALING * s700Stiffness_Nm_p_rad; }
+        if (WristMods && joint_idx == wristFlexionIndex<harmony::ArmJoint>()) { return WF_SCALING * s700Stiffness_Nm_p_rad; }
+        return s400Stiffness_Nm_p_rad;
+    }
+
+    static constexpr double armMaxStiffness(int joint_idx) {
+        if (joint_idx == int(harmony::ArmJoint::elbowFlexion)) { return s600MaxStiffness_Nm_p_rad; }
+        if (joint_idx == int(harmony::ArmJoint::wristPronation)) { return s700MaxStiffness_Nm_p_rad; }
+        if (WristMods && (joint_idx == wristAbductionIndex<harmony::ArmJoint>() || joint_idx == wristFlexionIndex<harmony::ArmJoint>())) {
+            return s700MaxStiffness_Nm_p_rad;
+        }
+        return s400MaxStiffness_Nm_p_rad;
+    }
+
+    static constexpr double armLimit_rad(int joint_idx) { return DEG_2_RAD * jointLimit_deg(joint_idx); }
+
+    /**
+     * @brief Expand a per arm joint table to the data line layout
+     */
+    static constexpr DataLine table(double (*entry)(int)) {
+        DataLine line{};
+        for (int i = 1; i < nCols; i++) { line[i] = entry((i - 1) % armJoints); }
+        return line;
+    }
+
+    static constexpr DataLine stiffness = table(armStiffness); // nominal stiffness [Nm/rad]
+    static constexpr DataLine maxStiffness = table(armMaxStiffness); // actuator series limit [Nm/rad]
+    static constexpr DataLine limit_rad = table(armLimit_rad); // joint position limit [rad]
+};
+
+using ArmsOnly = JointConfig<false, false>;
+using ArmsTorso = JointConfig<true, false>;
+using WristMods = JointConfig<false, true>;
+using TorsoWristMods = JointConfig<true, true>;
+
+/******************************************************************************************
+ * Structs
+ *****************************************************************************************/
+struct NoTorsoOverrides {};
+
+template <class Config>
+struct AllArmsOverrides {
+    harmony::ArmJointsOverride leftOverrides;
+    harmony::ArmJointsOverride rightOverrides;
+    std::conditional_t<Config::hasTorso, harmony::TorsoJointsOverride, NoTorsoOverrides> torsoOverrides;
+};
+
+/**
+ * @brief A single UDP command and the time it reached the socket
+ * rx_real_ns is the kernel receive timestamp (SO_TIMESTAMPNS, CLOCK_REALTIME),
+ * rx_mono_ns is the same instant expressed on CLOCK_MONOTONIC
+ */
+struct UdpCommand {
+    char cmd = 0;
+    int64_t rx_mono_ns = 0;
+    int64_t rx_real_ns = 0;
+};
+
+/**
+ * @brief Latest UDP command, shared between the UDP thread and the control loop
+ * The control loop peeks at the command character every tick and takes the whole
+ * command (with its timestamps) once it acts on it. A newer command overwrites an
+ * older one that has not been taken yet, same as the old shared buffer did.
+ * The last LATCH_HISTORY commands taken are kept for the journal, so every take is
+ * journaled even when one tick takes several.
+ */
+#define LATCH_HISTORY 16
+
+class CommandLatch {
+public:
+    /**
+     * @return false if an older command had not been taken yet and is lost
+     */
+    bool publish(const UdpCommand& command) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bool pending = command_.cmd != 0;
+        command_ = command;
+        cmd_.store(command.cmd, std::memory_order_release);
+        return !pending;
+    }
+
+    char peek() const { return cmd_.load(std::memory_order_acquire); }
+
+    UdpCommand take() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        UdpCommand command = command_;
+        command_ = UdpCommand();
+        cmd_.store(0, std::memory_order_release);
+        if (command.cmd != 0) { history_[taken_++ % LATCH_HISTORY] = command; }
+        return command;
+    }
+
+    // commands taken so far and the k-th of them, one of the last LATCH_HISTORY (control loop only)
+    uint64_t taken() const { return taken_; }
+    const UdpCommand& taken(uint64_t k) const { return history_[k % LATCH_HISTORY]; }
+
+private:
+    std::mutex mutex_;
+    UdpCommand command_;
+    std::atomic<char> cmd_{0};
+    uint64_t taken_ = 0;
+    std::array<UdpCommand, LATCH_HISTORY> history_;
+};
+
+/**
+ * @brief Running class probabilities of the decoder ("p <x> <y> <z>" packets)
+ * Only used to decide which trajectories to precompute first, so the three values
+ * are stored independently without further synchronisation.
+ */
+class ClassProbabilities {
+public:
+    void publish(double x, double y, double z) {
+        p_[0].store(x, std::memory_order_relaxed);
+        p_[1].store(y, std::memory_order_relaxed);
+        p_[2].store(z, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Movement classes, most likely first (x, y, z before the first packet)
+     */
+    std::array<char, 3> ranking() const {
+        std::array<char, 3> order = {'x', 'y', 'z'};
+        double p[3] = {p_[0].load(std::memory_order_relaxed), p_[1].load(std::memory_order_relaxed), p_[2].load(std::memory_order_relaxed)};
+        // stable insertion sort, std::stable_sort would allocate a temporary buffer every tick
+        for (int i = 1; i < 3; i++) {
+            for (int j = i; j > 0 && p[order[j] - 'x'] > p[order[j - 1] - 'x']; j--) { std::swap(order[j], order[j - 1]); }
+        }
+        return order;
+    }
+
+private:
+    std::atomic<double> p_[3] = {};
+};
+
+/******************************************************************************************
+ * Joint state filtering
+ *****************************************************************************************/
+/**
+ * @brief Filtered joint positions and torques, and joint velocity estimates
+ * Runs once per control tick on the raw joint states. Every channel and every filter
+ * state is one array over all joints in the data line layout (structure of arrays),
+ * so each stage is a single loop over contiguous doubles that vectorizes across joints.
+ *  - position: second order Butterworth low pass at jointFilterCutoff_Hz
+ *  - velocity: constant velocity Kalman filter per joint (velocityEstimator 'k'), or
+ *    finite difference of the raw positions low passed at velocityCutoff_Hz ('d')
+ *  - torque: second order Butterworth low pass at torqueFilterCutoff_Hz
+ * A cutoff of 0 passes the channel through. The first update starts every filter in
+ * steady state on its input, so nothing rings when the session starts.
+ */
+template <class Config>
+class JointFilter {
+public:
+    using DataLine = typename Config::DataLine;
+
+    explicit JointFilter(double dt_s)
+        : dt_s_(dt_s),
+          positionLowPass_(Biquad::lowPass(jointFilterCutoff_Hz, dt_s)),
+          velocityLowPass_(Biquad::lowPass(velocityCutoff_Hz, dt_s)),
+          torqueLowPass_(Biquad::lowPass(torqueFilterCutoff_Hz, dt_s)) {
+        q_ = kalmanAccelNoise_rad_s2 * kalmanAccelNoise_rad_s2;
+        r_ = kalmanPositionNoise_rad * kalmanPositionNoise_rad;
+        for (DataLine* line : {&position_, &velocity_, &torque_, &raw_}) { line->fill(0.0); }
+    }
+
+    /**
+     * @brief Filter the joint states of one tick
+     */
+    void update(const DataLine& position, const DataLine& torque) {
+        if (!started_) {
+            reset(position, torque);
+            return;
+        }
+
+        positionLowPass_.apply(position, positionState_, position_);
+        torqueLowPass_.apply(torque, torqueState_, torque_);
+
+        if (velocityEstimator == 'd') {
+            DataLine difference;
+            double inverse_dt = 1.0 / dt_s_;
+            for (int i = 0; i < Config::nCols; i++) { difference[i] = (position[i] - raw_[i]) * inverse_dt; }
+            velocityLowPass_.apply(difference, velocityState_, velocity_);
+        } else {
+            kalman(position);
+        }
+        raw_ = position;
+    }
+
+    const DataLine& position() const { return position_; }
+    const DataLine& velocity() const { return velocity_; }
+    const DataLine& torque() const { return torque_; }
+
+private:
+    /**
+     * @brief Transposed direct form II biquad, coefficients shared by all joints
+     */
+    struct Biquad {
+        double b0 = 1.0, b1 = 0.0, b2 = 0.0, a1 = 0.0, a2 = 0.0;
+
+        static Biquad lowPass(double cutoff_Hz, double dt_s) {
+            Biquad f;
+            if (cutoff_Hz <= 0.0) { return f; }
+            double w0 = 2.0 * PI * std::min(cutoff_Hz * dt_s, 0.45);
+            double alpha = std::sin(w0) / std::sqrt(2.0); // Q = 1/sqrt(2)
+            double a0 = 1.0 + alpha;
+            f.b0 = f.b2 = (1.0 - std::cos(w0)) / 2.0 / a0;
+            f.b1 = (1.0 - std::cos(w0)) / a0;
+            f.a1 = -2.0 * std::cos(w0) / a0;
+            f.a2 = (1.0 - alpha) / a0;
+            return f;
+        }
+
+        struct State {
+            DataLine z1{};
+            DataLine z2{};
+        };
+
+        // state that holds a constant input x
+        void settle(const DataLine& x, State& s) const {
+            for (int i = 0; i < Config::nCols; i++) {
+                s.z1[i] = x[i] * (1.0 - b0);
+                s.z2[i] = x[i] * (b2 - a2);
+            }
+        }
+
+        void apply(const DataLine& x, State& s, DataLine& y) const {
+            for (int i = 0; i < Config::nCols; i++) {
+                double out = b0 * x[i] + s.z1[i];
+                s.z1[i] = b1 * x[i] - a1 * out + s.z2[i];
+                s.z2[i] = b2 * x[i] - a2 * out;
+                y[i] = out;
+            }
+        }
+    };
+
+    void reset(const DataLine& position, const DataLine& torque) {
+        position_ = raw_ = kalmanPosition_ = position;
+        torque_ = torque;
+        velocity_.fill(0.0);
+        positionLowPass_.settle(position, positionState_);
+        torqueLowPass_.settle(torque, torqueState_);
+        velocityLowPass_.settle(velocity_, velocityState_);
+        p00_.fill(r_);
+        p01_.fill(0.0);
+        p11_.fill(q_ * dt_s_);
+        started_ = true;
+    }
+
+    /**
+     * @brief One predict / update step of the per joint [position, velocity] Kalman filter
+     * White acceleration process noise q, position measurement noise r.
+     */
+    void kalman(const DataLine& z) {
+        const double dt = dt_s_, dt2 = dt * dt;
+        const double q00 = q_ * dt2 * dt2 / 4.0, q01 = q_ * dt2 * dt / 2.0, q11 = q_ * dt2;
+        for (int i = 0; i < Config::nCols; i++) {
+            // predict
+            double p = kalmanPosition_[i] + velocity_[i] * dt;
+            double p00 = p00_[i] + dt * (2.0 * p01_[i] + dt * p11_[i]) + q00;
+            double p01 = p01_[i] + dt * p11_[i] + q01;
+            double p11 = p11_[i] + q11;
+            // update with the measured position
+            double k0 = p00 / (p00 + r_), k1 = p01 / (p00 + r_);
+            double innovation = z[i] - p;
+            kalmanPosition_[i] = p + k0 * innovation;
+            velocity_[i] += k1 * innovation;
+            p00_[i] = (1.0 - k0) * p00;
+            p01_[i] = (1.0 - k0) * p01;
+            p11_[i] = p11 - k1 * p01;
+        }
+    }
+
+    double dt_s_;
+    double q_ = 0.0;
+    double r_ = 0.0;
+    bool started_ = false;
+    Biquad positionLowPass_;
+    Biquad velocityLowPass_;
+    Biquad torqueLowPass_;
+    typename Biquad::State positionState_;
+    typename Biquad::State velocityState_;
+    typename Biquad::State torqueState_;
+
+    alignas(32) DataLine position_;
+    alignas(32) DataLine velocity_;
+    alignas(32) DataLine torque_;
+    alignas(32) DataLine raw_;
+    alignas(32) DataLine kalmanPosition_;
+    alignas(32) DataLine p00_;
+    alignas(32) DataLine p01_;
+    alignas(32) DataLine p11_;
+};
+
+/******************************************************************************************
+ * Timestamps
+ *****************************************************************************************/
+int64_t clockNs(clockid_t clock_id) {
+    struct timespec ts;
+    clock_gettime(clock_id, &ts);
+    return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+int64_t monotonicNs() { return clockNs(CLOCK_MONOTONIC); }
+int64_t realtimeNs() { return clockNs(CLOCK_REALTIME); }
+
+/**
+ * @brief Wall time of the start-up stages, reported once the first trial can start
+ * Stages may run concurrently, each one records when it started and ended relative
+ * to the creation of the timer. Thread safe.
+ */
+class StartupTimer {
+public:
+    StartupTimer() : start_ns_(monotonicNs()) {}
+
+    void record(const char* stage, int64_t begin_ns, int64_t end_ns) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stages_.push_back({stage, begin_ns - start_ns_, end_ns - start_ns_});
+    }
+
+    /**
+     * @brief Run f as the stage called stage
+     */
+    template <typename F>
+    auto time(const char* stage, F&& f) {
+        int64_t begin_ns = monotonicNs();
+        auto result = f();
+        record(stage, begin_ns, monotonicNs());
+        return result;
+    }
+
+    void report(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::stable_sort(stages_.begin(), stages_.end(), [](const Stage& a, const Stage& b) { return a.begin_ns < b.begin_ns; });
+        out << "Start-up stages [ms]        start      took\n";
+        for (const Stage& stage : stages_) {
+            out << "  " << std::left << std::setw(24) << stage.name << std::right << std::fixed << std::setprecision(1)
+                << std::setw(9) << stage.begin_ns * 1e-6 << std::setw(10) << (stage.end_ns - stage.begin_ns) * 1e-6 << "\n";
+        }
+        out << "  " << std::left << std::setw(24) << "ready for the first trial" << std::right << std::setw(9)
+            << (monotonicNs() - start_ns_) * 1e-6 << std::defaultfloat << std::setprecision(6) << std::endl;
+    }
+
+private:
+    struct Stage {
+        const char* name;
+        int64_t begin_ns;
+        int64_t end_ns;
+    };
+
+    int64_t start_ns_;
+    std::mutex mutex_;
+    std::vector<Stage> stages_;
+};
+
+/******************************************************************************************
+ * Clock
+ *****************************************************************************************/
+/**
+ * @brief Time source of the control loop
+ * Every tick, phase duration and log timestamp of a session goes through this, so
+ * the same session can run on the real clock or on a virtual one.
+ */
+class Clock {
+public:
+    virtual ~Clock() {}
+    virtual int64_t monotonic_ns() = 0;
+    virtual int64_t realtime_ns() = 0;
+    virtual void sleepUntil(int64_t deadline_ns) = 0;
+};
+
+/**
+ * @brief CLOCK_MONOTONIC / CLOCK_REALTIME with absolute sleeps
+ */
+class RealClock : public Clock {
+public:
+    int64_t monotonic_ns() override { return monotonicNs(); }
+    int64_t realtime_ns() override { return realtimeNs(); }
+
+    void sleepUntil(int64_t deadline_ns) override {
+        struct timespec ts;
+        ts.tv_sec = deadline_ns / 1000000000LL;
+        ts.tv_nsec = deadline_ns % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+    }
+};
+
+/**
+ * @brief Clock that only moves when the control loop sleeps
+ * Sleeping jumps straight to the deadline, after waiting (deadline - now) / speed of
+ * real time. speed 100 runs a session at 100x real time, speed 0 as fast as the CPU
+ * allows. Only meant for the simulated backend.
+ */
+class VirtualClock : public Clock {
+public:
+    explicit VirtualClock(double speed) : speed_(speed) {
+        start_mono_ns_ = now_ns_ = monotonicNs();
+        start_real_ns_ = realtimeNs();
+    }
+
+    int64_t monotonic_ns() override { return now_ns_.load(); }
+    int64_t realtime_ns() override { return start_real_ns_ + (now_ns_.load() - start_mono_ns_); }
+
+    void sleepUntil(int64_t deadline_ns) override {
+        if (deadline_ns <= now_ns_.load()) { return; }
+        if (speed_ > 0) {
+            RealClock real;
+            real.sleepUntil(start_mono_ns_ + int64_t((deadline_ns - start_mono_ns_) / speed_));
+        }
+        now_ns_.store(deadline_ns);
+    }
+
+private:
+    double speed_;
+    int64_t start_mono_ns_;
+    int64_t start_real_ns_;
+    std::atomic<int64_t> now_ns_;
+};
+
+/**
+ * @brief Feeds commands from a script file into the command latch
+ * One command per line, "<delay_s> <command>", '#' starts a comment. The delay runs
+ * from the moment the control loop took the previous command, so a script follows the
+ * session whatever the phase durations are. Every command must be one the session
+ * will take (e.g. an 's' only while moving), the script waits for it otherwise.
+ * Polled by the InputRouter every tick, which keeps it deterministic on a virtual
+ * clock.
+ */
+class ScriptedCommands {
+public:
+    bool load(const std::string& path) {
+        std::ifstream file(path);
+        if (!file) { return false; }
+        std::string line;
+        while (std::getline(file, line)) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream iss(line);
+            Entry entry;
+            if (iss >> entry.delay_s >> entry.cmd) { entries_.push_back(entry); }
+        }
+        return true;
+    }
+
+    bool active() const { return next_ < entries_.size() || pending_; }
+
+    /**
+     * @return the next command once it is due, 0 otherwise
+     */
+    char poll(const CommandLatch& commands, Clock* clock) {
+        int64_t now = clock->monotonic_ns();
+        if (readyAt_ns_ < 0 && next_ < entries_.size()) { readyAt_ns_ = now + delay_ns(next_); }
+
+        if (pending_ && commands.peek() == 0) {
+            pending_ = false;
+            if (next_ < entries_.size()) { readyAt_ns_ = now + delay_ns(next_); }
+        }
+
+        if (!pending_ && next_ < entries_.size() && now >= readyAt_ns_) {
+            pending_ = true;
+            return entries_[next_++].cmd;
+        }
+        return 0;
+    }
+
+private:
+    struct Entry {
+        double delay_s = 0.0;
+        char cmd = 0;
+    };
+
+    int64_t delay_ns(size_t i) const { return int64_t(entries_[i].delay_s * 1e9); }
+
+    std::vector<Entry> entries_;
+    size_t next_ = 0;
+    int64_t readyAt_ns_ = -1;
+    bool pending_ = false;
+};
+
+/******************************************************************************************
+ * Logging
+ *****************************************************************************************/
+#define LOG_QUEUE_SIZE 4096 // frames buffered between the control loop and the log writer
+
+/**
+ * @brief Fixed size single producer / single consumer queue
+ * push() and pop() never block or allocate, a full queue rejects the item.
+ */
+template <typename T, size_t N>
+class SpscRing {
+public:
+    bool push(const T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t next = (head + 1) % N;
+        if (next == tail_.load(std::memory_order_acquire)) { return false; }
+        slots_[head] = item;
+        head_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) { return false; }
+        item = slots_[tail];
+        tail_.store((tail + 1) % N, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        return (head + N - tail) % N;
+    }
+
+private:
+    std::array<T, N> slots_;
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+};
+
+class IoPool;
+
+/**
+ * @brief Background output (log, journal, feedback) that drains its queue now and then
+ * service() runs on a thread of the task's own, or on a shared IoPool when several
+ * robots run in one process, so N robots do not bring 3N writer threads along.
+ */
+class IoTask {
+public:
+    virtual ~IoTask() {}
+
+    /**
+     * @brief Move what is queued to its destination
+     * @param final last call, everything still queued must go out
+     */
+    virtual void service(bool final) = 0;
+
+protected:
+    /**
+     * @brief Call service() every interval_ms, on the pool if given, on an own thread otherwise
+     */
+    void startService(IoPool* pool, int interval_ms);
+
+    /**
+     * @brief Run the final service() and stop, call from the destructor of the derived class
+     */
+    void stopService();
+
+    bool serviceRunning() const { return running_; }
+
+private:
+    friend class IoPool;
+    IoPool* pool_ = nullptr;
+    bool running_ = false;
+    int interval_ms_ = 1;
+    int64_t due_ns_ = 0; // next service on the pool
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+
+/**
+ * @brief Threads shared by the IoTasks of all robots of a process
+ * Every pool thread walks its tasks each millisecond and services the ones that are due.
+ * Tasks are dealt to the threads round robin as they are added.
+ */
+class IoPool {
+public:
+    explicit IoPool(int nThreads) : workers_(size_t(std::max(1, nThreads))) {
+        for (Worker& worker : workers_) { worker.thread = std::thread(&IoPool::run, this, &worker); }
+    }
+
+    // the tasks are gone by now, their owners removed them
+    ~IoPool() {
+        stopping_.store(true);
+        for (Worker& worker : workers_) { worker.thread.join(); }
+    }
+
+    int threads() const { return int(workers_.size()); }
+
+    void add(IoTask* task) {
+        Worker& worker = workers_[next_.fetch_add(1) % workers_.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(task);
+    }
+
+    /**
+     * @brief Have the task's pool thread run its final service, return once that is done
+     */
+    void remove(IoTask* task) {
+        for (Worker& worker : workers_) {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            auto listed = [&] { return std::find(worker.tasks.begin(), worker.tasks.end(), task) != worker.tasks.end(); };
+            if (!listed()) { continue; }
+            task->stopping_.store(true);
+            worker.removed.wait(lock, [&] { return !listed(); });
+            return;
+        }
+    }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable removed;
+        std::vector<IoTask*> tasks;
+        std::thread thread;
+    };
+
+    void run(Worker* worker) {
+        while (!stopping_.load()) {
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                int64_t now_ns = monotonicNs();
+                for (size_t i = 0; i < worker->tasks.size();) {
+                    IoTask* task = worker->tasks[i];
+                    if (task->stopping_.load()) {
+                        task->service(true);
+                        worker->tasks.erase(worker->tasks.begin() + i);
+                        worker->removed.notify_all();
+                        continue;
+                    }
+                    if (now_ns >= task->due_ns_) {
+                        task->service(false);
+                        task->due_ns_ = now_ns + task->interval_ms_ * 1000000LL;
+                    }
+                    i++;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    std::vector<Worker> workers_;
+    std::atomic<size_t> next_{0};
+    std::atomic<bool> stopping_{false};
+};
+
+inline void IoTask::startService(IoPool* pool, int interval_ms) {
+    pool_ = pool;
+    interval_ms_ = interval_ms;
+    running_ = true;
+    if (pool_) {
+        pool_->add(this);
+        return;
+    }
+    thread_ = std::thread([this] {
+        while (true) {
+            bool final = stopping_.load();
+            service(final);
+            if (final) { return; }
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms_));
+        }
+    });
+}
+
+inline void IoTask::stopService() {
+    if (!running_) { return; }
+    running_ = false;
+    if (pool_) {
+        pool_->remove(this);
+        return;
+    }
+    stopping_.store(true);
+    thread_.join();
+}
+
+/**
+ * @brief What a log writer did over its session
+ */
+struct LogWriterTotals {
+    uint64_t frames = 0; // frames written
+    uint64_t bytes = 0;
+    uint64_t dropped = 0;
+    int64_t busy_ns = 0; // writer time spent formatting, compressing and writing frames
+};
+
+/**
+ * @brief Writes log frames from a background thread
+ * The control loop only fills a frame and pushes it; formatting, compression and
+ * file I/O all happen on the writer thread. Frames are dropped (and counted) rather
+ * than blocking the control loop if the writer falls behind.
+ *
+ * With segmentedLog the output goes to preallocated, checksummed segment files that
+ * survive the process being killed (see log_segment.h, log_recover.cpp). On a clean
+ * stop the segments are turned into the normal log file and removed.
+ */
+class LogWriter : public IoTask {
+public:
+    /**
+     * @param path file to write
+     * @param header text header of the log (see printLogHeader)
+     * @param compressed write .bmz blocks instead of text rows
+     * @param resolutions quantization step of every log column (see logColumnResolutions)
+     * @param pool shared writer threads, nullptr for a thread of its own
+     */
+    LogWriter(const std::string& path, const std::string& header, bool compressed, const std::vector<double>& resolutions,
+        IoPool* pool = nullptr)
+        : path_(path), compressed_(compressed), queue_(new SpscRing<logcodec::Frame, LOG_QUEUE_SIZE>) {
+        if (segmentedLog) {
+            segmentBase_ = path_.substr(0, path_.rfind('.'));
+            segments_.reset(new logsegment::SegmentWriter(segmentBase_, compressed_ ? logsegment::flagCompressed : 0,
+                size_t(logSegmentSize_MB) << 20, logSyncInterval_ms));
+            if (!segments_->ok()) { std::cerr << "Failed to open log segments for " << segmentBase_ << std::endl; }
+        } else {
+            file_.open(path_, std::ios::out | std::ios::binary);
+        }
+
+        if (compressed_) {
+            encoder_.reset(new logcodec::BlockEncoder(resolutions));
+
+            std::vector<uint8_t> block;
+            logcodec::writeHeaderBlock(block, header);
+            write(block.data(), block.size());
+        } else {
+            write(header.data(), header.size());
+        }
+        lastBlock_ = std::chrono::steady_clock::now();
+        startService(pool, 5);
+    }
+
+    ~LogWriter() { stop(); }
+
+    void push(const logcodec::Frame& frame) {
+        while (!queue_->push(frame)) {
+            if (!lossless_) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    /**
+     * @brief Wait for room instead of dropping frames, for sessions on a virtual clock
+     * that produce frames faster than real time
+     */
+    void setLossless(bool lossless) { lossless_ = lossless; }
+
+    /**
+     * @brief Where stop() leaves the writer's totals once the log is closed
+     */
+    void setTotals(LogWriterTotals* totals) { totals_ = totals; }
+
+    size_t queueDepth() const { return queue_->size(); }
+    uint64_t bytesWritten() const { return bytesWritten_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Write out everything still queued and close the file
+     */
+    void stop() {
+        if (!serviceRunning()) { return; }
+        stopService();
+        if (dropped_.load() > 0) { std::cerr << "Log writer dropped " << dropped_.load() << " frames" << std::endl; }
+        if (segments_) { finalizeSegments(); }
+        if (totals_) {
+            totals_->frames = frames_;
+            totals_->bytes = bytesWritten();
+            totals_->dropped = dropped();
+            totals_->busy_ns = busy_ns_;
+        }
+    }
+
+private:
+    void write(const void* data, size_t len) {
+        bytesWritten_.store(bytesWritten_.load(std::memory_order_relaxed) + len, std::memory_order_relaxed);
+        if (segments_) {
+            segments_->append(data, len);
+        } else {
+            file_.write((const char*)data, len);
+        }
+    }
+
+public:
+    void service(bool final) override {
+        auto begin = std::chrono::steady_clock::now();
+        logcodec::Frame frame;
+        uint64_t frames = 0;
+        while (queue_->pop(frame)) {
+            if (compressed_) {
+                encoder_->add(frame);
+            } else {
+                logcodec::writeTextRow(text_, frame);
+            }
+            frames++;
+        }
+
+        // segments are only as crash safe as the data handed to them, so compressed
+        // blocks are closed at least once per sync interval in that mode
+        auto now = std::chrono::steady_clock::now();
+        bool blockDue = int(encoder_ ? encoder_->frames() : 0) >= logBlockFrames ||
+            (segments_ && now - lastBlock_ >= std::chrono::milliseconds(logSyncInterval_ms));
+        if (compressed_ && (blockDue || final)) {
+            block_.clear();
+            encoder_->finish(block_);
+            write(block_.data(), block_.size());
+            lastBlock_ = now;
+        } else if (!compressed_ && text_.tellp() > 0) {
+            std::string rows = text_.str();
+            write(rows.data(), rows.size());
+            text_.str("");
+        }
+        if (file_.is_open()) { file_.flush(); }
+        if (final && file_.is_open()) { file_.close(); }
+
+        // idle polls are left out, they say nothing about what the writer can take
+        if (frames > 0 || final) {
+            frames_ += frames;
+            busy_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        }
+    }
+
+private:
+
+    /**
+     * @brief Rebuild the normal log file from the segments after a clean stop
+     */
+    void finalizeSegments() {
+        segments_.reset();
+
+        std::ofstream out(path_, std::ios::out | std::ios::binary);
+        logsegment::RecoveryResult result;
+        bool recovered = logsegment::recover(segmentBase_, out, result);
+        out.close();
+        if (recovered && result.clean && out) {
+            logsegment::removeSegments(segmentBase_);
+        } else {
+            std::cerr << "Log segments kept for log_recover: " << result.message << std::endl;
+        }
+    }
+
+    std::string path_;
+    bool compressed_;
+    std::ofstream file_;
+    std::string segmentBase_;
+    std::unique_ptr<logsegment::SegmentWriter> segments_;
+    std::unique_ptr<SpscRing<logcodec::Frame, LOG_QUEUE_SIZE>> queue_;
+    std::unique_ptr<logcodec::BlockEncoder> encoder_;
+    bool lossless_ = false;
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> bytesWritten_{0};
+    LogWriterTotals* totals_ = nullptr;
+
+    // writer side
+    uint64_t frames_ = 0;
+    int64_t busy_ns_ = 0;
+    std::vector<uint8_t> block_;
+    std::ostringstream text_;
+    std::chrono::steady_clock::time_point lastBlock_;
+};
+
+/******************************************************************************************
+ * Feedback
+ *****************************************************************************************/
+#define FEEDBACK_QUEUE_SIZE 256 // samples buffered between the control loop and the feedback sender
+
+/**
+ * @brief Where the session is, as reported to the EEG PC
+ */
+enum class TrialState : uint8_t { init, toStart, select, ready, exercise, rest, toHome, home, done, exit };
+
+const char* trialStateName(TrialState state) {
+    switch (state) {
+        case TrialState::init: return "INIT";
+        case TrialState::toStart: return "TO_START";
+        case TrialState::select: return "SELECT";
+        case TrialState::ready: return "READY";
+        case TrialState::exercise: return "EXERCISE";
+        case TrialState::rest: return "REST";
+        case TrialState::toHome: return "TO_HOME";
+        case TrialState::home: return "HOME";
+        case TrialState::done: return "DONE";
+        default: return "EXIT";
+    }
+}
+
+/**
+ * @brief Session state at one control tick
+ */
+struct FeedbackSample {
+    int64_t mono_ns = 0;
+    TrialState state = TrialState::init;
+    int32_t trial = 0;
+    char movement = 0;
+    double progress = 0.0; // 0..1 through the current movement phase
+    double position_mm[3] = {}; // end effector of the exercising arm
+};
+
+/**
+ * @brief Sends the session state back to the EEG PC over UDP
+ * The control loop asks due() every tick and, if so, samples the end effector and
+ * pushes a sample: at feedbackRate_Hz, and at once on every state change. Samples go
+ * through a lock free queue to a sender thread, which computes the per trial metrics
+ * and sends one text datagram per sample with MSG_DONTWAIT:
+ *
+ *   BMF <seq> <mono_ns> <state> <trial> <movement> <progress> <x_mm> <y_mm> <z_mm> <path_mm> <peak_mm_s>
+ *
+ * path_mm and peak_mm_s are the hand path length and peak hand speed of the current (or
+ * last) exercise movement, accumulated sample by sample. seq counts every packet sent, so
+ * the receiver can detect losses. A full queue drops the sample, the control loop never
+ * waits on this channel.
+ */
+class FeedbackChannel : public IoTask {
+public:
+    /**
+     * @param destination "host:port", empty to follow the command sender, "off" to disable
+     * @param rate_Hz periodic samples per second
+     * @param pool shared sender threads, nullptr for a thread of its own
+     */
+    FeedbackChannel(const std::string& destination, double rate_Hz, IoPool* pool = nullptr)
+        : period_ns_(int64_t(1e9 / std::max(rate_Hz, 0.1))), queue_(new SpscRing<FeedbackSample, FEEDBACK_QUEUE_SIZE>) {
+        if (destination == "off") { return; }
+        if (!destination.empty()) {
+            size_t colon = destination.rfind(':');
+            in_addr addr;
+            if (colon == std::string::npos || inet_pton(AF_INET, destination.substr(0, colon).c_str(), &addr) != 1) {
+                std::cerr << "Bad feedback destination " << destination << ", feedback disabled" << std::endl;
+                return;
+            }
+            peerAddr_.store(addr.s_addr);
+            peerPort_.store(htons(uint16_t(std::atoi(destination.c_str() + colon + 1))));
+            followSender_ = false;
+        }
+        sockfd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sockfd_ < 0) {
+            std::cerr << "Feedback socket creation failed" << std::endl;
+            return;
+        }
+        startService(pool, 1);
+    }
 
-// UDP include
-#include <cstring>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <unistd.h>
+    ~FeedbackChannel() { stop(); }
+
+    /**
+     * @brief Remember who sent the last command, feedback goes there if no destination was given
+     * Feedback is sent over IPv4, an IPv6 sender needs an explicit destination.
+     */
+    void setSender(const in6_addr& sender) {
+        if (!followSender_ || !IN6_IS_ADDR_V4MAPPED(&sender)) { return; }
+        uint32_t addr;
+        memcpy(&addr, sender.s6_addr + 12, 4);
+        peerPort_.store(htons(FEEDBACK_PORT));
+        peerAddr_.store(addr);
+    }
 
-#define PI 3.141592653
-#define DEG_2_RAD PI / 180
-#define RAD_2_DEG 180 / PI
+    /**
+     * @brief Whether the control loop should push a sample this tick (control thread)
+     */
+    bool due(int64_t now_ns, TrialState state) const {
+        return serviceRunning() && (now_ns >= nextSample_ns_ || state != lastState_);
+    }
 
-// UDP define
-#define PORT 8080
-#define MAX_BUFFER_SIZE 1024
+    /**
+     * @brief Queue a sample for sending, never blocks (control thread)
+     */
+    void push(const FeedbackSample& sample) {
+        if (!serviceRunning()) { return; }
+        if (!queue_->push(sample)) { dropped_.fetch_add(1, std::memory_order_relaxed); }
+        lastState_ = sample.state;
+        if (sample.mono_ns >= nextSample_ns_) {
+            nextSample_ns_ += period_ns_;
+            if (nextSample_ns_ <= sample.mono_ns) { nextSample_ns_ = sample.mono_ns + period_ns_; }
+        }
+    }
 
-#define s400Stiffness_Nm_p_rad 15.0 // desired joint stiffness for series 400 [shoulder] motors(max is 50)
-#define s600Stiffness_Nm_p_rad 15.0 // desired joint stiffness for series 600 [elbow] motors (max is 30)
-#define s700Stiffness_Nm_p_rad 1.5 // desired joint stiffness for series 700 [wrist] motors(max is 3)
+    /**
+     * @brief Send what is still queued and stop the sender thread
+     */
+    void stop() {
+        if (!serviceRunning()) { return; }
+        stopService();
+        close(sockfd_);
+        if (dropped_.load() > 0) { std::cerr << "Feedback dropped " << dropped_.load() << " samples" << std::endl; }
+    }
 
-#ifdef WRIST_MODS
-#define WD_SCALING 1.0
-#define WF_SCALING 0.33
-#endif
+    void service(bool) override {
+        FeedbackSample sample;
+        char packet[256];
+        while (queue_->pop(sample)) {
+            updateMetrics(sample);
+            sockaddr_in peer;
+            memset(&peer, 0, sizeof(peer));
+            peer.sin_family = AF_INET;
+            peer.sin_addr.s_addr = peerAddr_.load();
+            peer.sin_port = peerPort_.load();
+            if (peer.sin_addr.s_addr == 0) { continue; } // nobody to send to yet
+
+            int len = snprintf(packet, sizeof(packet), "BMF %llu %lld %s %d %c %.3f %.1f %.1f %.1f %.1f %.1f\n",
+                (unsigned long long)sequence_, (long long)sample.mono_ns, trialStateName(sample.state), sample.trial,
+                sample.movement != 0 ? sample.movement : '-', sample.progress, sample.position_mm[0],
+                sample.position_mm[1], sample.position_mm[2], pathLength_mm_, peakSpeed_mm_s_);
+            sequence_++;
+            sendto(sockfd_, packet, size_t(len), MSG_DONTWAIT, (const sockaddr*)&peer, sizeof(peer));
+        }
+    }
 
-#ifdef TORSO_MODS
-#define nCols 2 * harmony::armJointCount + harmony::torsoJointCount + 1 // number of columns in dataset
-#else
-#define nCols 2 * harmony::armJointCount + 1 // number of columns in dataset
-#endif
+private:
+
+    /**
+     * @brief Accumulate path length and peak speed over the samples of an exercise movement
+     */
+    void updateMetrics(const FeedbackSample& sample) {
+        if (sample.state != TrialState::exercise) {
+            previousState_ = sample.state;
+            return;
+        }
+        if (previousState_ != TrialState::exercise) {
+            pathLength_mm_ = peakSpeed_mm_s_ = 0.0;
+        } else {
+            double dx = sample.position_mm[0] - previous_.position_mm[0];
+            double dy = sample.position_mm[1] - previous_.position_mm[1];
+            double dz = sample.position_mm[2] - previous_.position_mm[2];
+            double distance = std::sqrt(dx * dx + dy * dy + dz * dz);
+            double dt_s = (sample.mono_ns - previous_.mono_ns) * 1e-9;
+            pathLength_mm_ += distance;
+            if (dt_s > 0.0) { peakSpeed_mm_s_ = std::max(peakSpeed_mm_s_, distance / dt_s); }
+        }
+        previous_ = sample;
+        previousState_ = sample.state;
+    }
+
+    int64_t period_ns_;
+    int sockfd_ = -1;
+    bool followSender_ = true;
+    std::atomic<uint32_t> peerAddr_{0}; // network byte order, 0: no destination yet
+    std::atomic<uint16_t> peerPort_{0};
+    std::unique_ptr<SpscRing<FeedbackSample, FEEDBACK_QUEUE_SIZE>> queue_;
+
+    // control thread
+    int64_t nextSample_ns_ = 0;
+    TrialState lastState_ = TrialState::init;
+
+    // sender thread
+    uint64_t sequence_ = 0;
+    FeedbackSample previous_;
+    TrialState previousState_ = TrialState::init;
+    double pathLength_mm_ = 0.0;
+    double peakSpeed_mm_s_ = 0.0;
+
+    std::atomic<uint64_t> dropped_{0};
+};
 
-// Buffer Times 
-int ImpedenceBufferTime_s = 4;
-int startPosBufferTime_s = 5;
-int beginExBufferTime_s = 6; 
-int waitBufferTime_s = 3;
-int back2StartBufferTime_s = 2;
-int waitBufferTime2_s = waitBufferTime_s;
- 
 /******************************************************************************************
- * Structs
+ * Metrics
  *****************************************************************************************/
-struct AllArmsOverrides {
-    harmony::ArmJointsOverride leftOverrides;
-    harmony::ArmJointsOverride rightOverrides;
-#ifdef TORSO_MODS
-    harmony::TorsoJointsOverride torsoOverrides;
-#endif
+#define LATENCY_BINS 24 // latency histogram bins, bin b holds (2^(b+9), 2^(b+10)] ns
+#define UDP_SOURCES 16 // UDP senders counted separately, the rest share the last slot
+
+/**
+ * @brief Add to a counter that only one thread writes
+ * No read-modify-write instruction needed, readers on other threads just load it.
+ */
+inline void bump(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Log scale latency histogram, written by one thread and read by the scraper
+ */
+/**
+ * @brief Label set of a sample: robot="<name>" when several robots share the endpoint, plus extra
+ */
+std::string metricLabels(const std::string& robot, const std::string& extra = "") {
+    std::string labels = robot.empty() ? extra : "robot=\"" + robot + "\"" + (extra.empty() ? "" : "," + extra);
+    return labels.empty() ? "" : "{" + labels + "}";
+}
+
+class LatencyHistogram {
+public:
+    void record(int64_t ns) {
+        uint64_t v = ns > 0 ? uint64_t(ns) : 0;
+        int b = v <= 1024 ? 0 : std::min(LATENCY_BINS - 1, 64 - __builtin_clzll(v - 1) - 10);
+        bump(counts_[b]);
+        bump(sum_ns_, v);
+        bump(count_);
+        if (v > max_ns_.load(std::memory_order_relaxed)) { max_ns_.store(v, std::memory_order_relaxed); }
+    }
+
+    static void describe(std::ostream& out, const char* name, const char* help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " summary\n";
+    }
+
+    /**
+     * @brief Write the histogram as the samples of a Prometheus summary in seconds
+     * Quantiles are interpolated within their bin (and capped at the largest value seen),
+     * so they are good to a factor of 2 at worst.
+     * @param robot robot label, empty for a single robot
+     */
+    void render(std::ostream& out, const char* name, const std::string& robot) const {
+        for (double q : {0.5, 0.9, 0.99, 0.999}) {
+            std::ostringstream quantile;
+            quantile << "quantile=\"" << q << "\"";
+            out << name << metricLabels(robot, quantile.str()) << " " << quantile_ns(q) * 1e-9 << "\n";
+        }
+        out << name << "_sum" << metricLabels(robot) << " " << sum_ns_.load(std::memory_order_relaxed) * 1e-9 << "\n";
+        out << name << "_count" << metricLabels(robot) << " " << count_.load(std::memory_order_relaxed) << "\n";
+    }
+
+    /**
+     * @brief Quantile q of the recorded values [ns], same precision as render()
+     */
+    double quantile_ns(double q) const {
+        uint64_t counts[LATENCY_BINS];
+        uint64_t total = 0;
+        for (int b = 0; b < LATENCY_BINS; b++) { total += counts[b] = counts_[b].load(std::memory_order_relaxed); }
+        return std::min(quantile_s(counts, total, q) * 1e9, double(max_ns_.load(std::memory_order_relaxed)));
+    }
+
+    double mean_ns() const {
+        uint64_t count = count_.load(std::memory_order_relaxed);
+        return count > 0 ? double(sum_ns_.load(std::memory_order_relaxed)) / count : 0.0;
+    }
+    uint64_t max_ns() const { return max_ns_.load(std::memory_order_relaxed); }
+
+private:
+    static double quantile_s(const uint64_t* counts, uint64_t total, double q) {
+        if (total == 0) { return 0.0; }
+        double rank = q * total, seen = 0.0;
+        for (int b = 0; b < LATENCY_BINS; b++) {
+            if (counts[b] > 0 && seen + counts[b] >= rank) {
+                double lower = b == 0 ? 0.0 : double(1ULL << (b + 9)), upper = double(1ULL << (b + 10));
+                return (lower + (upper - lower) * (rank - seen) / counts[b]) * 1e-9;
+            }
+            seen += counts[b];
+        }
+        return double(1ULL << (LATENCY_BINS + 9)) * 1e-9;
+    }
+
+    std::atomic<uint64_t> counts_[LATENCY_BINS] = {};
+    std::atomic<uint64_t> sum_ns_{0};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> max_ns_{0};
+};
+
+/**
+ * @brief Counters of the control thread
+ */
+struct ControlMetrics {
+    std::atomic<uint64_t> ticks{0};
+    std::atomic<uint64_t> overruns{0}; // ticks that finished after the next tick's deadline
+    LatencyHistogram tickLatency; // tick deadline to end of the tick's work
+    LatencyHistogram periodError; // time between the starts of two ticks, off by how much from the period
+    LatencyHistogram commandLatency; // UDP receive of 'g' to the first override of the movement
+    LatencyHistogram readToCommand; // joint state read to override sent, every tick
+    std::atomic<uint64_t> safetyClamped{0}; // ticks where a safety limit changed the command
+    std::atomic<uint64_t> safetyHeld{0}; // ticks where the safety stage held the last safe command
+    std::atomic<int32_t> trial{0};
+    std::atomic<uint8_t> state{0};
+    // rest of the session state shown on the operator console
+    std::atomic<char> movement{0};
+    std::atomic<double> progress{0.0};
+    std::atomic<bool> paused{false};
+    std::atomic<char> side{0}; // 'l' or 'r'
+};
+
+/**
+ * @brief Address of a datagram sender, IPv4 senders as v4-mapped IPv6 addresses
+ */
+in6_addr senderAddress(const sockaddr_storage& from) {
+    in6_addr addr = {};
+    if (from.ss_family == AF_INET6) {
+        addr = ((const sockaddr_in6&)from).sin6_addr;
+    } else {
+        addr.s6_addr[10] = addr.s6_addr[11] = 0xff;
+        memcpy(addr.s6_addr + 12, &((const sockaddr_in&)from).sin_addr, 4);
+    }
+    return addr;
+}
+
+/**
+ * @brief Text form of an address, dotted quad for v4-mapped ones
+ */
+std::string formatAddress(const in6_addr& addr) {
+    char text[INET6_ADDRSTRLEN];
+    if (IN6_IS_ADDR_V4MAPPED(&addr)) {
+        inet_ntop(AF_INET, addr.s6_addr + 12, text, sizeof(text));
+    } else {
+        inet_ntop(AF_INET6, &addr, text, sizeof(text));
+    }
+    return text;
+}
+
+/**
+ * @brief Counters of the UDP thread, per sender address
+ */
+class UdpMetrics {
+public:
+    struct Source {
+        std::atomic<bool> used{false}; // set once addr is filled in
+        in6_addr addr = {}; // see senderAddress
+        std::atomic<uint64_t> received{0};
+        std::atomic<uint64_t> dropped{0}; // commands replaced before the control loop took them, or not queued
+        std::atomic<uint64_t> malformed{0};
+    };
+
+    /**
+     * @brief Counters of a sender (UDP thread only; dropped is also counted by the control loop)
+     */
+    Source& source(const in6_addr& addr) {
+        for (Source& s : sources_) {
+            if (!s.used.load(std::memory_order_relaxed)) {
+                s.addr = addr;
+                s.used.store(true, std::memory_order_release);
+                return s;
+            }
+            if (memcmp(&s.addr, &addr, sizeof(addr)) == 0) { return s; }
+        }
+        return sources_[UDP_SOURCES - 1];
+    }
+
+    static constexpr const char* counterNames[3] = {"received", "dropped", "malformed"};
+    static constexpr const char* counterHelp[3] = {"UDP packets received",
+        "UDP commands replaced before the control loop took them", "UDP packets that were not a known command"};
+
+    /**
+     * @brief Write the samples of counter k (see counterNames), one per sender
+     * @param robot robot label, empty for a single robot
+     */
+    void render(std::ostream& out, int k, const std::string& robot) const {
+        for (const Source& s : sources_) {
+            if (!s.used.load(std::memory_order_acquire)) { continue; }
+            const std::atomic<uint64_t>& counter = k == 0 ? s.received : (k == 1 ? s.dropped : s.malformed);
+            out << "bmi_udp_packets_" << counterNames[k] << "_total" << metricLabels(robot, "source=\"" + formatAddress(s.addr) + "\"")
+                << " " << counter.load(std::memory_order_relaxed) << "\n";
+        }
+    }
+
+private:
+    std::array<Source, UDP_SOURCES> sources_;
+};
+
+/**
+ * @brief Metrics of one robot of the process
+ */
+struct RobotMetrics {
+    std::string name; // robot label, empty for a single robot
+    const ControlMetrics* control;
+    const UdpMetrics* udp;
+    const LogWriter* log;
+};
+
+/**
+ * @brief Write every metric in the Prometheus text exposition format
+ * Each metric family is written once, with a sample per robot.
+ */
+void renderMetrics(std::ostream& out, const std::vector<RobotMetrics>& robots) {
+    auto family = [&](const char* name, const char* type, const char* help, auto value) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+        for (const RobotMetrics& robot : robots) { out << name << metricLabels(robot.name) << " " << value(robot) << "\n"; }
+    };
+    auto summary = [&](const char* name, const char* help, LatencyHistogram ControlMetrics::*histogram) {
+        LatencyHistogram::describe(out, name, help);
+        for (const RobotMetrics& robot : robots) { (robot.control->*histogram).render(out, name, robot.name); }
+    };
+
+    family("bmi_control_ticks_total", "counter", "Control ticks run",
+        [](const RobotMetrics& r) { return r.control->ticks.load(std::memory_order_relaxed); });
+    family("bmi_control_deadline_overruns_total", "counter", "Ticks that finished after the next deadline",
+        [](const RobotMetrics& r) { return r.control->overruns.load(std::memory_order_relaxed); });
+    summary("bmi_tick_latency_seconds", "Time from a tick's deadline to the end of its work", &ControlMetrics::tickLatency);
+    summary("bmi_tick_period_error_seconds", "Deviation of the time between tick starts from the control period",
+        &ControlMetrics::periodError);
+    summary("bmi_command_to_motion_latency_seconds", "UDP receive of a start command to the first override of the movement",
+        &ControlMetrics::commandLatency);
+    summary("bmi_read_to_command_latency_seconds", "Joint state read to override sent within a tick", &ControlMetrics::readToCommand);
+    for (int k = 0; k < 3; k++) {
+        out << "# HELP bmi_udp_packets_" << UdpMetrics::counterNames[k] << "_total " << UdpMetrics::counterHelp[k] << "\n";
+        out << "# TYPE bmi_udp_packets_" << UdpMetrics::counterNames[k] << "_total counter\n";
+        for (const RobotMetrics& robot : robots) { robot.udp->render(out, k, robot.name); }
+    }
+    family("bmi_safety_clamped_ticks_total", "counter", "Ticks where a safety limit changed the command",
+        [](const RobotMetrics& r) { return r.control->safetyClamped.load(std::memory_order_relaxed); });
+    family("bmi_safety_held_ticks_total", "counter", "Ticks where the safety stage held the last safe command",
+        [](const RobotMetrics& r) { return r.control->safetyHeld.load(std::memory_order_relaxed); });
+    family("bmi_log_queue_depth", "gauge", "Log frames waiting for the writer", [](const RobotMetrics& r) { return r.log->queueDepth(); });
+    family("bmi_log_bytes_written_total", "counter", "Bytes written to the session log",
+        [](const RobotMetrics& r) { return r.log->bytesWritten(); });
+    family("bmi_log_frames_dropped_total", "counter", "Log frames dropped because the writer fell behind",
+        [](const RobotMetrics& r) { return r.log->dropped(); });
+    family("bmi_trial", "gauge", "Current trial number", [](const RobotMetrics& r) { return r.control->trial.load(std::memory_order_relaxed); });
+    out << "# HELP bmi_phase Current session phase (1 for the active one)\n# TYPE bmi_phase gauge\n";
+    for (const RobotMetrics& robot : robots) {
+        uint8_t state = robot.control->state.load(std::memory_order_relaxed);
+        for (uint8_t k = 0; k <= uint8_t(TrialState::exit); k++) {
+            out << "bmi_phase" << metricLabels(robot.name, "phase=\"" + std::string(trialStateName(TrialState(k))) + "\"") << " "
+                << (k == state) << "\n";
+        }
+    }
+}
+
+/**
+ * @brief The robots the metrics endpoint reports on
+ * Sessions list themselves while they run (see Listing), the endpoint renders whatever
+ * is listed when it is scraped.
+ */
+class MetricsRegistry {
+public:
+    /**
+     * @brief Keeps a robot listed while it lives
+     */
+    class Listing {
+    public:
+        Listing(MetricsRegistry* registry, const RobotMetrics& robot) : registry_(registry), control_(robot.control) {
+            std::lock_guard<std::mutex> lock(registry_->mutex_);
+            registry_->robots_.push_back(robot);
+        }
+        ~Listing() {
+            std::lock_guard<std::mutex> lock(registry_->mutex_);
+            auto& robots = registry_->robots_;
+            robots.erase(std::remove_if(robots.begin(), robots.end(), [&](const RobotMetrics& r) { return r.control == control_; }),
+                robots.end());
+        }
+
+    private:
+        MetricsRegistry* registry_;
+        const ControlMetrics* control_;
+    };
+
+    void render(std::ostream& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        renderMetrics(out, robots_);
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<RobotMetrics> robots_;
+};
+
+/******************************************************************************************
+ * Input journal
+ *****************************************************************************************/
+#define INBOX_SIZE 256 // packets buffered between the UDP thread and the control loop
+#define JOURNAL_QUEUE_SIZE 1024 // records buffered between the control loop and the journal writer
+#define MAX_PACKET_BYTES 63 // longest packet kept, longer ones are truncated
+
+/**
+ * @brief One packet on its way to the control loop, from the UDP thread, a script or a journal
+ */
+struct InputPacket {
+    int64_t rx_mono_ns = 0;
+    int64_t rx_real_ns = 0;
+    UdpMetrics::Source* source = nullptr; // counters of the sender, nullptr for scripted and replayed packets
+    uint8_t length = 0;
+    char bytes[MAX_PACKET_BYTES + 1] = {};
+};
+
+using InputInbox = SpscRing<InputPacket, INBOX_SIZE>;
+
+/**
+ * @brief Parse a "p <x> <y> <z>" class probability packet
+ */
+bool parseProbabilities(const char* bytes, double p[3]) {
+    return bytes[0] == 'p' && sscanf(bytes + 1, "%lf %lf %lf", &p[0], &p[1], &p[2]) == 3;
+}
+
+/**
+ * @brief One journal entry
+ * 'R': a packet was handed to the control loop at the start of tick
+ * 'T': the control loop took a command during tick
+ */
+struct JournalRecord {
+    char type = 0;
+    uint32_t tick = 0;
+    int64_t rx_mono_ns = 0;
+    int64_t rx_real_ns = 0;
+    uint8_t length = 0;
+    char bytes[MAX_PACKET_BYTES + 1] = {};
+};
+
+/**
+ * @brief Writes the input journal of a session from a background thread
+ * The journal holds everything a session depends on besides the robot: the operator's
+ * startup answers and every packet with the control tick it was delivered at, so the
+ * session can be replayed tick for tick (see JournalReplay). Commands the loop took are
+ * journaled as well, a replay compares against them.
+ *
+ * file   : "BMJ1" | uint32 tick period [ns] | uint32 answers length | answers | record | ...
+ * record : uint8 type | uint32 tick | int64 rx_mono_ns | int64 rx_real_ns | uint8 length | bytes
+ */
+class InputJournal : public IoTask {
+public:
+    /**
+     * @param pool shared writer threads, nullptr for a thread of its own
+     */
+    InputJournal(const std::string& path, uint32_t tickPeriod_ns, const std::string& answers, IoPool* pool = nullptr)
+        : queue_(new SpscRing<JournalRecord, JOURNAL_QUEUE_SIZE>) {
+        file_.open(path, std::ios::out | std::ios::binary);
+        if (!file_) {
+            std::cerr << "Failed to open input journal " << path << std::endl;
+            return;
+        }
+        uint32_t length = uint32_t(answers.size());
+        file_.write("BMJ1", 4);
+        file_.write((const char*)&tickPeriod_ns, 4);
+        file_.write((const char*)&length, 4);
+        file_.write(answers.data(), length);
+        startService(pool, 20);
+    }
+
+    ~InputJournal() {
+        if (!serviceRunning()) { return; }
+        stopService();
+        if (dropped_.load() > 0) { std::cerr << "Input journal dropped " << dropped_.load() << " records" << std::endl; }
+    }
+
+    void received(uint32_t tick, const InputPacket& packet) {
+        JournalRecord record;
+        record.type = 'R';
+        record.tick = tick;
+        record.rx_mono_ns = packet.rx_mono_ns;
+        record.rx_real_ns = packet.rx_real_ns;
+        record.length = packet.length;
+        memcpy(record.bytes, packet.bytes, packet.length);
+        push(record);
+    }
+
+    void taken(uint32_t tick, const UdpCommand& command) {
+        JournalRecord record;
+        record.type = 'T';
+        record.tick = tick;
+        record.rx_mono_ns = command.rx_mono_ns;
+        record.rx_real_ns = command.rx_real_ns;
+        record.length = 1;
+        record.bytes[0] = command.cmd;
+        push(record);
+    }
+
+    /**
+     * @brief Wait for room instead of dropping records (virtual clock sessions)
+     */
+    void setLossless(bool lossless) { lossless_ = lossless; }
+
+private:
+    void push(const JournalRecord& record) {
+        if (!serviceRunning()) { return; }
+        while (!queue_->push(record)) {
+            if (!lossless_) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+public:
+    void service(bool final) override {
+        JournalRecord record;
+        while (queue_->pop(record)) {
+            file_.put(record.type);
+            file_.write((const char*)&record.tick, 4);
+            file_.write((const char*)&record.rx_mono_ns, 8);
+            file_.write((const char*)&record.rx_real_ns, 8);
+            file_.put(char(record.length));
+            file_.write(record.bytes, record.length);
+        }
+        file_.flush();
+        if (final) { file_.close(); }
+    }
+
+private:
+    std::ofstream file_;
+    std::unique_ptr<SpscRing<JournalRecord, JOURNAL_QUEUE_SIZE>> queue_;
+    bool lossless_ = false;
+    std::atomic<uint64_t> dropped_{0};
+};
+
+/**
+ * @brief An input journal read back to replay its session
+ * Packets are handed out at the tick they were originally delivered at. The commands
+ * the replayed session takes are compared with the journaled ones; the first
+ * difference is where the replay stopped reproducing the original session.
+ */
+class JournalReplay {
+public:
+    /**
+     * @return empty on success, otherwise what is wrong with the file
+     */
+    std::string load(const std::string& path) {
+        std::ifstream file(path, std::ios::in | std::ios::binary);
+        if (!file) { return "cannot open file"; }
+        char magic[4];
+        uint32_t length = 0;
+        if (!file.read(magic, 4) || memcmp(magic, "BMJ1", 4) != 0 || !file.read((char*)&tickPeriod_ns_, 4) ||
+            !file.read((char*)&length, 4)) {
+            return "not an input journal";
+        }
+        answers_.resize(length);
+        if (!file.read(&answers_[0], length)) { return "truncated answers"; }
+
+        JournalRecord record;
+        while (file.get(record.type)) {
+            char len = 0;
+            if (!file.read((char*)&record.tick, 4) || !file.read((char*)&record.rx_mono_ns, 8) ||
+                !file.read((char*)&record.rx_real_ns, 8) || !file.get(len) || uint8_t(len) > MAX_PACKET_BYTES ||
+                !file.read(record.bytes, uint8_t(len))) {
+                std::cerr << "Input journal " << path << " is truncated, replaying what is complete" << std::endl;
+                break;
+            }
+            record.length = uint8_t(len);
+            record.bytes[record.length] = '\0';
+            (record.type == 'R' ? received_ : taken_).push_back(record);
+        }
+        return "";
+    }
+
+    const std::string& answers() const { return answers_; }
+    uint32_t tickPeriod_ns() const { return tickPeriod_ns_; }
+    const std::vector<JournalRecord>& received() const { return received_; }
+    const std::vector<JournalRecord>& taken() const { return taken_; }
+
+    /**
+     * @brief Next packet delivered at tick, false once there is none left for it
+     */
+    bool poll(uint32_t tick, InputPacket& packet) {
+        if (next_ >= received_.size() || received_[next_].tick > tick) { return false; }
+        const JournalRecord& record = received_[next_++];
+        packet = InputPacket();
+        packet.rx_mono_ns = record.rx_mono_ns;
+        packet.rx_real_ns = record.rx_real_ns;
+        packet.length = record.length;
+        memcpy(packet.bytes, record.bytes, record.length);
+        return true;
+    }
+
+    /**
+     * @brief Check a command the replayed session took against the journal
+     */
+    void compare(uint32_t tick, const UdpCommand& command) {
+        size_t k = compared_++;
+        if (diverged_ || (k < taken_.size() && taken_[k].tick == tick && taken_[k].bytes[0] == command.cmd)) { return; }
+        diverged_ = true;
+        std::ostringstream what;
+        what << "command " << k + 1 << " taken at tick " << tick << " as '" << command.cmd << "'";
+        if (k < taken_.size()) { what << ", journal: tick " << taken_[k].tick << " '" << taken_[k].bytes[0] << "'"; }
+        divergence_ = what.str();
+    }
+
+    void report(std::ostream& out) const {
+        if (diverged_) {
+            out << "Replay diverged from the journal at " << divergence_ << std::endl;
+        } else if (compared_ < taken_.size() || next_ < received_.size()) {
+            out << "Replay ended early: " << compared_ << " of " << taken_.size() << " commands taken, "
+                << next_ << " of " << received_.size() << " packets delivered" << std::endl;
+        } else {
+            out << "Replay matched the journal: " << compared_ << " commands taken at the journaled ticks" << std::endl;
+        }
+    }
+
+private:
+    std::string answers_;
+    uint32_t tickPeriod_ns_ = 0;
+    std::vector<JournalRecord> received_;
+    std::vector<JournalRecord> taken_;
+    size_t next_ = 0;
+    size_t compared_ = 0;
+    bool diverged_ = false;
+    std::string divergence_;
+};
+
+/**
+ * @brief Hands packets to the control loop at tick boundaries
+ * Live packets come from the UDP thread through the inbox or from a command script,
+ * replayed ones from a journal. Either way they go through deliver() at the start of
+ * a tick, which also journals them, so a replay sees the same packets at the same
+ * ticks as the original session. Control thread only, apart from inbox().
+ */
+class InputRouter {
+public:
+    InputRouter(CommandLatch* commands, ClassProbabilities* probabilities)
+        : commands_(commands), probabilities_(probabilities), inbox_(new InputInbox), keys_(new InputInbox) {}
+
+    // a session can end right after taking a command, without another tick
+    ~InputRouter() {
+        recordTaken();
+        if (replay_) { replay_->report(std::cout); }
+    }
+
+    InputInbox* inbox() { return inbox_.get(); }
+    InputInbox* keys() { return keys_.get(); } // operator keys, filled by the console thread
+    void setScript(ScriptedCommands* script) { script_ = script; }
+    void setJournal(InputJournal* journal) { journal_ = journal; }
+    void setReplay(JournalReplay* replay) { replay_ = replay; }
+    uint32_t tick() const { return tick_; }
+
+    /**
+     * @brief Start the next control tick: record what the last one took, deliver what arrived
+     */
+    void nextTick(Clock* clock) {
+        recordTaken();
+        tick_++;
+
+        InputPacket packet;
+        if (replay_) {
+            while (replay_->poll(tick_, packet)) { deliver(packet); }
+            return;
+        }
+        while (inbox_->pop(packet)) { deliver(packet); }
+        while (keys_->pop(packet)) { deliver(packet); }
+        char scripted = script_ && script_->active() ? script_->poll(*commands_, clock) : 0;
+        if (scripted != 0) {
+            packet = InputPacket();
+            packet.rx_mono_ns = clock->monotonic_ns();
+            packet.rx_real_ns = clock->realtime_ns();
+            packet.length = 1;
+            packet.bytes[0] = scripted;
+            deliver(packet);
+        }
+    }
+
+private:
+    void deliver(const InputPacket& packet) {
+        if (journal_) { journal_->received(tick_, packet); }
+
+        double p[3];
+        if (parseProbabilities(packet.bytes, p)) {
+            probabilities_->publish(p[0], p[1], p[2]);
+            return;
+        }
+        UdpCommand command;
+        command.cmd = packet.bytes[0];
+        command.rx_mono_ns = packet.rx_mono_ns;
+        command.rx_real_ns = packet.rx_real_ns;
+        if (!commands_->publish(command) && packet.source != nullptr) {
+            packet.source->dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // every command taken since the last call, called at least once per tick
+    void recordTaken() {
+        for (; taken_ < commands_->taken(); taken_++) {
+            if (journal_) { journal_->taken(tick_, commands_->taken(taken_)); }
+            if (replay_) { replay_->compare(tick_, commands_->taken(taken_)); }
+        }
+    }
+
+    CommandLatch* commands_;
+    ClassProbabilities* probabilities_;
+    std::unique_ptr<InputInbox> inbox_;
+    std::unique_ptr<InputInbox> keys_;
+    ScriptedCommands* script_ = nullptr;
+    InputJournal* journal_ = nullptr;
+    JournalReplay* replay_ = nullptr;
+    uint32_t tick_ = 0;
+    uint64_t taken_ = 0;
+};
+
+/**
+ * @brief Operator answers to the startup questions
+ * Taken from startupPresets (command line or launch configuration) when given there,
+ * otherwise read from the console, or from a journal when replaying. Every answer is
+ * kept for the journal of the session.
+ */
+class StartupAnswers {
+public:
+    StartupAnswers(std::istream& in, bool echo, const std::map<std::string, std::string>& presets)
+        : in_(in), echo_(echo), presets_(presets) {}
+
+    /**
+     * @param key name of the answer in startupPresets
+     */
+    template <typename T>
+    T ask(const char* key) {
+        std::string token;
+        auto preset = presets_.find(key);
+        if (preset != presets_.end()) {
+            token = preset->second;
+        } else {
+            in_ >> token;
+        }
+        if (echo_ || preset != presets_.end()) { std::cout << token << "\n"; }
+        recorded_ += token + "\n";
+        T value{};
+        std::istringstream(token) >> value;
+        return value;
+    }
+
+    const std::string& recorded() const { return recorded_; }
+
+private:
+    std::istream& in_;
+    bool echo_;
+    const std::map<std::string, std::string>& presets_;
+    std::string recorded_;
+};
+
+/******************************************************************************************
+ * Operator console
+ *****************************************************************************************/
+#define CONSOLE_QUEUE_SIZE 64 // messages buffered between the control loop and the console
+#define CONSOLE_LINE_BYTES 128
+#define CONSOLE_POLL_MS 10 // how often the console thread looks for keys and messages
+
+/**
+ * @brief Terminal of the operator, run on its own thread
+ * The control thread never writes to the terminal. It posts messages, which are
+ * formatted into a fixed size ring and dropped if the console falls behind, and keeps
+ * ControlMetrics up to date. The console thread prints the messages and, on a terminal,
+ * redraws a status line from ControlMetrics consoleRate_Hz times per second.
+ * Operator keys are read from stdin with poll (unbuffered on a terminal):
+ *   q quits, p pauses and resumes, n skips the trial, c changes side while selecting,
+ *   x y z d g s e work as they do over UDP.
+ * They go into the key inbox of the InputRouter as one byte packets, so they reach the
+ * same command latch as UDP commands and are journaled and replayed with them.
+ * When several robots share the terminal, every console prefixes its lines with the
+ * robot name and there is neither a status line nor key input.
+ */
+class OperatorConsole {
+public:
+    /**
+     * @param keys inbox for operator keys, nullptr to leave stdin alone (e.g. on replay)
+     * @param prefix robot name put before every line, empty for the only robot
+     */
+    OperatorConsole(InputInbox* keys, Clock* clock, const ControlMetrics* metrics, const std::string& prefix = "")
+        : keys_(keys), clock_(clock), metrics_(metrics), prefix_(prefix), queue_(new SpscRing<Line, CONSOLE_QUEUE_SIZE>) {
+        statusLine_ = prefix_.empty() && isatty(STDOUT_FILENO) == 1;
+        if (keys_ && isatty(STDIN_FILENO) == 1 && tcgetattr(STDIN_FILENO, &savedTerminal_) == 0) {
+            termios raw = savedTerminal_;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            raw.c_cc[VMIN] = 1;
+            raw.c_cc[VTIME] = 0;
+            rawKeys_ = tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
+        }
+        thread_ = std::thread(&OperatorConsole::loop, this);
+    }
+
+    // prints what is still queued before returning
+    ~OperatorConsole() {
+        stopping_.store(true);
+        thread_.join();
+        if (rawKeys_) { tcsetattr(STDIN_FILENO, TCSANOW, &savedTerminal_); }
+    }
+
+    /**
+     * @brief Queue a line for the terminal, printf style. Control thread only, never blocks.
+     */
+    void post(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+        Line line;
+        va_list args;
+        va_start(args, format);
+        vsnprintf(line.text, CONSOLE_LINE_BYTES, format, args);
+        va_end(args);
+        while (!queue_->push(line)) {
+            if (!lossless_) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    /**
+     * @brief Wait for room instead of dropping messages (virtual clock sessions)
+     */
+    void setLossless(bool lossless) { lossless_ = lossless; }
+
+private:
+    struct Line {
+        char text[CONSOLE_LINE_BYTES];
+    };
+
+    void loop() {
+        int64_t redraw_ns = int64_t(1e9 / consoleRate_Hz);
+        int64_t nextRedraw_ns = monotonicNs();
+        bool reading = keys_ != nullptr;
+        while (true) {
+            bool stopping = stopping_.load();
+            struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+            if (!stopping && reading && poll(&pfd, 1, CONSOLE_POLL_MS) > 0) {
+                reading = readKeys();
+            } else if (!stopping && !reading) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(CONSOLE_POLL_MS));
+            }
+
+            Line line;
+            bool printed = false;
+            while (queue_->pop(line)) {
+                std::lock_guard<std::mutex> lock(terminalMutex());
+                if (statusLine_ && !printed) { std::cout << "\r\033[K"; }
+                if (!prefix_.empty()) { std::cout << "[" << prefix_ << "] "; }
+                std::cout << line.text << "\n";
+                printed = true;
+            }
+            if (stopping) {
+                std::lock_guard<std::mutex> lock(terminalMutex());
+                if (statusLine_) { std::cout << "\r\033[K"; }
+                uint64_t dropped = dropped_.load();
+                if (dropped > 0) { std::cout << (prefix_.empty() ? "" : "[" + prefix_ + "] ") << dropped << " console messages dropped" << std::endl; }
+                std::cout.flush();
+                return;
+            }
+            if (statusLine_ && (printed || monotonicNs() >= nextRedraw_ns)) {
+                renderStatus();
+                nextRedraw_ns = monotonicNs() + redraw_ns;
+            } else if (printed) {
+                std::cout.flush();
+            }
+        }
+    }
+
+    // false once stdin is closed
+    bool readKeys() {
+        char buffer[16];
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n <= 0) { return false; }
+        for (ssize_t i = 0; i < n; i++) {
+            char command = buffer[i] == 'q' ? 'e' : buffer[i];
+            if (strchr(COMMAND_CHARS, command) == nullptr) { continue; }
+            InputPacket packet;
+            packet.rx_mono_ns = clock_->monotonic_ns();
+            packet.rx_real_ns = clock_->realtime_ns();
+            packet.length = 1;
+            packet.bytes[0] = command;
+            keys_->push(packet);
+        }
+        return true;
+    }
+
+    void renderStatus() {
+        char movement = metrics_->movement.load(std::memory_order_relaxed);
+        char side = metrics_->side.load(std::memory_order_relaxed);
+        char text[160];
+        snprintf(text, sizeof(text), "\r\033[Ktrial %d | %s %c %3.0f%%%s | side %c | read->cmd %.1f us, tick late max %.2f ms, %llu overruns",
+            metrics_->trial.load(std::memory_order_relaxed),
+            trialStateName(TrialState(metrics_->state.load(std::memory_order_relaxed))),
+            movement != 0 ? movement : '-', 100.0 * metrics_->progress.load(std::memory_order_relaxed),
+            metrics_->paused.load(std::memory_order_relaxed) ? " | PAUSED (p resumes)" : "",
+            side != 0 ? side : '-', metrics_->readToCommand.mean_ns() / 1000.0, metrics_->tickLatency.max_ns() / 1e6,
+            (unsigned long long)metrics_->overruns.load(std::memory_order_relaxed));
+        std::cout << text;
+        std::cout.flush();
+    }
+
+    // keeps the lines of the consoles of several robots whole
+    static std::mutex& terminalMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    InputInbox* keys_;
+    Clock* clock_;
+    const ControlMetrics* metrics_;
+    std::string prefix_;
+    std::unique_ptr<SpscRing<Line, CONSOLE_QUEUE_SIZE>> queue_;
+    std::atomic<uint64_t> dropped_{0};
+    bool lossless_ = false;
+    bool statusLine_ = false;
+    bool rawKeys_ = false;
+    termios savedTerminal_;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
 };
 
 /**
@@ -90,11 +2263,12 @@ void printStart(double fs) {
 
 std::string getCurrentDateTime() {
     std::time_t now = std::time(nullptr);
-    std::tm* ptm = std::localtime(&now);
+    std::tm tm;
+    localtime_r(&now, &tm); // robots of one process start their sessions concurrently
 
     std::stringstream ss;
-    // ss << std::put_time(ptm, "%Y-%m-%d_%H-%M-%S");
-    ss << std::put_time(ptm, "%Y_%m_%d");
+    // ss << std::put_time(&tm, "%Y-%m-%d_%H-%M-%S");
+    ss << std::put_time(&tm, "%Y_%m_%d");
     return ss.str();
 }
 
@@ -103,11 +2277,12 @@ std::string getCurrentDateTime() {
  * The first line of the log file is the sampling frequency,
  * the second line is the column names
  * the nth line is the nth recorded joint position vector with
- * respect to time
- * @param logFile the ofstream object for the file to be written
+ * respect to time. Torso joints, if driven, follow the end effector columns.
+ * @param logFile the stream the header is written to
  * @param fs the sampling frequency in Hz
  */
-void printLogHeader(std::ofstream* logFile, double fs) {
+template <class Config>
+void printLogHeader(std::ostream* logFile, double fs) {
     *logFile << "TIME\tITERATION\tMOV\tTRIGGER";
     for (int i=0; i<harmony::armJointCount; i++){ *logFile << "\tleft_j" << i;  }
     for (int i=0; i<harmony::armJointCount; i++){ *logFile << "\tright_j" << i; }
@@ -117,23 +2292,40 @@ void printLogHeader(std::ofstream* logFile, double fs) {
     *logFile << "\tr_end_pos_x";
     *logFile << "\tr_end_pos_y";
     *logFile << "\tr_end_pos_z";
+    for (int i=0; i<Config::torsoJoints; i++){ *logFile << "\ttorso_j" << i; }
+    for (const char* channel : {"v", "tau"}) {
+        for (int i=0; i<harmony::armJointCount; i++){ *logFile << "\tleft_" << channel << i; }
+        for (int i=0; i<harmony::armJointCount; i++){ *logFile << "\tright_" << channel << i; }
+        for (int i=0; i<Config::torsoJoints; i++){ *logFile << "\ttorso_" << channel << i; }
+    }
+    *logFile << "\tMONO_NS\tREALTIME_NS\tRX_MONO_NS\tRX_REALTIME_NS";
     *logFile << "\n";
-
-#ifdef TORSO_MODS
-    for (int i=0; i<harmony::torsoJointCount; i++){ *logFile << "torso_j" << i << ", "; }
-#endif
     *logFile << std::endl;
 }
 
+/**
+ * @brief Quantization step of every log column in the compressed log, in header order
+ */
+template <class Config>
+std::vector<double> logColumnResolutions() {
+    std::vector<double> resolutions(2 * Config::armJoints, logJointResolution_deg);
+    for (int i = 0; i < 6; i++) { resolutions.push_back(logPoseResolution_mm); }
+    for (int i = 0; i < Config::torsoJoints; i++) { resolutions.push_back(logJointResolution_deg); }
+    resolutions.resize(resolutions.size() + 2 * Config::armJoints + Config::torsoJoints, logVelocityResolution_deg_s);
+    resolutions.resize(resolutions.size() + 2 * Config::armJoints + Config::torsoJoints, logTorqueResolution_Nm);
+    return resolutions;
+}
+
 
 /**
  * @brief Convert a given file prefix to a log filename, including path.
- *  Makes all files end in a '-log.txt'
+ *  Makes all files end in a '_log.txt' ('_log.bmz' for compressed logs)
  * @param filePrefix the desired file prefix
+ * @param extension file extension, including the dot
  * @return std::string logfilename
  */
-std::string filepath(std::string filePrefix) {
-    return "./log/" + filePrefix + "_log.txt";
+std::string filepath(std::string filePrefix, std::string extension = ".txt") {
+    return "./log/" + filePrefix + "_log" + extension;
 }
 
 // /**
@@ -156,50 +2348,56 @@ std::string filepath(std::string filePrefix) {
 //     }
 // }
 
-// Function to save data in the log file
-void saveDataInLogFile(std::ofstream* logFile, harmony::ResearchInterface* info, int iteration, char movement, std::string trigger_type) {
-    // Continuously write data to the log file
-    // while (true) {
-        // Get the current timestamp
-
-        std::array<harmony::JointState, harmony::armJointCount> states_left =  info->joints().leftArm.getOrderedStates();
-        std::array<harmony::JointState, harmony::armJointCount> states_right =  info->joints().rightArm.getOrderedStates();
-        harmony::Pose pose_left = info->poses().leftEndEffector;
-        harmony::Pose pose_right = info->poses().rightEndEffector; 
-
-        using namespace std::chrono;
-
-        // auto now = std::chrono::system_clock::now();
-        // date::format("%T", std::chrono::floor<std::chrono::milliseconds>(now));
-        auto now = std::chrono::system_clock::now();
-        auto timePoint = std::chrono::system_clock::to_time_t(now);
-        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) % 1000;
-        std::tm* timeinfo = std::localtime(&timePoint);
-
-        *logFile << std::put_time(timeinfo, "%H:%M:%S") << "." << std::setfill('0') << std::setw(3) << ms.count() << "\t" << iteration <<"\t" << movement << "\t" << trigger_type;
-
-        // Generate some sample data to save in the log file
-        for (int i = 0; i < harmony::armJointCount; i++) { *logFile << "\t" << states_left[i].position_rad * RAD_2_DEG;}
-        for (int i = 0; i < harmony::armJointCount; i++) { *logFile << "\t" << states_right[i].position_rad * RAD_2_DEG;}
-        *logFile << "\t" << pose_left.position_mm.x;
-        *logFile << "\t" << pose_left.position_mm.y;
-        *logFile << "\t" << pose_left.position_mm.z;
-        
-        *logFile << "\t" << pose_right.position_mm.x;
-        *logFile << "\t" << pose_right.position_mm.y;
-        *logFile << "\t" << pose_right.position_mm.z;
-        *logFile << "\n";
-
-        *logFile << std::endl;
-
-        // std::string data = "Sample data " + states[i].position_rad * RAD_2_DEG;
-
-        // Save the data in the log file
-        // logFile << timestampStr << " - " << data << std::endl;
-
-        // Sleep for some time (e.g., 1 second)
-        // std::this_thread::sleep_for(std::chrono::seconds(1));
-    // }
+/**
+ * @brief Log one row of joint and end effector data
+ * Every row carries the monotonic and realtime clock at which it was sampled. Rows
+ * written for a UDP command (START, STOP, SELECT, EXIT) also carry the kernel receive
+ * time of that command, so command -> override latency can be computed offline.
+ * Joint velocities [deg/s] and filtered torques [Nm] come from the last filter update.
+ * The row is only sampled here, the log writer thread formats and writes it.
+ * @param command the command this row reacts to, nullptr for periodic rows
+ */
+template <class Config>
+void saveDataInLogFile(LogWriter* logWriter, harmony::ResearchInterface* info, const JointFilter<Config>* filter, Clock* clock, int iteration, char movement, logcodec::Trigger trigger_type, const UdpCommand* command = nullptr) {
+    RtScope rt;
+    logcodec::Frame frame;
+    frame.mono_ns = clock->monotonic_ns();
+    frame.real_ns = clock->realtime_ns();
+    if (command != nullptr) {
+        frame.rx_mono_ns = command->rx_mono_ns;
+        frame.rx_real_ns = command->rx_real_ns;
+    }
+    frame.iteration = iteration;
+    frame.movement = movement;
+    frame.trigger = trigger_type;
+    frame.nColumns = Config::nLogCols;
+
+    auto joints = info->joints();
+    std::array<harmony::JointState, harmony::armJointCount> states_left = joints.leftArm.getOrderedStates();
+    std::array<harmony::JointState, harmony::armJointCount> states_right = joints.rightArm.getOrderedStates();
+    harmony::Pose pose_left = info->poses().leftEndEffector;
+    harmony::Pose pose_right = info->poses().rightEndEffector; 
+
+    double* column = frame.columns;
+    for (int i = 0; i < harmony::armJointCount; i++) { *column++ = states_left[i].position_rad * RAD_2_DEG; }
+    for (int i = 0; i < harmony::armJointCount; i++) { *column++ = states_right[i].position_rad * RAD_2_DEG; }
+    *column++ = pose_left.position_mm.x;
+    *column++ = pose_left.position_mm.y;
+    *column++ = pose_left.position_mm.z;
+    *column++ = pose_right.position_mm.x;
+    *column++ = pose_right.position_mm.y;
+    *column++ = pose_right.position_mm.z;
+    if constexpr (Config::hasTorso) {
+        auto states_torso = joints.torso.getOrderedStates();
+        for (int i = 0; i < Config::torsoJoints; i++) { *column++ = states_torso[i].position_rad * RAD_2_DEG; }
+    }
+    // velocity and torque channels are in data line order: left, right, torso
+    const typename Config::DataLine& velocity = filter->velocity();
+    const typename Config::DataLine& torque = filter->torque();
+    for (int i = 1; i < Config::nCols; i++) { *column++ = velocity[i] * RAD_2_DEG; }
+    for (int i = 1; i < Config::nCols; i++) { *column++ = torque[i]; }
+
+    logWriter->push(frame);
 }
 
 
@@ -233,14 +2431,12 @@ void saveDataInLogFile(std::ofstream* logFile, harmony::ResearchInterface* info,
  * @return true if the user hits [0]
  * @return false if the user hits [1]
  */
-bool setSideChoice() {
-
-    char usr_input[6];
+bool setSideChoice(StartupAnswers& answers) {
 
     std::cout << "Choose the side you want to exercise with!\n";
     std::cout << "r : RIGHT arm, l : LEFT arm!\n";
 
-    std::cin >> usr_input;
+    std::string usr_input = answers.ask<std::string>("side");
 
     bool startRecording;
 
@@ -295,16 +2491,15 @@ bool setSideChoice() {
  * @brief returns the desired joint position for home mode
  */
 
-std::array<double, nCols> setHomePosition(harmony::ResearchInterface* info) {
-    std::array<double, nCols> data;
-
-    // // std::array<double, nCols> homepositionRight_array = {0, 0, 0, 30, 45, -90, 40};
-    // // std::array<double, nCols> homepositionLeft_array = {0, 0, 0, -30, -45, 90, -40};
+template <class Config>
+typename Config::DataLine setHomePosition(harmony::ResearchInterface* info) {
+    typename Config::DataLine data{};
 
-    std::array<double, nCols> homepositionRight_array = {6.3, -2.2, -8, -6, -30, -114, 10};
-    std::array<double, nCols> homepositionLeft_array = {-6.3, 2.2, 8, 6, 30, 114, -10};
+    // // std::array<double, harmony::armJointCount> homepositionRight_array = {0, 0, 0, 30, 45, -90, 40};
+    // // std::array<double, harmony::armJointCount> homepositionLeft_array = {0, 0, 0, -30, -45, 90, -40};
 
-    data[0] = 0.0;
+    std::array<double, harmony::armJointCount> homepositionRight_array = {6.3, -2.2, -8, -6, -30, -114, 10};
+    std::array<double, harmony::armJointCount> homepositionLeft_array = {-6.3, 2.2, 8, 6, 30, 114, -10};
 
     for (int i = 0; i < harmony::armJointCount; i++) {
         data[i + 1] = DEG_2_RAD * homepositionLeft_array[i];
@@ -320,11 +2515,12 @@ std::array<double, nCols> setHomePosition(harmony::ResearchInterface* info) {
  * @brief returns the desired joint position for home mode
  */
 
-std::array<double, nCols> setSideArmActive(harmony::ResearchInterface* info, bool side) {
-    std::array<double, nCols> data;
+template <class Config>
+typename Config::DataLine setSideArmActive(harmony::ResearchInterface* info, bool side) {
+    typename Config::DataLine data{};
 
-    std::array<double, nCols> homepositionRight_array;
-    std::array<double, nCols> homepositionLeft_array;
+    std::array<double, harmony::armJointCount> homepositionRight_array;
+    std::array<double, harmony::armJointCount> homepositionLeft_array;
 
     if (side == true) {
         // RIGHT side
@@ -336,8 +2532,6 @@ std::array<double, nCols> setSideArmActive(harmony::ResearchInterface* info, boo
         homepositionLeft_array = {-6.3, 2.2, 8, 6, 30, 114, -10}; // home position
     }
 
-    data[0] = 0.0;
-
     for (int i = 0; i < harmony::armJointCount; i++) {
         data[i + 1] = DEG_2_RAD * homepositionLeft_array[i];
     }
@@ -352,11 +2546,12 @@ std::array<double, nCols> setSideArmActive(harmony::ResearchInterface* info, boo
  * @brief returns the desired joint position for execise mode
  */
 
-std::array<double, nCols> setEndPoint2(harmony::ResearchInterface* info, bool side, char movement) {
-    std::array<double, nCols> data;
+template <class Config>
+typename Config::DataLine setEndPoint2(harmony::ResearchInterface* info, bool side, char movement) {
+    typename Config::DataLine data{};
 
-    std::array<double, nCols> endpointRight_array;
-    std::array<double, nCols> endpointLeft_array;
+    std::array<double, harmony::armJointCount> endpointRight_array{};
+    std::array<double, harmony::armJointCount> endpointLeft_array{};
 
     if (side == true) {
         // RIGHT side
@@ -389,8 +2584,6 @@ std::array<double, nCols> setEndPoint2(harmony::ResearchInterface* info, bool si
         for(int i = 0; i < harmony::armJointCount; i++){endpointLeft_array[i] = endpointLeft_array[i] * RAD_2_DEG;} 
     }
 
-    data[0] = 0.0;
-
     for (int i = 0; i < harmony::armJointCount; i++) {
         data[i + 1] = DEG_2_RAD * endpointLeft_array[i];
         // data[i + 1] = endpointLeft_array[i];
@@ -405,134 +2598,336 @@ std::array<double, nCols> setEndPoint2(harmony::ResearchInterface* info, bool si
 
 
 /**
- * @brief returns the desired joint stiffness based on the actuator type
- * Joints <5 are all series 400, joint 5 is the elbow series 500, and
- * joint 6 is the wrist series 700 joint.
- * @param joint_idx current index for joint
- * @return double the desired joint stiffness
- */
-double jointStiffness(int joint_idx) {
-    double stiffness;
-    harmony::ArmJoint joint = harmony::ArmJoint(joint_idx);
-
-    switch (joint) {
-        case harmony::ArmJoint::elbowFlexion:
-            stiffness = s600Stiffness_Nm_p_rad;
-            break;
-        case harmony::ArmJoint::wristPronation:
-            stiffness = s700Stiffness_Nm_p_rad;
-            break;
-#ifdef WRIST_MODS
-        case harmony::ArmJoint::wristAbduction:
-            stiffness = WD_SCALING * s700Stiffness_Nm_p_rad;
-            break;
-        case harmony::ArmJoint::wristFlexion:
-            stiffness = WF_SCALING * s700Stiffness_Nm_p_rad;
-            break;
-#endif
-        default:
-            stiffness = s400Stiffness_Nm_p_rad;
-            break;
+ * @brief Takes a data array and converts it to override format
+ *
+ * @param data read data line from log file, parsed to array
+ * @param stiffness per joint stiffness, same layout as data
+ * @return AllArmsOverrides studt containing left, right and torso overrides
+ */
+template <class Config>
+AllArmsOverrides<Config> data2override(const typename Config::DataLine& data, const typename Config::DataLine& stiffness) {
+    std::array<harmony::JointOverride, harmony::armJointCount> leftOverrides;
+    std::array<harmony::JointOverride, harmony::armJointCount> rightOverrides;
+    UNROLL
+    for (int i = 0; i < Config::armJoints; i++) {
+        leftOverrides[i] = {data[i + Config::leftOffset], stiffness[i + Config::leftOffset]};
+        rightOverrides[i] = {data[i + Config::rightOffset], stiffness[i + Config::rightOffset]};
     }
 
-    return stiffness;
-}
-
-/**
- * @brief returns the desired joint stiffness based on the actuator type
- * Joints <5 are all series 400, joint 5 is the elbow series 500, and
- * joint 6 is the wrist series 700 joint.
- * @param joint_idx current index for joint
- * @param scaling is used to indirectly control the stiffnesses
- * @return double the desired joint stiffness
- */
-double jointStiffness(int joint_idx, double scaling) {
-    double stiffness;
-    harmony::ArmJoint joint = harmony::ArmJoint(joint_idx);
-
-    switch (joint) {
-        case harmony::ArmJoint::elbowFlexion:
-            stiffness = s600Stiffness_Nm_p_rad * scaling;
-            break;
-        case harmony::ArmJoint::wristPronation:
-            stiffness = s700Stiffness_Nm_p_rad * scaling;
-            break;
-#ifdef WRIST_MODS
-        case harmony::ArmJoint::wristAbduction:
-            stiffness = WD_SCALING * s700Stiffness_Nm_p_rad * scaling;
-            break;
-        case harmony::ArmJoint::wristFlexion:
-            stiffness = WF_SCALING * s700Stiffness_Nm_p_rad * scaling;
-            break;
-#endif
-        default:
-            stiffness = s400Stiffness_Nm_p_rad;
-            break;
+    if constexpr (Config::hasTorso) {
+        std::array<harmony::JointOverride, harmony::torsoJointCount> torsoOverrides;
+        UNROLL
+        for (int i = 0; i < Config::torsoJoints; i++) {
+            torsoOverrides[i] = {data[i + Config::torsoOffset], stiffness[i + Config::torsoOffset]};
+        }
+        return {harmony::ArmJointsOverride(leftOverrides), harmony::ArmJointsOverride(rightOverrides),
+            harmony::TorsoJointsOverride(torsoOverrides)};
+    } else {
+        return {harmony::ArmJointsOverride(leftOverrides), harmony::ArmJointsOverride(rightOverrides), NoTorsoOverrides()};
     }
-
-    return stiffness;
 }
 
 /**
- * @brief Takes a data array and converts it to override format
+ * @brief Per joint stiffness for every control tick: smooth ramp up, then assist as needed
+ * After start() the stiffness of every joint rises from 0 to its nominal value
+ * (Config::stiffness) along a smoothstep over the ramp time. Once ramped, each joint
+ * adapts its own stiffness multiplier m every tick:
  *
- * @param data read data line from log file, parsed to array
- * @return AllArmsOverrides studt containing left and right overrides
+ *   dm/dt = aanErrorGain |e| - aanRelaxRate (m - 1) - aanEffortGain effort (m - aanFloorFraction)
+ *
+ * e is the tracking error (last command - measured position) and effort the joint
+ * torque not explained by the spring (|torque| - k |e|), i.e. what the patient adds.
+ * The patient struggling raises stiffness, the patient working lowers it, and it
+ * relaxes back to nominal otherwise. Stiffness never exceeds the series limit.
+ * Fixed size arrays only, no allocation, well under a microsecond per tick.
  */
-AllArmsOverrides data2override(std::array<double, nCols> data) {
-    std::array<harmony::JointOverride, harmony::armJointCount> leftOverrides;
-    std::array<harmony::JointOverride, harmony::armJointCount> rightOverrides;
-    for (int i = 0; i < harmony::armJointCount; i++) {
-        leftOverrides[i] = {data[i + 1], jointStiffness(i)};
-        rightOverrides[i] = {data[i + harmony::armJointCount + 1], jointStiffness(i)};
+template <class Config>
+class ImpedanceEngine {
+public:
+    using DataLine = typename Config::DataLine;
+
+    ImpedanceEngine() {
+        floor_.fill(aanFloorFraction);
+        floor_[0] = 0.0;
+        scale_.fill(1.0);
+        compliance_.fill(1.0);
+        stiffness_.fill(0.0);
+        previousCommand_.fill(0.0);
     }
 
-#ifdef TORSO_MODS
-    std::array<harmony::JointOverride, harmony::torsoJointCount> torsoOverrides;
-    for (int i = 0; i < harmony::torsoJointCount; i++) {
-        torsoOverrides[i] = {data[i + harmony::armJointCount * 2 + 1], jointStiffness(i)};
+    /**
+     * @brief Restart the ramp from zero stiffness
+     * @param rampTime_s time to reach nominal stiffness
+     */
+    void start(double rampTime_s) {
+        rampTime_s_ = rampTime_s;
+        elapsed_s_ = 0.0;
+        scale_.fill(1.0);
+        started_ = false;
     }
-#endif
 
-    return {harmony::ArmJointsOverride(leftOverrides),
-        harmony::ArmJointsOverride(rightOverrides)
-#ifdef TORSO_MODS
-            ,
-        harmony::TorsoJointsOverride(torsoOverrides)
-#endif
-    };
-}
+    /**
+     * @brief Scale the stiffness of individual joints, e.g. to let a therapist guide an arm
+     * @param compliance per joint factor on the stiffness, same layout as a data line
+     */
+    void setCompliance(const DataLine& compliance) { compliance_ = compliance; }
+
+    /**
+     * @brief Compute the stiffness to send with command
+     * @param command joint positions about to be sent
+     * @param position measured joint positions
+     * @param torque measured joint torques
+     * @param dt_s time since the previous update
+     * @return per joint stiffness, same layout as command
+     */
+    const DataLine& update(const DataLine& command, const DataLine& position, const DataLine& torque, double dt_s) {
+        if (!started_) {
+            previousCommand_ = position;
+            started_ = true;
+        }
+
+        elapsed_s_ += dt_s;
+        double ramp = 1.0;
+        if (elapsed_s_ < rampTime_s_) {
+            double x = elapsed_s_ / rampTime_s_;
+            ramp = x * x * (3.0 - 2.0 * x);
+        }
+
+        constexpr const DataLine& nominal = Config::stiffness;
+        constexpr const DataLine& maximum = Config::maxStiffness;
+        bool adapt = adaptiveImpedance && ramp >= 1.0;
+        UNROLL
+        for (int i = 1; i < Config::nCols; i++) {
+            if (adapt) {
+                double error = std::fabs(previousCommand_[i] - position[i]);
+                double effort = std::fmax(0.0, std::fabs(torque[i]) - stiffness_[i] * error);
+                double dm = aanErrorGain * error - aanRelaxRate * (scale_[i] - 1.0) - aanEffortGain * effort * (scale_[i] - floor_[i]);
+                scale_[i] = std::fmin(std::fmax(scale_[i] + dm * dt_s, floor_[i]), maximum[i] / nominal[i]);
+            }
+            stiffness_[i] = ramp * scale_[i] * nominal[i] * compliance_[i];
+        }
+
+        previousCommand_ = command;
+        return stiffness_;
+    }
+
+    const DataLine& stiffness() const { return stiffness_; }
+
+private:
+    DataLine floor_;
+    DataLine scale_;
+    DataLine compliance_;
+    DataLine stiffness_;
+    DataLine previousCommand_;
+    double rampTime_s_ = 0.0;
+    double elapsed_s_ = 0.0;
+    bool started_ = false;
+};
+
+#define WS_BINS 32 // workspace table resolution per joint axis
 
 /**
- * @brief Takes a data array and converts it to override format
+ * @brief Checks and limits every command before it is sent to the motors
+ * Runs each tick between trajectory generation and setJointsOverride:
+ *  1. non finite commands are rejected
+ *  2. per tick acceleration and velocity are clamped, then joint position limits
+ *  3. the hand of each arm is checked against the workspace box
+ * Joint limits are clamped; a non finite command or a hand outside the workspace
+ * makes the stage hold the last safe command instead.
  *
- * @param data read data line from log file, parsed to array
- * @param scaling indirectly controlls impedence values
- * @return AllArmsOverrides studt containing left and right overrides
+ * The velocity and acceleration limits start at maxJointVelocity_rad_s and
+ * maxJointAcceleration_rad_s2 and are raised at startup to keep safetyMoveMargin above
+ * every move the program plans (allowMove, allowPath), so a session that goes as
+ * planned is never limited and a clamped tick always means a command went astray.
+ *
+ * The workspace check never runs kinematics in the loop. The constructor evaluates a
+ * coarse two link arm model (upperArmLength_mm, forearmLength_mm) over a WS_BINS^3 grid
+ * of shoulder abduction, shoulder flexion and elbow flexion, and the tick only indexes
+ * that table. The left arm is the sign mirror of the right one and shares the table.
+ * If one of the poses this program drives to falls outside the table (verifyPose), the
+ * model does not fit the robot and the session refuses to start.
+ *
+ * Every tick does the same fixed amount of work on fixed size arrays (branch free
+ * min/max loops the compiler vectorizes), so its cost is bounded at well below a
+ * microsecond.
  */
-AllArmsOverrides data2override(std::array<double, nCols> data, double scaling) {
-    std::array<harmony::JointOverride, harmony::armJointCount> leftOverrides;
-    std::array<harmony::JointOverride, harmony::armJointCount> rightOverrides;
-    for (int i = 0; i < harmony::armJointCount; i++) {
-        leftOverrides[i] = {data[i + 1], jointStiffness(i, scaling)};
-        rightOverrides[i] = {data[i + harmony::armJointCount + 1], jointStiffness(i, scaling)};
+template <class Config>
+class SafetyStage {
+public:
+    using DataLine = typename Config::DataLine;
+
+    SafetyStage() : maxVelocity_(maxJointVelocity_rad_s), maxAcceleration_(maxJointAcceleration_rad_s2), workspaceEnabled_(workspaceCheck) {
+        double dt_s = 1.0 / 200.0;
+        setTickPeriod(dt_s);
+        buildWorkspaceTable();
+        previous_.fill(0.0);
+        previous2_.fill(0.0);
+        safe_.fill(0.0);
     }
 
-#ifdef TORSO_MODS
-    std::array<harmony::JointOverride, harmony::torsoJointCount> torsoOverrides;
-    for (int i = 0; i < harmony::torsoJointCount; i++) {
-        torsoOverrides[i] = {data[i + harmony::armJointCount * 2 + 1], jointStiffness(i, scaling)};
+    void setTickPeriod(double dt_s) {
+        dt_s_ = dt_s;
+        maxStep_ = maxVelocity_ * dt_s;
+        maxStepChange_ = maxAcceleration_ * dt_s * dt_s;
     }
-#endif
 
-    return {harmony::ArmJointsOverride(leftOverrides),
-        harmony::ArmJointsOverride(rightOverrides)
-#ifdef TORSO_MODS
-            ,
-        harmony::TorsoJointsOverride(torsoOverrides)
-#endif
-    };
-}
+    /**
+     * @brief Raise the limits to cover a minimum jerk move between two poses at rest
+     * A move over distance d in T s peaks at 1.875 d/T rad/s and 5.77 d/T^2 rad/s^2.
+     */
+    void allowMove(const DataLine& from, const DataLine& to, double duration_s) {
+        double distance = 0.0;
+        for (int i = 1; i < Config::nCols; i++) { distance = std::max(distance, std::fabs(to[i] - from[i])); }
+        raiseLimits(1.875 * distance / duration_s, 5.7735 * distance / (duration_s * duration_s));
+    }
+
+    /**
+     * @brief Raise the limits to cover a path sampled at the tick period
+     */
+    void allowPath(const std::vector<DataLine>& poses) {
+        double velocity = 0.0, acceleration = 0.0;
+        for (size_t k = 1; k < poses.size(); k++) {
+            for (int i = 1; i < Config::nCols; i++) {
+                double step = poses[k][i] - poses[k - 1][i];
+                velocity = std::max(velocity, std::fabs(step) / dt_s_);
+                if (k > 1) { acceleration = std::max(acceleration, std::fabs(step - (poses[k - 1][i] - poses[k - 2][i])) / (dt_s_ * dt_s_)); }
+            }
+        }
+        raiseLimits(velocity, acceleration);
+    }
+
+    double maxVelocity() const { return maxVelocity_; }
+    double maxAcceleration() const { return maxAcceleration_; }
+
+    /**
+     * @brief Check that a pose used by the program lies inside the workspace table
+     * @return false if the workspace check is on and would hold the pose back
+     */
+    bool verifyPose(const DataLine& pose) const {
+        return !workspaceEnabled_ || (insideWorkspace(pose, Config::leftOffset, -1.0) && insideWorkspace(pose, Config::rightOffset, 1.0));
+    }
+
+    /**
+     * @brief Limit a command
+     * @param command joint positions from the trajectory
+     * @param measured measured joint positions, used to seed the limiter on the first call
+     * @return the command to send
+     */
+    const DataLine& apply(const DataLine& command, const DataLine& measured) {
+        if (!seeded_) {
+            previous_ = previous2_ = safe_ = measured;
+            seeded_ = true;
+        }
+
+        constexpr const DataLine& limit = Config::limit_rad;
+        double finite = 0.0;
+        bool clamped = false;
+        UNROLL
+        for (int i = 1; i < Config::nCols; i++) {
+            finite += command[i] - command[i]; // NaN or inf poisons the sum
+            double lastStep = previous_[i] - previous2_[i];
+            double step = command[i] - previous_[i];
+            step = std::fmin(std::fmax(step, lastStep - maxStepChange_), lastStep + maxStepChange_);
+            step = std::fmin(std::fmax(step, -maxStep_), maxStep_);
+            double limited = std::fmin(std::fmax(previous_[i] + step, -limit[i]), limit[i]);
+            clamped |= limited != command[i];
+            candidate_[i] = limited;
+        }
+        candidate_[0] = command[0];
+
+        bool inside = !workspaceEnabled_ ||
+            (insideWorkspace(candidate_, Config::leftOffset, -1.0) && insideWorkspace(candidate_, Config::rightOffset, 1.0));
+        if (finite == 0.0 && inside) {
+            safe_ = candidate_;
+            clampedTicks += clamped;
+        } else {
+            holdTicks++;
+        }
+
+        previous2_ = previous_;
+        previous_ = safe_;
+        return safe_;
+    }
+
+    /**
+     * @brief Whether a pose is within the joint limits and, if checked, the workspace
+     */
+    bool contains(const DataLine& pose) const {
+        constexpr const DataLine& limit = Config::limit_rad;
+        for (int i = 1; i < Config::nCols; i++) {
+            if (!(std::fabs(pose[i]) <= limit[i])) { return false; }
+        }
+        return !workspaceEnabled_ ||
+            (insideWorkspace(pose, Config::leftOffset, -1.0) && insideWorkspace(pose, Config::rightOffset, 1.0));
+    }
+
+    uint64_t clampedTicks = 0; // ticks where a limit changed the command
+    uint64_t holdTicks = 0; // ticks where the last safe command was held instead
+
+private:
+    void raiseLimits(double velocity_rad_s, double acceleration_rad_s2) {
+        maxVelocity_ = std::max(maxVelocity_, safetyMoveMargin * velocity_rad_s);
+        maxAcceleration_ = std::max(maxAcceleration_, safetyMoveMargin * acceleration_rad_s2);
+        setTickPeriod(dt_s_);
+    }
+
+    static int bin(double angle_rad) {
+        int b = int((angle_rad + PI) * (WS_BINS / (2 * PI)));
+        return b < 0 ? 0 : (b >= WS_BINS ? WS_BINS - 1 : b);
+    }
+
+    /**
+     * @brief Look up the hand of one arm in the workspace table
+     * @param offset index of the arm's first joint in the data line
+     * @param sign -1 for the left arm (mirror of the right one), 1 for the right arm
+     */
+    bool insideWorkspace(const DataLine& pose, int offset, double sign) const {
+        int a = bin(sign * pose[offset + int(harmony::ArmJoint::shoulderAbduction)]);
+        int b = bin(sign * pose[offset + int(harmony::ArmJoint::shoulderFlexion)]);
+        int c = bin(sign * pose[offset + int(harmony::ArmJoint::elbowFlexion)]);
+        return workspace_[(a * WS_BINS + b) * WS_BINS + c] != 0;
+    }
+
+    /**
+     * @brief Evaluate the arm model at the centre of every table cell
+     * Shoulder abduction (a) rotates about the forward axis, shoulder flexion (b) about
+     * the lateral axis, the elbow flexes the forearm about the lateral axis (negative is
+     * flexion on the right arm). The arm hangs straight down with all three at zero.
+     */
+    void buildWorkspaceTable() {
+        workspace_.assign(WS_BINS * WS_BINS * WS_BINS, 0);
+        auto centre = [](int b) { return -PI + (b + 0.5) * (2 * PI / WS_BINS); };
+        for (int a = 0; a < WS_BINS; a++) {
+            for (int b = 0; b < WS_BINS; b++) {
+                for (int c = 0; c < WS_BINS; c++) {
+                    double qa = centre(a), qb = centre(b), qc = centre(c);
+                    // arm in the sagittal plane after flexion (qb) and elbow flexion (qc)
+                    double x = upperArmLength_mm * std::sin(qb) + forearmLength_mm * std::sin(qb - qc);
+                    double z = -upperArmLength_mm * std::cos(qb) - forearmLength_mm * std::cos(qb - qc);
+                    // then abducted about the forward axis (qa)
+                    double y = -z * std::sin(qa);
+                    z = z * std::cos(qa);
+                    bool inside = x >= workspaceMin_mm[0] && x <= workspaceMax_mm[0] && y >= workspaceMin_mm[1] &&
+                        y <= workspaceMax_mm[1] && z >= workspaceMin_mm[2] && z <= workspaceMax_mm[2];
+                    workspace_[(a * WS_BINS + b) * WS_BINS + c] = inside;
+                }
+            }
+        }
+    }
+
+    DataLine previous_;
+    DataLine previous2_;
+    DataLine candidate_;
+    DataLine safe_;
+    double maxVelocity_;
+    double maxAcceleration_;
+    double dt_s_ = 0.0;
+    double maxStep_ = 0.0;
+    double maxStepChange_ = 0.0;
+    std::vector<uint8_t> workspace_;
+    bool workspaceEnabled_ = true;
+    bool seeded_ = false;
+};
 
 void printStates(std::array<harmony::JointState, harmony::armJointCount> states) {
     for (int i = 0; i < harmony::armJointCount; i++) {
@@ -548,71 +2943,610 @@ void printStates(std::array<harmony::JointState, harmony::armJointCount> states)
  * @param info pointer to research interface
  * @return AllArmsOverrides object holding left, right, and torso overrides
  */
-std::array<double, nCols> getCurrentArmPositionsAsDataLine(harmony::ResearchInterface* info) {
-    auto leftStates = info->joints().leftArm.getOrderedStates();
-    auto rightStates = info->joints().rightArm.getOrderedStates();
+template <class Config>
+typename Config::DataLine getCurrentArmPositionsAsDataLine(harmony::ResearchInterface* info) {
+    auto joints = info->joints();
+    auto leftStates = joints.leftArm.getOrderedStates();
+    auto rightStates = joints.rightArm.getOrderedStates();
 
-    std::array<double, nCols> data;
+    typename Config::DataLine data;
 
     data[0] = 0.0;
 
-    for (int i = 0; i < harmony::armJointCount; i++) {
-        data[i + 1] = leftStates[i].position_rad;
+    for (int i = 0; i < Config::armJoints; i++) {
+        data[i + Config::leftOffset] = leftStates[i].position_rad;
     }
-    for (int i = 0; i < harmony::armJointCount; i++) {
-        data[i + harmony::armJointCount + 1] = rightStates[i].position_rad;
+    for (int i = 0; i < Config::armJoints; i++) {
+        data[i + Config::rightOffset] = rightStates[i].position_rad;
     }
 
-#ifdef TORSO_MODS
-    auto torsoStates = info->joints().torso.getOrderedStates();
-    for (int i = 0; i < harmony::torsoJointCount; i++) {
-        data[i + 2 * harmony::armJointCount + 1] = torsoStates[i].position_rad;
+    if constexpr (Config::hasTorso) {
+        auto torsoStates = joints.torso.getOrderedStates();
+        for (int i = 0; i < Config::torsoJoints; i++) {
+            data[i + Config::torsoOffset] = torsoStates[i].position_rad;
+        }
     }
-#endif
 
     return data;
 }
 
 /**
- * @brief Given an initial and target position, interpolate between the two
- * Moves each joint (linearly) towards the traget posiiton with the iter representing the
- * current step taken out of nSteps. This function returns AllArmsOverrides to be pushed to
- * Harmony
- * @param initialOverride Initial position as AllArmsOverrides
- * @param targetOverride Target Position as AllArmsOverrides
- * @param iter iteration of interpolation
- * @param nSteps number of steps to take between initial and target positions
- * @return AllArmsOverrides the override command per the _iter_ step
+ * @brief Read positions and torques of all joints in the data line layout
+ *
+ * @param info pointer to research interface
+ * @param position filled with joint positions [rad]
+ * @param torque filled with joint torques [Nm]
+ */
+template <class Config>
+void getCurrentJointStates(harmony::ResearchInterface* info, typename Config::DataLine& position, typename Config::DataLine& torque) {
+    auto joints = info->joints();
+    auto leftStates = joints.leftArm.getOrderedStates();
+    auto rightStates = joints.rightArm.getOrderedStates();
+
+    position[0] = torque[0] = 0.0;
+    UNROLL
+    for (int i = 0; i < Config::armJoints; i++) {
+        position[i + Config::leftOffset] = leftStates[i].position_rad;
+        torque[i + Config::leftOffset] = leftStates[i].torque_Nm;
+        position[i + Config::rightOffset] = rightStates[i].position_rad;
+        torque[i + Config::rightOffset] = rightStates[i].torque_Nm;
+    }
+
+    if constexpr (Config::hasTorso) {
+        auto torsoStates = joints.torso.getOrderedStates();
+        UNROLL
+        for (int i = 0; i < Config::torsoJoints; i++) {
+            position[i + Config::torsoOffset] = torsoStates[i].position_rad;
+            torque[i + Config::torsoOffset] = torsoStates[i].torque_Nm;
+        }
+    }
+}
+
+/**
+ * @brief Exercise trajectories computed ahead of the 'g' command
+ * A trajectory is the list of poses step2targetPosition produces from a start pose to
+ * the end point of a movement class over nSteps ticks. Entries are keyed by
+ * (start pose, movement class, nSteps) and filled a few rows per tick by prepare()
+ * while the robot holds still, so once 'g' arrives the exercise just reads poses.
+ *
+ * Memory is bounded: the slots and their pose buffers are allocated once in the
+ * constructor, the least recently used slot is reused when all are taken. All entries
+ * are dropped when the hold pose changes, they can not be used from another start.
+ */
+template <class Config>
+class TrajectoryCache {
+public:
+    using DataLine = typename Config::DataLine;
+
+    /**
+     * @param slots number of trajectories kept
+     * @param maxSteps longest trajectory, in ticks
+     */
+    TrajectoryCache(int slots, int maxSteps) : entries_(std::max(slots, 1)) {
+        for (Entry& entry : entries_) { entry.poses.resize(std::max(maxSteps, 1)); }
+    }
+
+    /**
+     * @brief Continue building the trajectory for a movement class from start
+     * @param finish end point of the movement class
+     * @param budget poses to compute at most
+     * @return number of poses computed
+     */
+    int prepare(const DataLine& start, char target, const DataLine& finish, int nSteps, int budget) {
+        Entry* entry = slotFor(start, target, finish, nSteps);
+        if (entry == nullptr) { return 0; }
+        int n = std::min(budget, nSteps - entry->filled);
+        for (int k = 0; k < n; k++, entry->filled++) {
+            entry->poses[entry->filled] = jointtrajectory::step2targetPosition<Config>(start, finish, entry->filled, nSteps);
+        }
+        return n;
+    }
+
+    /**
+     * @brief Poses of the trajectory for a movement class, finished now if it was not ready
+     * @return pointer to nSteps poses, nullptr if nSteps does not fit a slot
+     */
+    const DataLine* trajectory(const DataLine& start, char target, const DataLine& finish, int nSteps) {
+        Entry* entry = slotFor(start, target, finish, nSteps);
+        if (entry == nullptr) { return nullptr; }
+        if (entry->filled < nSteps) {
+            misses++;
+            prepare(start, target, finish, nSteps, nSteps);
+        } else {
+            hits++;
+        }
+        return entry->poses.data();
+    }
+
+    uint64_t hits = 0; // trajectories that were ready when needed
+    uint64_t misses = 0; // trajectories that had to be (partly) computed when needed
+
+private:
+    struct Entry {
+        char target = 0;
+        int nSteps = 0;
+        int filled = 0;
+        uint64_t lastUse = 0;
+        DataLine finish;
+        std::vector<DataLine> poses;
+    };
+
+    static bool samePose(const DataLine& a, const DataLine& b) {
+        bool same = true;
+        UNROLL
+        for (int i = 1; i < Config::nCols; i++) { same &= std::fabs(a[i] - b[i]) < 1e-9; }
+        return same;
+    }
+
+    /**
+     * @brief Slot holding (or about to hold) the trajectory for this key
+     */
+    Entry* slotFor(const DataLine& start, char target, const DataLine& finish, int nSteps) {
+        if (nSteps > int(entries_[0].poses.size())) { return nullptr; }
+        if (!hasStart_ || !samePose(start, start_)) {
+            for (Entry& entry : entries_) { entry.target = 0; }
+            start_ = start;
+            hasStart_ = true;
+        }
+
+        Entry* oldest = &entries_[0];
+        for (Entry& entry : entries_) {
+            if (entry.target == target && entry.nSteps == nSteps && samePose(entry.finish, finish)) {
+                entry.lastUse = ++useCount_;
+                return &entry;
+            }
+            if (entry.target == 0 || (oldest->target != 0 && entry.lastUse < oldest->lastUse)) { oldest = &entry; }
+        }
+        oldest->target = target;
+        oldest->nSteps = nSteps;
+        oldest->finish = finish;
+        oldest->filled = 0;
+        oldest->lastUse = ++useCount_;
+        return oldest;
+    }
+
+    std::vector<Entry> entries_;
+    DataLine start_;
+    bool hasStart_ = false;
+    uint64_t useCount_ = 0;
+};
+
+/******************************************************************************************
+ * Teach by demonstration
+ *****************************************************************************************/
+/**
+ * @brief Joint frames recorded at the control rate
+ * The whole buffer is allocated in the constructor; add() only copies into it and
+ * refuses frames once it is full.
+ */
+template <class Config>
+class DemoArena {
+public:
+    using DataLine = typename Config::DataLine;
+
+    explicit DemoArena(int capacity)
+        : capacity_(std::max(capacity, 2)), times_(new double[capacity_]), frames_(new DataLine[capacity_]) {}
+
+    bool add(double t_s, const DataLine& position) {
+        if (size_ >= capacity_) { return false; }
+        times_[size_] = t_s;
+        frames_[size_] = position;
+        size_++;
+        return true;
+    }
+
+    void clear() { size_ = 0; }
+    int size() const { return size_; }
+    bool full() const { return size_ >= capacity_; }
+    const double* times() const { return times_.get(); }
+    const DataLine* frames() const { return frames_.get(); }
+
+private:
+    int capacity_;
+    int size_ = 0;
+    std::unique_ptr<double[]> times_;
+    std::unique_ptr<DataLine[]> frames_;
+};
+
+/**
+ * @brief A demonstrated movement: timed joint waypoints and the trajectory through them
+ * A recording is simplified with Ramer-Douglas-Peucker in joint space over time: a frame
+ * is dropped if linear interpolation between the kept neighbours reproduces every joint
+ * within the tolerance. A clamped cubic spline per joint (zero velocity at both ends)
+ * through the waypoints gives the smooth trajectory that sample() tabulates at the
+ * control rate, so playback is a table lookup like the cached exercise trajectories.
+ *
+ * File format (text, angles in rad):
+ *   BMDEMO 1
+ *   joints <n> side <r|l> waypoints <k>
+ *   <t_s> <joint 1> ... <joint n>      (k lines)
+ */
+template <class Config>
+class Demonstration {
+public:
+    using DataLine = typename Config::DataLine;
+
+    bool loaded() const { return !poses_.empty(); }
+    int waypoints() const { return int(times_.size()); }
+    double duration_s() const { return times_.empty() ? 0.0 : times_.back() - times_.front(); }
+    int steps() const { return int(poses_.size()); }
+    bool side() const { return side_; }
+
+    /**
+     * @brief Keep the frames of a recording that RDP needs to stay within tolerance_rad
+     */
+    void simplify(const DemoArena<Config>& arena, double tolerance_rad, bool side) {
+        int n = arena.size();
+        const double* t = arena.times();
+        const DataLine* q = arena.frames();
+        times_.clear();
+        waypoints_.clear();
+        side_ = side;
+        if (n < 2) { return; }
+
+        std::vector<char> keep(n, 0);
+        keep[0] = keep[n - 1] = 1;
+        std::vector<std::pair<int, int>> pending = {{0, n - 1}};
+        while (!pending.empty()) {
+            auto [a, b] = pending.back();
+            pending.pop_back();
+            double worst = 0.0;
+            int worstIdx = -1;
+            for (int k = a + 1; k < b; k++) {
+                double w = (t[k] - t[a]) / (t[b] - t[a]);
+                for (int i = 1; i < Config::nCols; i++) {
+                    double error = std::fabs(q[k][i] - (q[a][i] + (q[b][i] - q[a][i]) * w));
+                    if (error > worst) {
+                        worst = error;
+                        worstIdx = k;
+                    }
+                }
+            }
+            if (worst > tolerance_rad) {
+                keep[worstIdx] = 1;
+                pending.push_back({a, worstIdx});
+                pending.push_back({worstIdx, b});
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            if (!keep[k]) { continue; }
+            times_.push_back(t[k] - t[0]);
+            waypoints_.push_back(q[k]);
+        }
+    }
+
+    bool save(const std::string& path) const {
+        std::ofstream out(path);
+        out << "BMDEMO 1\njoints " << Config::nCols - 1 << " side " << (side_ ? 'r' : 'l') << " waypoints " << times_.size() << "\n";
+        out << std::setprecision(9);
+        for (size_t k = 0; k < times_.size(); k++) {
+            out << times_[k];
+            for (int i = 1; i < Config::nCols; i++) { out << " " << waypoints_[k][i]; }
+            out << "\n";
+        }
+        return bool(out);
+    }
+
+    /**
+     * @return empty on success, otherwise what is wrong with the file
+     */
+    std::string load(const std::string& path) {
+        std::ifstream in(path);
+        std::string magic, jointsKey, sideKey, waypointsKey;
+        int version = 0, nJoints = 0, nWaypoints = 0;
+        char side = 0;
+        if (!(in >> magic >> version >> jointsKey >> nJoints >> sideKey >> side >> waypointsKey >> nWaypoints) || magic != "BMDEMO" ||
+            version != 1) {
+            return "not a demonstration file";
+        }
+        if (nJoints != Config::nCols - 1) { return "recorded with " + std::to_string(nJoints) + " joints, this configuration drives " + std::to_string(Config::nCols - 1); }
+        if (nWaypoints < 2) { return "fewer than two waypoints"; }
+
+        times_.assign(nWaypoints, 0.0);
+        waypoints_.assign(nWaypoints, DataLine{});
+        for (int k = 0; k < nWaypoints; k++) {
+            in >> times_[k];
+            for (int i = 1; i < Config::nCols; i++) { in >> waypoints_[k][i]; }
+            if (!in || (k > 0 && !(times_[k] > times_[k - 1]))) { return "bad waypoint " + std::to_string(k); }
+        }
+        side_ = side == 'r';
+        return "";
+    }
+
+    /**
+     * @brief Tabulate the spline through the waypoints at fs
+     */
+    void sample(double fs) { jointtrajectory::clampedSpline<Config>(times_, waypoints_, fs, poses_); }
+
+    /**
+     * @brief Playback pose of a tick, faded in from the hold pose the movement starts at
+     */
+    DataLine pose(int step, const DataLine& start, double fs) const {
+        const DataLine& p = poses_[std::min(step, steps() - 1)];
+        double x = std::min(1.0, step / (demoBlendTime_s * fs + 1e-9));
+        double w = 1.0 - x * x * (3.0 - 2.0 * x);
+        DataLine out;
+        out[0] = 0.0;
+        for (int i = 1; i < Config::nCols; i++) { out[i] = p[i] + (start[i] - poses_[0][i]) * w; }
+        return out;
+    }
+
+    const DataLine& end() const { return poses_.back(); }
+    const std::vector<DataLine>& poses() const { return poses_; }
+
+private:
+    std::vector<double> times_;
+    std::vector<DataLine> waypoints_;
+    std::vector<DataLine> poses_;
+    bool side_ = true;
+};
+
+/******************************************************************************************
+ * Mirror therapy
+ *****************************************************************************************/
+/**
+ * @brief Drives the exercising (impaired) arm from the other (healthy) arm
+ * Every impaired arm joint follows one healthy arm joint (mirrorSource), flipped by
+ * mirrorSign and scaled by mirrorGain around the poses both arms had at start(), then
+ * low pass filtered at mirrorCutoff_Hz. The healthy arm's command follows its measured
+ * pose, so with mirrorHealthyCompliance 0 it moves freely. Fixed size state only, no
+ * allocation after construction.
+ */
+template <class Config>
+class MirrorMap {
+public:
+    using DataLine = typename Config::DataLine;
+
+    /**
+     * @param side exercising arm, true for the right one
+     * @param dt_s control period
+     */
+    MirrorMap(bool side, double dt_s)
+        : impaired_(side ? Config::rightOffset : Config::leftOffset), healthy_(side ? Config::leftOffset : Config::rightOffset) {
+        alpha_ = mirrorCutoff_Hz > 0.0 ? 1.0 - std::exp(-2.0 * PI * mirrorCutoff_Hz * dt_s) : 1.0;
+        for (int j = 0; j < Config::armJoints; j++) {
+            source_[j] = std::min(std::max(mirrorSource[j], 0), Config::armJoints - 1);
+            scale_[j] = mirrorSign[j] * mirrorGain[j];
+        }
+    }
+
+    /**
+     * @brief Hold pose with the healthy arm mirroring the impaired arm of pose
+     */
+    DataLine startPose(const DataLine& pose) const {
+        DataLine start = pose;
+        for (int j = 0; j < Config::armJoints; j++) { start[healthy_ + source_[j]] = mirrorSign[j] * pose[impaired_ + j]; }
+        return start;
+    }
+
+    /**
+     * @brief Start mirroring
+     * @param measured current joint positions, the healthy arm's reference pose
+     * @param hold current command, the impaired arm's reference pose
+     */
+    void start(const DataLine& measured, const DataLine& hold) {
+        healthyStart_ = measured;
+        impairedStart_ = hold;
+        command_ = hold;
+    }
+
+    /**
+     * @brief Command for this tick from the joint positions just measured
+     */
+    const DataLine& update(const DataLine& measured) {
+        UNROLL
+        for (int j = 0; j < Config::armJoints; j++) {
+            int h = healthy_ + source_[j];
+            double target = impairedStart_[impaired_ + j] + scale_[j] * (measured[h] - healthyStart_[h]);
+            command_[impaired_ + j] += alpha_ * (target - command_[impaired_ + j]);
+        }
+        UNROLL
+        for (int j = 0; j < Config::armJoints; j++) { command_[healthy_ + j] = measured[healthy_ + j]; }
+        return command_;
+    }
+
+    const DataLine& command() const { return command_; }
+    int healthyOffset() const { return healthy_; }
+
+private:
+    int impaired_;
+    int healthy_;
+    double alpha_ = 1.0;
+    std::array<int, harmony::armJointCount> source_{};
+    std::array<double, harmony::armJointCount> scale_{};
+    DataLine healthyStart_{};
+    DataLine impairedStart_{};
+    DataLine command_{};
+};
+
+/**
+ * @brief Join commandGroup on the command socket, from commandSources only if any are given
+ * Uses the protocol independent MCAST_JOIN_GROUP / MCAST_JOIN_SOURCE_GROUP, so IPv4 and
+ * IPv6 groups take the same path. Source filtering needs IGMPv3 / MLDv2 on the network.
+ */
+bool joinCommandGroup(int sockfd, const sockaddr_storage& group) {
+    int level = group.ss_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    uint32_t interface = 0;
+    if (!commandInterface.empty() && (interface = if_nametoindex(commandInterface.c_str())) == 0) {
+        std::cerr << "No network interface " << commandInterface << std::endl;
+        return false;
+    }
+    if (commandSources.empty()) {
+        group_req request = {};
+        request.gr_interface = interface;
+        memcpy(&request.gr_group, &group, sizeof(group));
+        if (setsockopt(sockfd, level, MCAST_JOIN_GROUP, &request, sizeof(request)) < 0) {
+            std::cerr << "Joining " << commandGroup << " failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+    for (const std::string& text : commandSources) {
+        group_source_req request = {};
+        request.gsr_interface = interface;
+        memcpy(&request.gsr_group, &group, sizeof(group));
+        if (!commandrelay::parseAddress(text, 0, request.gsr_source) || request.gsr_source.ss_family != group.ss_family) {
+            std::cerr << "Source " << text << " is not an address of the same family as " << commandGroup << std::endl;
+            return false;
+        }
+        if (setsockopt(sockfd, level, MCAST_JOIN_SOURCE_GROUP, &request, sizeof(request)) < 0) {
+            std::cerr << "Joining " << commandGroup << " from " << text << " failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Open the command socket on port with kernel receive timestamps
+ * Quiet on success, it runs concurrently with the startup questions.
+ * With commandGroup set the socket also joins that multicast group; it is shared with
+ * other listeners of the group on this machine (SO_REUSEADDR), and an IPv6 group makes it
+ * a dual stack socket that still takes unicast commands over IPv4.
+ * @return the socket, -1 on failure
  */
-std::array<double, nCols> step2targetPosition(std::array<double, nCols> start,
-    std::array<double, nCols> finish,
-    int iter,
-    int nSteps) {
+int openCommandSocket(int port = PORT) {
+    int sockfd;
+    sockaddr_storage group;
+    if (!commandGroup.empty() && !commandrelay::parseAddress(commandGroup, 0, group)) {
+        std::cerr << "Bad multicast group " << commandGroup << std::endl;
+        return -1;
+    }
+    int family = !commandGroup.empty() && group.ss_family == AF_INET6 ? AF_INET6 : AF_INET;
+
+    // Creating socket file descriptor
+    sockfd = socket(family, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        std::cerr << "socket creation failed" << std::endl;
+        return -1;
+    }
 
-    std::array<double, nCols> step;
-    step[0] = 0.;
+    // Ask the kernel to timestamp every datagram on arrival
+    int enableTimestamps = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &enableTimestamps, sizeof(enableTimestamps)) < 0) {
+        std::cerr << "SO_TIMESTAMPNS not available, using receive time instead" << std::endl;
+    }
+    int enable = 1, disable = 0;
+    if (!commandGroup.empty()) { setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)); }
+    if (family == AF_INET6) { setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable)); }
+
+    // Filling server information, any address of the family
+    sockaddr_storage servaddr;
+    commandrelay::parseAddress(family == AF_INET6 ? "::" : "0.0.0.0", port, servaddr);
+
+    // Bind the socket with the server address
+    socklen_t length = family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    if (bind(sockfd, (const struct sockaddr*)&servaddr, length) < 0) {
+        std::cerr << "bind to port " << port << " failed" << std::endl;
+        close(sockfd);
+        return -1;
+    }
 
-    for (int i = 1; i < nCols; i++) {
-        step[i] = start[i] + (finish[i] - start[i]) * iter / nSteps;
+    if (!commandGroup.empty() && !joinCommandGroup(sockfd, group)) {
+        close(sockfd);
+        return -1;
     }
-    return step;
+
+    return sockfd;
 }
 
 /*******UDP LOOP*********/
-void UDPloop(char* buffer, int buffer_len, struct sockaddr_in cliaddr, int sockfd) {
-
-    while (true) {
-        // Receiving data from the client
-        buffer_len = sizeof(cliaddr);
-        int n = recvfrom(
-            sockfd, (char*)buffer, MAX_BUFFER_SIZE, MSG_WAITALL, (struct sockaddr*)&cliaddr, (socklen_t*)&buffer_len);
+/**
+ * @brief Receive commands and hand them to the control loop with their arrival time
+ * The socket must have SO_TIMESTAMPNS enabled; if the kernel timestamp is missing
+ * the time of the recvmsg return is used instead. Packets go to the inbox, the
+ * InputRouter delivers them at the next control tick: commands to the command latch,
+ * "p <x> <y> <z>" packets (the decoder's class probabilities) to the class probabilities.
+ * Commands are the characters of COMMAND_CHARS, the operator console sends the same ones.
+ * The sender of each command is handed to feedback as its default destination.
+ * Packets that are not a known command are counted as malformed and ignored.
+ * Every datagram, known or not, is then forwarded to the consumers of relay, if any.
+ * Returns once stopping is set and the socket has been shut down (see CommandReceiver).
+ */
+void UDPloop(int sockfd, InputInbox* inbox, FeedbackChannel* feedback, UdpMetrics* metrics, commandrelay::CommandRelay* relay,
+    const std::atomic<bool>* stopping) {
+    char buffer[MAX_BUFFER_SIZE];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+
+    while (!stopping->load()) {
+        // Receiving data from the client, IPv4 or IPv6 (see openCommandSocket)
+        struct sockaddr_storage cliaddr;
+        struct iovec iov = {buffer, MAX_BUFFER_SIZE - 1};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &cliaddr;
+        msg.msg_namelen = sizeof(cliaddr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        int n = recvmsg(sockfd, &msg, 0);
+        if (n < 0 || stopping->load()) { continue; }
         buffer[n] = '\0';
-        std::cout << "Client: " << buffer << std::endl;
+        in6_addr sender = senderAddress(cliaddr);
+        UdpMetrics::Source& source = metrics->source(sender);
+        bump(source.received);
+
+        double p[3];
+        bool probabilities = parseProbabilities(buffer, p);
+        if (n == 0 || (!probabilities && strchr(COMMAND_CHARS, buffer[0]) == nullptr)) {
+            bump(source.malformed);
+            relay->forward(buffer, size_t(n));
+            continue;
+        }
+
+        int64_t now_mono_ns = monotonicNs();
+        int64_t now_real_ns = realtimeNs();
+        int64_t rx_real_ns = now_real_ns;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                rx_real_ns = int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+            }
+        }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        // the kernel stamps on the realtime clock, shift it onto the monotonic one
+        InputPacket packet;
+        packet.rx_real_ns = rx_real_ns;
+        packet.rx_mono_ns = now_mono_ns - (now_real_ns - rx_real_ns);
+        packet.source = &source;
+        packet.length = uint8_t(std::min(n, MAX_PACKET_BYTES));
+        memcpy(packet.bytes, buffer, packet.length);
+        if (!inbox->push(packet)) { source.dropped.fetch_add(1, std::memory_order_relaxed); }
+        relay->forward(buffer, size_t(n));
+        if (probabilities) { continue; }
+        feedback->setSender(sender);
     }
 }
 
+/**
+ * @brief Runs UDPloop on a thread of its own for as long as a session lives
+ * Owns the command socket. On the way out it shuts the socket down, which wakes the
+ * blocked recvmsg, and joins the thread, so no receiver outlives the inbox it feeds or
+ * reads a descriptor that another robot of the process has been given since.
+ */
+class CommandReceiver {
+public:
+    CommandReceiver(int sockfd, InputInbox* inbox, FeedbackChannel* feedback, UdpMetrics* metrics, commandrelay::CommandRelay* relay)
+        : sockfd_(sockfd) {
+        thread_ = std::thread(UDPloop, sockfd, inbox, feedback, metrics, relay, &stopping_);
+    }
+
+    ~CommandReceiver() {
+        stopping_.store(true);
+        shutdown(sockfd_, SHUT_RDWR);
+        thread_.join();
+        close(sockfd_);
+    }
+
+private:
+    int sockfd_;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+
 // /*******SHUTDOWN LOOP*********/
 // void exitLoop(harmony::ResearchInterface* info, int sockfd){
 
@@ -650,79 +3584,297 @@ void UDPloop(char* buffer, int buffer_len, struct sockaddr_in cliaddr, int sockf
 
 // }
 
-int main() {
+/**
+ * @brief Read a launch configuration file as command line options
+ * One option per line, "key value" or "key = value" where key is the long option without
+ * the dashes (e.g. "joints torso", "subject 12", "side r"), or just the key for switches
+ * such as "mirror". '#' starts a comment.
+ */
+bool readConfigFile(const std::string& path, std::vector<std::string>& options) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Failed to read configuration " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        std::replace(line.begin(), line.end(), '=', ' ');
+        std::istringstream iss(line);
+        std::string key, value;
+        if (!(iss >> key)) { continue; }
+        options.push_back("--" + key);
+        if (iss >> value) { options.push_back(value); }
+    }
+    return true;
+}
+
+/**
+ * @brief Prints the command line options
+ */
+void printUsage(const char* exeName) {
+    std::cout << "Usage: " << exeName << " [--config file] [--subject n --online 0|1 --session n --run n --side r|l]\n"
+              << "       [--ramp-time s] [--start-time s] [--start-speed rad_s]\n"
+              << "       [--joints config] [--no-workspace-check] [--script file] [--feedback host:port|off] [--feedback-rate hz]\n"
+              << "       [--group addr [--source addr ...] [--group-interface name]] [--relay host:port ...]\n"
+              << "       [--metrics-port p] [--record file | --demo file | --mirror] [--mirror-rate hz] [--mirror-gain g]\n"
+              << "       [--replay journal] [--speed x] [--core n]\n"
+              << "       [--robots n | --robot file ...] [--io-threads n]\n"
+              << "       [--print-journal journal] [--bench file] [--bench-baseline file] [--bench-machine name]\n"
+              << "       [--bench-configs]\n";
+    std::cout << "  --config file     read options from file, \"key value\" per line (e.g. \"side r\"), later options override it\n";
+    std::cout << "  --subject n ...   answer the startup questions up front, the ones not given are asked\n";
+    std::cout << "  --ramp-time s     stiffness ramp at the start (default " << ImpedenceBufferTime_s << ")\n";
+    std::cout << "  --start-time s    longest move to the start pose (default " << startPosBufferTime_s << ")\n";
+    std::cout << "  --start-speed v   move to the start pose at v rad/s on the farthest joint instead of taking start-time\n";
+    std::cout << "  --joints config   arms, torso, wrist or torso-wrist (default " DEFAULT_JOINT_CONFIG ")\n";
+    std::cout << "  --no-workspace-check  run without the hand workspace limit (joint limits stay), otherwise a program\n"
+              << "                    pose outside the workspace model stops the start\n";
+    std::cout << "  --script file     feed commands from a script (\"<delay_s> <command>\" per line) besides UDP\n";
+    std::cout << "  --feedback dest   send session feedback to host:port (default: command sender, port " << FEEDBACK_PORT << ")\n";
+    std::cout << "  --feedback-rate hz  periodic feedback packets per second (default " << feedbackRate_Hz << ")\n";
+    std::cout << "  --group addr      also take commands sent to the IPv4 or IPv6 multicast group addr\n";
+    std::cout << "  --source addr     take the group's commands only from sender addr (repeatable, needs IGMPv3/MLDv2)\n";
+    std::cout << "  --group-interface name  network interface to join the group on (default: chosen by the kernel)\n";
+    std::cout << "  --relay host:port forward every received datagram to a local consumer ([host]:port for IPv6, repeatable)\n";
+    std::cout << "  --metrics-port p  serve metrics on http://127.0.0.1:p/metrics, 0: off (default " << METRICS_PORT << ")\n";
+    std::cout << "  --record file     record a therapist demonstration (g starts, s stops) into file and exit\n";
+    std::cout << "  --demo file       offer the demonstration in file as movement d\n";
+    std::cout << "  --mirror          mirror therapy: the exercising arm follows the other arm (g starts, s stops)\n";
+    std::cout << "  --mirror-rate hz  control rate of a mirror session (default " << mirrorRate_Hz << ", at most 1000)\n";
+    std::cout << "  --mirror-gain g   scale of the mirrored motion on every joint (default 1)\n";
+    std::cout << "  --replay journal  rerun a session from its _input.bmj, same answers and packets at the same ticks\n";
+    std::cout << "  --print-journal journal  print an input journal as text and exit\n";
+    std::cout << "  --core n          pin the control thread to CPU core n\n";
+    std::cout << "  --robots n        drive n robots, robot<i> on port " << PORT << "+i, each with the options given here\n";
+    std::cout << "  --robot file      add a robot configured by file (name, port, core, script, feedback, subject ... side),\n"
+              << "                    repeat for more; every robot needs all startup answers\n";
+    std::cout << "  --io-threads n    log and feedback writer threads shared by the robots (default 2)\n";
+#ifdef SIM_BACKEND
+    std::cout << "  --speed x         run on a virtual clock at x times real time (0: as fast as possible)\n";
+#endif
+#ifdef RT_ALLOC_CHECK
+    std::cout << "  --alloc-fail      abort on the first heap allocation in a control tick instead of counting them\n";
+#endif
+    std::cout << "  --bench file      write the session's tick timing, command latency and log throughput as JSON\n";
+    std::cout << "  --bench-baseline f  compare them with a --bench file of this machine, or the <host>.json in directory f,\n"
+              << "                    exit with 4 if its thresholds are exceeded (see bench_session.sh)\n";
+    std::cout << "  --bench-machine n name the machine n instead of its host name, e.g. a reference or CI runner\n";
+    std::cout << "  --bench-configs   time the control tick of every joint configuration and exit\n";
+    std::cout << "Keys during a session: q quit, p pause/resume, n skip the trial, c change side (while selecting),\n"
+              << "x y z d g s e as sent over UDP, X Y Z redirect a running movement to another end point\n";
+}
+
+/**
+ * @brief Print an input journal as text, one record per line
+ */
+int printJournal(const std::string& path) {
+    JournalReplay journal;
+    std::string error = journal.load(path);
+    if (!error.empty()) {
+        std::cerr << "Input journal " << path << ": " << error << std::endl;
+        return -1;
+    }
+    std::cout << "# tick period " << journal.tickPeriod_ns() << " ns\n# answers:";
+    std::istringstream answers(journal.answers());
+    for (std::string answer; answers >> answer;) { std::cout << " " << answer; }
+    std::cout << "\n# type\ttick\trx_mono_ns\trx_real_ns\tbytes\n";
+
+    // received and taken records interleaved by tick, received first within a tick
+    const std::vector<JournalRecord>& received = journal.received();
+    const std::vector<JournalRecord>& taken = journal.taken();
+    size_t r = 0, t = 0;
+    while (r < received.size() || t < taken.size()) {
+        bool takeNext = r == received.size() || (t < taken.size() && taken[t].tick < received[r].tick);
+        const JournalRecord& record = takeNext ? taken[t++] : received[r++];
+        std::cout << record.type << "\t" << record.tick << "\t" << record.rx_mono_ns << "\t" << record.rx_real_ns << "\t"
+                  << std::string(record.bytes, record.length) << "\n";
+    }
+    return 0;
+}
+
+/**
+ * @brief Keep the compiler from optimizing away a benchmark result
+ */
+template <typename T>
+inline void keepResult(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/**
+ * @brief Time the per tick control path of a joint configuration without the robot
+ * Runs the safety stage, the impedance update, the override packing and the
+ * trajectory step on a synthetic exercise movement that the joints follow with a lag.
+ * @return mean time per tick in nanoseconds
+ */
+template <class Config>
+double benchmarkTick(int nTicks) {
+    using DataLine = typename Config::DataLine;
+    ImpedanceEngine<Config> impedance;
+    SafetyStage<Config> safety;
+    JointFilter<Config> filter(0.005);
+    DataLine start = setSideArmActive<Config>(nullptr, true);
+    DataLine finish = setEndPoint2<Config>(nullptr, true, 'x');
+    DataLine position = start;
+    DataLine torque{};
+    int nSteps = 1200;
+    impedance.start(1.0);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < nTicks; tick++) {
+        int iter = tick % (2 * nSteps);
+        DataLine command = jointtrajectory::step2targetPosition<Config>(start, finish, iter < nSteps ? iter : 2 * nSteps - iter, nSteps);
+        filter.update(position, torque);
+        const DataLine& safeCommand = safety.apply(command, position);
+        const DataLine& stiffness = impedance.update(safeCommand, filter.position(), filter.torque(), 0.005);
+        auto overrides = data2override<Config>(safeCommand, stiffness);
+        keepResult(overrides);
+        UNROLL
+        for (int i = 1; i < Config::nCols; i++) {
+            torque[i] = stiffness[i] * (safeCommand[i] - position[i]);
+            position[i] += 0.05 * (safeCommand[i] - position[i]);
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1 - t0).count() / nTicks;
+}
+
+/**
+ * @brief Benchmark every joint configuration built into this program
+ */
+void benchmarkConfigs() {
+    const int nTicks = 2000000;
+    auto report = [](const char* name, int nCols, double ns) {
+        std::cout << std::left << std::setw(12) << name << std::right << std::setw(3) << nCols - 1 << " joints  "
+                  << std::fixed << std::setprecision(1) << std::setw(7) << ns << " ns/tick" << std::endl;
+    };
+    report("arms", ArmsOnly::nCols, benchmarkTick<ArmsOnly>(nTicks));
+    report("torso", ArmsTorso::nCols, benchmarkTick<ArmsTorso>(nTicks));
+    report("wrist", WristMods::nCols, benchmarkTick<WristMods>(nTicks));
+    report("torso-wrist", TorsoWristMods::nCols, benchmarkTick<TorsoWristMods>(nTicks));
+}
+
+/******************************************************************************************
+ * Robot instances
+ *  One process can drive several robots (--robots, --robot). Every robot runs its session
+ *  on a control thread of its own, pinned to its own core, with its own command port,
+ *  log and startup answers. Log, journal and feedback writers of all robots share one
+ *  IoPool and a single metrics endpoint reports on all of them, labelled by robot.
+ *****************************************************************************************/
+
+/**
+ * @brief Everything that differs between the robots of one process
+ */
+struct RobotInstance {
+    std::string name; // log file suffix, console prefix and metrics label, empty for the only robot
+    int port = PORT; // UDP command port
+    int core = -1; // CPU core of the control thread, -1: not pinned
+    std::string scriptPath; // command script to feed besides UDP, empty for none
+    std::string feedbackDestination; // see the global of the same name
+    std::vector<std::string> relays; // local consumers of the command stream, see relayDestinations
+    std::map<std::string, std::string> presets; // startup answers, see startupPresets
+    IoPool* io = nullptr; // shared writer threads, nullptr: each writer has its own
+    MetricsRegistry* metrics = nullptr;
+    ControlMetrics control;
+    LogWriterTotals log; // filled in when the session log is closed
+    int result = 0; // return value of runSession
+
+    RobotInstance() = default;
+    RobotInstance(const RobotInstance&) = delete;
+    RobotInstance& operator=(const RobotInstance&) = delete;
+};
+
+/**
+ * @brief Pin the calling thread to one CPU core
+ * @return false if the core does not exist or the kernel refused
+ */
+bool pinToCore(int core) {
+    if (core < 0 || core >= CPU_SETSIZE) { return false; }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+/**
+ * @brief Run one exercise session with the joint configuration Config
+ * @param clockSpeed < 0 for the real clock, otherwise virtual clock speed (see VirtualClock)
+ * @param robot the robot to drive, with its port, script, answers and metrics
+ */
+template <class Config>
+int runSession(double clockSpeed, RobotInstance& robot) {
+    const std::string& scriptPath = robot.scriptPath;
+    ControlMetrics& controlMetrics = robot.control;
+    using DataLine = typename Config::DataLine;
 
-    double fs = 200; // recording frequency
+    double fs = mirrorMode ? mirrorRate_Hz : 200; // recording frequency
     uint T_ms = uint(1000 / fs);
+    fs = 1000.0 / T_ms; // whole milliseconds per tick
     ; // recording time step
 
-    //     /*--------- Init Research Interface --------*/
-    harmony::ResearchInterface info;
-    if (!info.init()) {
-        std::cerr << "Failed to initialize Research Interface" << std::endl;
-        return -1;
-    } else {
-        std::cout << "Research interface initialized!" << std::endl;
-    }
-
-#ifdef TORSO_MODS
-    auto torso = info.makeTorsoController();
-    if (!torso->init()) {
-        std::cerr << "Failed to initialize Torso Controller" << std::endl;
-        return -1;
+    std::unique_ptr<Clock> sessionClock;
+    if (clockSpeed >= 0) {
+        sessionClock.reset(new VirtualClock(clockSpeed));
     } else {
-        std::cout << "Torso Controller initialized!" << std::endl;
+        sessionClock.reset(new RealClock());
     }
-#endif
+    Clock* clock = sessionClock.get();
 
-    auto left = info.makeLeftArmController(); // left arm controller
-    auto right = info.makeRightArmController(); // right arm controller
-    if (!left->init() || !right->init()) {
-        std::cerr << "Failed to initialize Arm Controllers" << std::endl;
+    ScriptedCommands script;
+    if (!scriptPath.empty() && !script.load(scriptPath)) {
+        std::cerr << "Failed to read command script " << scriptPath << std::endl;
         return -1;
     }
 
-    // UDP socket initialization
-
-    int sockfd, buffer_len;
-    char buffer[MAX_BUFFER_SIZE];
-    struct sockaddr_in servaddr, cliaddr;
-
-    // Creating socket file descriptor
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        std::cerr << "socket creation failed" << std::endl;
-        return 1;
-    } else {
-        std::cout << "Socket succesflly created!" << std::endl;
-    }
-
-    memset(&servaddr, 0, sizeof(servaddr));
-    memset(&cliaddr, 0, sizeof(cliaddr));
-
-    // Filling server information
-    servaddr.sin_family = AF_INET; // IPv4
-    servaddr.sin_addr.s_addr = INADDR_ANY;
-    servaddr.sin_port = htons(PORT);
-
-    // Bind the socket with the server address
-    if (bind(sockfd, (const struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-        std::cerr << "bind failed" << std::endl;
-        return 1;
-    } else {
-        std::cout << "Binded succesflly!" << std::endl;
+    JournalReplay replay;
+    if (!replayPath.empty()) {
+        std::string error = replay.load(replayPath);
+        if (error.empty() && replay.tickPeriod_ns() != T_ms * 1000000u) { error = "recorded with another control rate"; }
+        if (error.empty() && !scriptPath.empty()) { error = "cannot be combined with a command script"; }
+        if (!error.empty()) {
+            std::cerr << "Input journal " << replayPath << ": " << error << std::endl;
+            return -1;
+        }
+        std::cout << "Replaying " << replay.received().size() << " packets from " << replayPath << std::endl;
     }
 
-    std::cout << "DONE\n";
-
-    // Calling UDP Thread !!
-    std::thread udpBackground(UDPloop, buffer, buffer_len, cliaddr, sockfd);
-    char* UDPinput = buffer;
-    udpBackground.detach();
+    /*--------- Start-up: independent stages run concurrently with the questions --------*/
+    StartupTimer startup;
 
-    // //Calling SHUTDOWN Thread !!
-    // std::thread exitBackground(exitLoop, &info, sockfd);
-    // exitBackground.detach();
+    //     /*--------- Init Research Interface --------*/
+    harmony::ResearchInterface info;
+#ifdef SIM_BACKEND
+    info.setTimeSource([clock]() { return clock->monotonic_ns(); });
+#endif
+    decltype(info.makeTorsoController()) torso;
+    decltype(info.makeLeftArmController()) left, right;
+    auto robotReady = std::async(std::launch::async, [&]() -> std::string {
+        if (!startup.time("research interface", [&] { return info.init(); })) { return "Failed to initialize Research Interface"; }
+        left = info.makeLeftArmController(); // left arm controller
+        right = info.makeRightArmController(); // right arm controller
+        if constexpr (Config::hasTorso) { torso = info.makeTorsoController(); }
+
+        // the controllers do not depend on each other
+        auto leftReady = std::async(std::launch::async, [&] { return startup.time("left arm controller", [&] { return left->init(); }); });
+        auto rightReady = std::async(std::launch::async, [&] { return startup.time("right arm controller", [&] { return right->init(); }); });
+        bool torsoReady = true;
+        if constexpr (Config::hasTorso) { torsoReady = startup.time("torso controller", [&] { return torso->init(); }); }
+        bool armsReady = leftReady.get();
+        armsReady = rightReady.get() && armsReady;
+        if (!torsoReady) { return "Failed to initialize Torso Controller"; }
+        if (!armsReady) { return "Failed to initialize Arm Controllers"; }
+        return "";
+    });
+
+    // UDP socket initialization, a replay takes its packets from the journal instead
+    auto socketReady = std::async(std::launch::async, [&] {
+        return replayPath.empty() ? startup.time("command socket", [&] { return openCommandSocket(robot.port); }) : -1;
+    });
+
+    // joint limit and workspace tables of the safety stage
+    auto safetyReady = std::async(std::launch::async, [&] {
+        return startup.time("safety tables", [] { return std::unique_ptr<SafetyStage<Config>>(new SafetyStage<Config>()); });
+    });
 
     /***************Main LooP *************/
 
@@ -732,19 +3884,26 @@ int main() {
     int sessionNumber;
     bool online;
 
+    std::istringstream replayedAnswers(replay.answers());
+    const std::map<std::string, std::string> noPresets;
+    StartupAnswers answers(replayPath.empty() ? std::cin : replayedAnswers, !replayPath.empty(),
+        replayPath.empty() ? robot.presets : noPresets);
+    int64_t questions_ns = monotonicNs();
+
     std::cout << "Enter subject number:\n";
-    std::cin >> subjectNumber;
+    subjectNumber = answers.ask<int>("subject");
 
     std::cout << "Offline (0), Online (1):\n"; 
-    std::cin >> online; 
+    online = answers.ask<bool>("online");
 
     std::cout << "Enter session number:\n";
-    std::cin >> sessionNumber; 
+    sessionNumber = answers.ask<int>("session");
 
     std::cout << "Enter run number:\n";
-    std::cin >> runNumber; 
+    runNumber = answers.ask<int>("run");
 
-    bool side = setSideChoice();
+    bool side = setSideChoice(answers);
+    startup.record("operator answers", questions_ns, monotonicNs());
     std::string dateString = getCurrentDateTime(); 
 
     
@@ -759,88 +3918,513 @@ int main() {
         filePrefix = dateString +"_sub" + std::to_string(subjectNumber) + "_off"+std::to_string(sessionNumber)+ "_r" + std::to_string(runNumber); // file prefix specified by user
     }
     
-    std::ofstream logFile(filepath(filePrefix), std::ios::out); // ofstream object for writing
-    printLogHeader(&logFile, fs);    
+    // a replay must not overwrite the log of the session it replays
+    if (!replayPath.empty()) { filePrefix += "_replay"; }
+    if (!robot.name.empty()) { filePrefix += "_" + robot.name; }
+
+    int64_t log_ns = monotonicNs();
+    std::stringstream logHeader;
+    printLogHeader<Config>(&logHeader, fs);
+    LogWriter logFile(filepath(filePrefix, compressLog ? ".bmz" : ".txt"), logHeader.str(), compressLog, logColumnResolutions<Config>(),
+        robot.io);
+    logFile.setLossless(clockSpeed >= 0);
+    logFile.setTotals(&robot.log);
+
+    std::unique_ptr<InputJournal> journal; // outlives input, which journals the last command on the way out
+    if (journalInput && replayPath.empty()) {
+        journal.reset(new InputJournal("./log/" + filePrefix + "_input.bmj", T_ms * 1000000u, answers.recorded(), robot.io));
+        journal->setLossless(clockSpeed >= 0);
+    }
+    startup.record("log and journal", log_ns, monotonicNs());
+
+    /*--------- Wait for the concurrent stages --------*/
+    std::string robotError = robotReady.get();
+    int sockfd = socketReady.get();
+    std::unique_ptr<SafetyStage<Config>> safetyTables = safetyReady.get();
+    if (!robotError.empty()) {
+        std::cerr << robotError << std::endl;
+        if (sockfd >= 0) { close(sockfd); }
+        return -1;
+    }
+    std::cout << "Research interface initialized!" << std::endl;
+    if (replayPath.empty() && sockfd < 0) { return 1; }
+    if (sockfd >= 0) { std::cout << "Command socket listening on port " << robot.port << std::endl; }
+    if (sockfd >= 0 && !commandGroup.empty()) {
+        std::cout << "Joined multicast group " << commandGroup << (commandSources.empty() ? "" : " (source filtered)") << std::endl;
+    }
+
+    std::cout << "DONE\n";
+
+    // Calling UDP Thread !!
+    CommandLatch commands;
+    ClassProbabilities probabilities;
+    FeedbackChannel feedback(robot.feedbackDestination, feedbackRate_Hz, robot.io);
+    UdpMetrics udpMetrics;
+    InputRouter input(&commands, &probabilities);
+    input.setScript(&script);
+    input.setJournal(journal.get());
+    if (!replayPath.empty()) { input.setReplay(&replay); }
+    commandrelay::CommandRelay relay;
+    for (const std::string& destination : robot.relays) {
+        if (!relay.add(destination)) { return -1; }
+    }
+    std::unique_ptr<CommandReceiver> receiver;
+    if (sockfd >= 0) { receiver.reset(new CommandReceiver(sockfd, input.inbox(), &feedback, &udpMetrics, &relay)); }
+
+    // //Calling SHUTDOWN Thread !!
+    // std::thread exitBackground(exitLoop, &info, sockfd);
+    // exitBackground.detach();
+
+    MetricsRegistry::Listing metricsListing(robot.metrics, {robot.name, &controlMetrics, &udpMetrics, &logFile});
 
  /*--------- Scale Up Impedence Control --------*/
     // std::cout << "Scaling Up Impedence Control Values [" << ImpedenceBufferTime_s << "s]" << std::endl;
     std::cout << "Scaling Up Impedence Control Values" << std::endl;
     std::cout.flush();
 
-    int nSteps = ImpedenceBufferTime_s * fs;
-    auto robotStartPosition = getCurrentArmPositionsAsDataLine(&info);
+    ImpedanceEngine<Config> impedance;
+    SafetyStage<Config>& safety = *safetyTables;
+    safety.setTickPeriod(T_ms / 1000.0);
+    for (bool s : {side, !side}) { // the operator can change sides between trials
+        std::string outside = safety.verifyPose(setSideArmActive<Config>(&info, s)) ? "" : "start";
+        for (char movement : {'x', 'y', 'z'}) {
+            if (outside.empty() && !safety.verifyPose(setEndPoint2<Config>(&info, s, movement))) { outside = std::string("exercise ") + movement; }
+        }
+        if (!outside.empty()) {
+            std::cerr << "Safety: the " << (s ? "right" : "left") << " " << outside << " pose is outside the workspace model, "
+                      << "fix the workspace bounds or run with --no-workspace-check" << std::endl;
+            return -1;
+        }
 
-    for (int i = 0; i < harmony::armJointCount; i++) {
-        robotStartPosition = getCurrentArmPositionsAsDataLine(&info);
-        auto overrides = data2override(robotStartPosition, i / nSteps);
+        // every planned move of this side: out and back, redirects in flight, and the change to the other side
+        DataLine start = setSideArmActive<Config>(&info, s);
+        safety.allowMove(start, setSideArmActive<Config>(&info, !s), startPosBufferTime_s);
+        for (char movement : {'x', 'y', 'z'}) {
+            DataLine end = setEndPoint2<Config>(&info, s, movement);
+            safety.allowMove(start, end, beginExBufferTime_s);
+            safety.allowMove(end, start, back2StartBufferTime_s);
+            safety.allowMove(start, end, redirectMinTime_s);
+            for (char other : {'x', 'y', 'z'}) { safety.allowMove(end, setEndPoint2<Config>(&info, s, other), redirectMinTime_s); }
+        }
+    }
+    if (!workspaceCheck) { std::cout << "Safety: workspace check off (--no-workspace-check), joint limits only" << std::endl; }
+
+    // demonstrated movement played back as class 'd'
+    Demonstration<Config> demo;
+    if (!demoPlaybackPath.empty()) {
+        std::string error = demo.load(demoPlaybackPath);
+        if (error.empty()) {
+            demo.sample(fs);
+            if (demo.side() != side) { error = "recorded on the other side"; }
+            for (const DataLine& pose : demo.poses()) {
+                if (error.empty() && !safety.contains(pose)) { error = "leaves the joint limits or the workspace"; }
+            }
+            safety.allowPath(demo.poses());
+        }
+        if (!error.empty()) {
+            std::cerr << "Demonstration " << demoPlaybackPath << ": " << error << std::endl;
+            return -1;
+        }
+        std::cout << "Demonstration loaded as movement d: " << demo.waypoints() << " waypoints, " << demo.duration_s() << " s" << std::endl;
+    }
+
+    MirrorMap<Config> mirror(side, T_ms / 1000.0);
+    if (mirrorMode && !safety.contains(mirror.startPose(setSideArmActive<Config>(&info, side)))) {
+        std::cerr << "Mirror start pose leaves the joint limits or the workspace, check the mirror map" << std::endl;
+        return -1;
+    }
+    if (mirrorMode) { safety.allowMove(setSideArmActive<Config>(&info, side), mirror.startPose(setSideArmActive<Config>(&info, side)), startPosBufferTime_s); }
+    std::cout << "Safety: command limits " << safety.maxVelocity() << " rad/s, " << safety.maxAcceleration() << " rad/s^2 per joint" << std::endl;
+    DataLine measuredPosition;
+    DataLine measuredTorque;
+    JointFilter<Config> jointFilter(T_ms / 1000.0);
+
+    // from here on the control thread leaves the terminal to the console thread
+    bool sharedTerminal = !robot.name.empty();
+    OperatorConsole console(replayPath.empty() && !sharedTerminal ? input.keys() : nullptr, clock, &controlMetrics, robot.name);
+    console.setLossless(clockSpeed >= 0);
+    if (robot.core >= 0 && !pinToCore(robot.core)) { console.post("Could not pin the control thread to core %d", robot.core); }
+
+    // session state reported to the EEG PC, kept up to date by the phases below
+    FeedbackSample status;
+    auto reportStatus = [&]() {
+        RtScope rt;
+        int64_t now_ns = clock->monotonic_ns();
+        if (!feedback.due(now_ns, status.state)) { return; }
+        harmony::Pose hand = side ? info.poses().rightEndEffector : info.poses().leftEndEffector;
+        status.mono_ns = now_ns;
+        status.position_mm[0] = hand.position_mm.x;
+        status.position_mm[1] = hand.position_mm.y;
+        status.position_mm[2] = hand.position_mm.z;
+        feedback.push(status);
+    };
+
+    // wait for the start of the next control tick and deliver the packets that arrived meanwhile
+    int64_t T_ns = int64_t(T_ms) * 1000000LL;
+    int64_t nextTick_ns = clock->monotonic_ns();
+    int64_t tickStart_ns = 0;
+    auto nextTick = [&]() {
+        reportStatus();
+        controlMetrics.trial.store(status.trial, std::memory_order_relaxed);
+        controlMetrics.state.store(uint8_t(status.state), std::memory_order_relaxed);
+        controlMetrics.movement.store(status.movement, std::memory_order_relaxed);
+        controlMetrics.progress.store(status.progress, std::memory_order_relaxed);
+        controlMetrics.side.store(side ? 'r' : 'l', std::memory_order_relaxed);
+
+        int64_t now_ns = clock->monotonic_ns();
+        bump(controlMetrics.ticks);
+        controlMetrics.tickLatency.record(now_ns - nextTick_ns);
+        nextTick_ns += T_ns;
+        if (now_ns > nextTick_ns) { bump(controlMetrics.overruns); }
+        if (now_ns > nextTick_ns + T_ns) { nextTick_ns = now_ns; } // overran, don't try to catch up
+        clock->sleepUntil(nextTick_ns);
+        int64_t start_ns = clock->monotonic_ns();
+        if (tickStart_ns > 0) { controlMetrics.periodError.record(std::llabs(start_ns - tickStart_ns - T_ns)); }
+        tickStart_ns = start_ns;
+        input.nextTick(clock);
+    };
+
+    // one control tick: measure the joints, limit the command, update the stiffness, send the command
+    int64_t readAt_ns = 0;
+    DataLine lastCommand{}; // last command sent, after the safety stage; a pause holds it
+    auto readJoints = [&]() {
+        RtScope rt;
+        readAt_ns = monotonicNs();
+        getCurrentJointStates<Config>(&info, measuredPosition, measuredTorque);
+        jointFilter.update(measuredPosition, measuredTorque);
+    };
+    auto commandOverrides = [&](const DataLine& command) {
+        RtScope rt;
+        const DataLine& safeCommand = safety.apply(command, measuredPosition);
+        controlMetrics.safetyClamped.store(safety.clampedTicks, std::memory_order_relaxed);
+        controlMetrics.safetyHeld.store(safety.holdTicks, std::memory_order_relaxed);
+        const DataLine& stiffness = impedance.update(safeCommand, jointFilter.position(), jointFilter.torque(), T_ms / 1000.0);
+        auto overrides = data2override<Config>(safeCommand, stiffness);
 
         left->setJointsOverride(overrides.leftOverrides);
         right->setJointsOverride(overrides.rightOverrides);
-#ifdef TORSO_MODS
-        torso->setJointsOverride(overrides.torsoOverrides);
-#endif
-        if (i * T_ms % 1000 == 0) {
-            std::cout << ".";
-            std::cout.flush();
+        if constexpr (Config::hasTorso) { torso->setJointsOverride(overrides.torsoOverrides); }
+        controlMetrics.readToCommand.record(monotonicNs() - readAt_ns);
+        lastCommand = safeCommand;
+    };
+    auto sendOverrides = [&](const DataLine& command) {
+        readJoints();
+        commandOverrides(command);
+    };
+    // hand every joint group back to the robot, on every way out of the session
+    auto releaseOverrides = [&]() {
+        left->removeOverride();
+        right->removeOverride();
+        if constexpr (Config::hasTorso) { torso->removeOverride(); }
+    };
+
+    // end the tick. A p from the operator holds the last command until the next p, an s
+    // or e ends the pause as well and is left for the phase to act on.
+    auto waitTick = [&]() {
+        RtScope rt;
+        nextTick();
+        if (commands.peek() != 'p') { return; }
+        char movement = status.movement != 0 ? status.movement : '-';
+        UdpCommand pauseCommand = commands.take();
+        saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, status.trial, movement, logcodec::Trigger::pause, &pauseCommand);
+        controlMetrics.paused.store(true, std::memory_order_relaxed);
+        console.post("Paused, p resumes");
+
+        DataLine hold = lastCommand;
+        while (commands.peek() != 'p' && commands.peek() != 's' && commands.peek() != 'e') {
+            sendOverrides(hold);
+            nextTick();
+        }
+        if (commands.peek() == 'p') {
+            UdpCommand resumeCommand = commands.take();
+            saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, status.trial, movement, logcodec::Trigger::resume, &resumeCommand);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(T_ms));
+        controlMetrics.paused.store(false, std::memory_order_relaxed);
+        console.post("Resumed");
+    };
+
+    int nSteps = ImpedenceBufferTime_s * fs;
+    auto robotStartPosition = getCurrentArmPositionsAsDataLine<Config>(&info);
+    impedance.start(ImpedenceBufferTime_s);
+    int64_t stage_ns = monotonicNs();
+
+    for (int i = 0; i <= nSteps; i++) {
+        robotStartPosition = getCurrentArmPositionsAsDataLine<Config>(&info);
+        status.progress = double(i) / nSteps;
+        sendOverrides(robotStartPosition);
+        waitTick();
     }
+    startup.record("stiffness ramp", stage_ns, monotonicNs());
 
     /*--------- Move Harmony to start position --------*/
-    std::cout << "Moving Harmony to starting position [" << startPosBufferTime_s << "s]";
-    std::cout.flush();
-    nSteps = startPosBufferTime_s * fs;
+    DataLine data;
+    DataLine prevData = robotStartPosition;
+    DataLine exerciseStartPos = setSideArmActive<Config>(&info, side); // setHomePosition(&info)
+
+    // with a start speed the move takes as long as the farthest joint needs, not a fixed time
+    // (a minimum jerk move peaks at 1.875 times its mean speed)
+    double startMove_s = startPosBufferTime_s;
+    if (startMoveSpeed_rad_s > 0.0) {
+        double distance = 0.0;
+        for (int i = 1; i < Config::nCols; i++) { distance = std::max(distance, std::fabs(exerciseStartPos[i] - robotStartPosition[i])); }
+        startMove_s = std::min(startMove_s, std::max(1.0, 1.875 * distance / startMoveSpeed_rad_s));
+    }
+    safety.allowMove(robotStartPosition, exerciseStartPos, startMove_s);
+    console.post("Moving Harmony to starting position [%.1fs]", startMove_s);
+    nSteps = startMove_s * fs;
+    stage_ns = monotonicNs();
+
+    // exercise trajectories of every movement class from the hold pose, built while the patient rests
+    int exerciseSteps = beginExBufferTime_s * fs;
+    TrajectoryCache<Config> trajectories(trajectoryCacheSlots, exerciseSteps);
+    std::array<DataLine, 3> endPoints;
+    for (char movement : {'x', 'y', 'z'}) { endPoints[movement - 'x'] = setEndPoint2<Config>(&info, side, movement); }
+    auto precompute = [&](char selected) {
+        RtScope rt;
+        std::array<char, 4> order = {selected, 0, 0, 0};
+        int n = selected != 0;
+        for (char movement : probabilities.ranking()) {
+            if (movement != selected) { order[n++] = movement; }
+        }
+        int budget = trajectoryPrecomputeRows;
+        for (int k = 0; k < std::min(n, trajectoryCacheSlots) && budget > 0; k++) {
+            budget -= trajectories.prepare(prevData, order[k], endPoints[order[k] - 'x'], exerciseSteps, budget);
+        }
+    };
 
-    std::array<double, nCols> data;
-    std::array<double, nCols> prevData = robotStartPosition;
-    std::array<double, nCols> exerciseStartPos = setSideArmActive(&info, side); // setHomePosition(&info)
+    // every phase change below blends from the running command, see TrajectoryBlender
+    jointtrajectory::TrajectoryBlender<Config> blender(T_ms / 1000.0);
+    blender.hold(robotStartPosition);
 
+    status.state = TrialState::toStart;
+    blender.moveTo(exerciseStartPos, double(nSteps) / fs);
     for (int i = 0; i <= nSteps; i++) {
-        data = step2targetPosition(robotStartPosition, exerciseStartPos, i, nSteps);
-
-        auto overrides = data2override(data);
-
-        left->setJointsOverride(overrides.leftOverrides);
-        right->setJointsOverride(overrides.rightOverrides);
-#ifdef TORSO_MODS
-        torso->setJointsOverride(overrides.torsoOverrides);
-#endif
+        data = blender.next();
+        status.progress = double(i) / nSteps;
 
-        if (i * T_ms % 1000 == 0) {
-            std::cout << ".";
-            std::cout.flush();
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(T_ms));
+        sendOverrides(data);
+        waitTick();
         prevData = data;
     }
 
-    std::cout << "DONE\n";
+    console.post("DONE");
+    startup.record("move to start", stage_ns, monotonicNs());
+    std::stringstream startupReport;
+    startup.report(startupReport);
+    for (std::string line; std::getline(startupReport, line);) { console.post("%s", line.c_str()); }
 
-    if (*UDPinput == 'e') {
-        *UDPinput = 0;
-        std::cout << "Exit detected";
-        left->removeOverride();
-        right->removeOverride();
+    if (commands.peek() == 'e') {
+        UdpCommand exitCommand = commands.take();
+        saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, 0, '-', logcodec::Trigger::exit, &exitCommand);
+        console.post("Exit detected");
+        status.state = TrialState::exit;
+        reportStatus();
+        releaseOverrides();
 
         return -1;
     }
+    // hold pose until the operator starts with g, false if the session is exited instead
+    auto holdForStart = [&](const DataLine& pose, char movement) {
+        status.state = TrialState::ready;
+        status.movement = movement;
+        while (commands.peek() != 'g') {
+            if (commands.peek() == 'e') {
+                UdpCommand exitCommand = commands.take();
+                saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, 0, movement, logcodec::Trigger::exit, &exitCommand);
+                console.post("Exit detected");
+                status.state = TrialState::exit;
+                reportStatus();
+                releaseOverrides();
+                return false;
+            }
+            sendOverrides(pose);
+            waitTick();
+        }
+        UdpCommand startCommand = commands.take();
+        saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, 0, movement, logcodec::Trigger::start, &startCommand);
+        return true;
+    };
+
+    // log the command that ended a free movement (s, or e which ends it the same way)
+    auto takeStop = [&](char movement) {
+        char stop = commands.peek();
+        if (stop != 's' && stop != 'e') { return; }
+        UdpCommand stopCommand = commands.take();
+        saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, 0, movement,
+            stop == 's' ? logcodec::Trigger::stop : logcodec::Trigger::exit, &stopCommand);
+    };
+
+    // move from one pose back to the start pose and end the session
+    auto finishAtStart = [&](const DataLine& from) {
+        console.post("Moving Harmony back to starting position [%ds]", startPosBufferTime_s);
+        status.state = TrialState::toHome;
+        int steps = startPosBufferTime_s * fs;
+        blender.hold(from);
+        blender.moveTo(exerciseStartPos, double(steps) / fs);
+        for (int i = 0; i <= steps; i++) {
+            sendOverrides(blender.next());
+            status.progress = double(i) / steps;
+            waitTick();
+        }
+        console.post("DONE");
+
+        status.state = TrialState::done;
+        reportStatus();
+        releaseOverrides();
+        return 0;
+    };
+
+    /************RECORD A DEMONSTRATION**********/
+    if (!demoRecordPath.empty()) {
+        DemoArena<Config> arena(int(demoMaxLength_s * fs));
+        console.post("Recording a demonstration: g starts, s stops, e drops it");
+        if (!holdForStart(prevData, 'd')) { return -1; }
+
+        // the exercising arm follows the therapist with little stiffness, the other arm holds
+        DataLine compliance;
+        compliance.fill(1.0);
+        int offset = side ? Config::rightOffset : Config::leftOffset;
+        for (int i = 0; i < Config::armJoints; i++) { compliance[offset + i] = demoRecordCompliance; }
+        impedance.setCompliance(compliance);
+        status.state = TrialState::exercise;
+        data = prevData;
+
+        for (int tick = 0; commands.peek() != 's' && commands.peek() != 'e'; tick++) {
+            RtScope rt;
+            for (int i = 0; i < Config::armJoints; i++) { data[offset + i] = measuredPosition[offset + i]; }
+            sendOverrides(data);
+            if (!arena.add(tick * T_ms / 1000.0, jointFilter.position())) {
+                console.post("Recording full [%gs]", demoMaxLength_s);
+                break;
+            }
+            if (tick % 2 == 0) { saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, 0, 'd', logcodec::Trigger::moving); }
+            waitTick();
+        }
+        bool exited = commands.peek() == 'e';
+        takeStop('d');
+        compliance.fill(1.0);
+        impedance.setCompliance(compliance);
+        if (exited) {
+            console.post("Exit detected, demonstration not saved");
+            status.state = TrialState::exit;
+            reportStatus();
+            releaseOverrides();
+            return -1;
+        }
+
+        Demonstration<Config> recorded;
+        recorded.simplify(arena, DEG_2_RAD * demoTolerance_deg, side);
+        if (recorded.save(demoRecordPath)) {
+            console.post("Demonstration saved to %s: %d frames, %d waypoints", demoRecordPath.c_str(), arena.size(), recorded.waypoints());
+        } else {
+            console.post("Failed to write %s", demoRecordPath.c_str());
+        }
+        return finishAtStart(data);
+    }
+
+    /************MIRROR THERAPY**********/
+    if (mirrorMode) {
+        DataLine mirrorStart = mirror.startPose(exerciseStartPos);
+        console.post("Moving the other arm to the mirrored start [%ds]", startPosBufferTime_s);
+        nSteps = startPosBufferTime_s * fs;
+        for (int i = 0; i <= nSteps; i++) {
+            sendOverrides(jointtrajectory::step2targetPosition<Config>(prevData, mirrorStart, i, nSteps));
+            waitTick();
+        }
+        console.post("DONE");
+        console.post("Mirror therapy at %g Hz: g starts, s stops", fs);
+        if (!holdForStart(mirrorStart, 'm')) { return -1; }
+
+        // the healthy arm is moved by the patient, the exercising arm mirrors it
+        DataLine compliance;
+        compliance.fill(1.0);
+        for (int i = 0; i < Config::armJoints; i++) { compliance[mirror.healthyOffset() + i] = mirrorHealthyCompliance; }
+        impedance.setCompliance(compliance);
+        status.state = TrialState::exercise;
+
+        readJoints();
+        mirror.start(measuredPosition, mirrorStart);
+        int64_t latencySum_ns = 0, latencyMax_ns = 0;
+        int tick = 0;
+        for (; commands.peek() != 's' && commands.peek() != 'e'; tick++) {
+            RtScope rt;
+            readJoints();
+            commandOverrides(mirror.update(measuredPosition));
+            int64_t latency_ns = monotonicNs() - readAt_ns;
+            latencySum_ns += latency_ns;
+            latencyMax_ns = std::max(latencyMax_ns, latency_ns);
+            if (tick % 2 == 0) { saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, 0, 'm', logcodec::Trigger::moving); }
+            waitTick();
+        }
+        takeStop('m');
+        compliance.fill(1.0);
+        impedance.setCompliance(compliance);
+
+        console.post("Mirrored %d ticks (%gs), read to command mean %g us, max %g us (period %u us)", tick, tick / fs,
+            (tick > 0 ? latencySum_ns / tick : 0) / 1000.0, latencyMax_ns / 1000.0, T_ms * 1000);
+        return finishAtStart(mirror.command());
+    }
+
+    // n from the operator: log it and leave the rest of the trial out
+    auto skipTrial = [&](int trial, char movement) {
+        UdpCommand skipCommand = commands.take();
+        saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, trial, movement, logcodec::Trigger::skip, &skipCommand);
+        console.post("Trial %d skipped", trial);
+    };
+
+    // c from the operator while selecting: exercise the other arm from now on
+    auto changeSide = [&]() {
+        UdpCommand sideCommand = commands.take();
+        side = !side;
+        saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, status.trial, side ? 'r' : 'l', logcodec::Trigger::side, &sideCommand);
+        console.post("Changing to the %s side [%ds]", side ? "RIGHT" : "LEFT", startPosBufferTime_s);
+
+        exerciseStartPos = setSideArmActive<Config>(&info, side);
+        for (char movement : {'x', 'y', 'z'}) { endPoints[movement - 'x'] = setEndPoint2<Config>(&info, side, movement); }
+        status.state = TrialState::toStart;
+        int steps = startPosBufferTime_s * fs;
+        blender.moveTo(exerciseStartPos, double(steps) / fs);
+        for (int i = 0; i <= steps; i++) {
+            prevData = blender.next();
+            status.progress = double(i) / steps;
+            sendOverrides(prevData);
+            waitTick();
+        }
+        status.state = TrialState::select;
+        status.progress = 0.0;
+        console.post("DONE");
+    };
+
     int iterations = 0;
     /************START OF TRIAL LOOP**********/
     for (int i = 0; i < 20; i++){
         iterations++;
-        std::cout << "Waiting for exercise selection..."<<std::endl;
+        console.post("Waiting for exercise selection...");
+        status.state = TrialState::select;
+        status.trial = iterations;
+        status.movement = 0;
+        status.progress = 0.0;
 
 
         while (true) {
-            
-
-            if (*UDPinput == 'x' || *UDPinput == 'y' || *UDPinput == 'z' || *UDPinput == 'e') {
-                if (*UDPinput == 'e') {
+            sendOverrides(prevData); // hold position while waiting
+            precompute(0);
+            waitTick();
+
+            char input = commands.peek();
+            if (input == 'c') {
+                changeSide();
+                continue;
+            }
+            if (input == 'x' || input == 'y' || input == 'z' || input == 'e' || input == 'n' || (input == 'd' && demo.loaded() && demo.side() == side)) {
+                if (input == 'e') {
 
-                    *UDPinput = 0;
-                    std::cout << "Exit detected";
-                    left->removeOverride();
-                    right->removeOverride();
+                    UdpCommand exitCommand = commands.take();
+                    saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, '-', logcodec::Trigger::exit, &exitCommand);
+                    console.post("Exit detected");
+                    status.state = TrialState::exit;
+                    reportStatus();
+                    releaseOverrides();
 
                     return -1;
 
@@ -851,62 +4435,112 @@ int main() {
             }
         }                
 
-        char movement = *UDPinput;
-        *UDPinput = 0;       
-
-        std::cout << "Waiting to start exercise\n";
-        // WAIT FOR UDP INPUT (g to START)
-        while (*UDPinput != 'g');
+        if (commands.peek() == 'n') {
+            skipTrial(iterations, '-');
+            continue;
+        }
+        UdpCommand selectCommand = commands.take();
+        char movement = selectCommand.cmd;
+        saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, movement, logcodec::Trigger::select, &selectCommand);
+
+        console.post("Waiting to start exercise");
+        status.state = TrialState::ready;
+        status.movement = movement;
+        // WAIT FOR UDP INPUT (g to START, n skips the trial)
+        while (commands.peek() != 'g' && commands.peek() != 'n') {
+            sendOverrides(prevData);
+            precompute(movement);
+            waitTick();
+        }
+        if (commands.peek() == 'n') {
+            skipTrial(iterations, movement);
+            continue;
+        }
 
-        std::string trigger_type = "START";     
-        saveDataInLogFile(&logFile, &info, iterations, movement, trigger_type); 
-        *UDPinput = 0;
+        UdpCommand startCommand = commands.take();
+        logcodec::Trigger trigger_type = logcodec::Trigger::start;     
+        saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, movement, trigger_type, &startCommand); 
 
         /*--------- Begin exercise [60s] --------*/
-        nSteps = beginExBufferTime_s * fs;
+        bool demonstrated = movement == 'd';
+        nSteps = demonstrated ? demo.steps() : int(beginExBufferTime_s * fs);
 
-        robotStartPosition = prevData; // getCurrentArmPositionsAsDataLine(&info);
-        exerciseStartPos = setEndPoint2(&info, side, movement);
+        robotStartPosition = prevData; // getCurrentArmPositionsAsDataLine<Config>(&info);
+        exerciseStartPos = demonstrated ? demo.end() : setEndPoint2<Config>(&info, side, movement);
+        const DataLine* trajectory =
+            demonstrated ? nullptr : trajectories.trajectory(robotStartPosition, movement, exerciseStartPos, nSteps);
 
-        trigger_type = "MOVING";
+        trigger_type = logcodec::Trigger::moving;
+        bool skipped = false; // n during the movement: stop it and leave out the waits of this trial
+        bool redirected = false; // X/Y/Z during the movement: the blender heads for the new end point
         int counter = 0;
+        status.state = TrialState::exercise;
 
         for (int i = 0; i < nSteps; i++) {
+            RtScope rt;
             counter++;
 
             if(counter % 2 == 0){
-                saveDataInLogFile(&logFile, &info, iterations, movement, trigger_type); 
+                saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, movement, trigger_type); 
             }
             
 
             // WAIT FOR UDP INPUT (s = stop)
-            if (*UDPinput == 's') {
-                std::cout << "Stop Requested\n";
+            if (commands.peek() == 's') {
+                console.post("Stop Requested");
 
-                trigger_type = "STOP";
-                saveDataInLogFile(&logFile, &info, iterations, movement, trigger_type); 
+                UdpCommand stopCommand = commands.take();
+                trigger_type = logcodec::Trigger::stop;
+                saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, movement, trigger_type, &stopCommand); 
 
-                *UDPinput = 0;
-                prevData = data;
+                blender.stop(stopBlendTime_s); // the rest below finishes the deceleration
                 break;
             }
+            if (commands.peek() == 'n') {
+                skipTrial(iterations, movement); // the way home starts from the running motion
+                skipped = true;
+                break;
+            }
+            char redirect = commands.peek();
+            if (redirect == 'X' || redirect == 'Y' || redirect == 'Z') {
+                UdpCommand redirectCommand = commands.take();
+                movement = char(tolower(redirect));
+                saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, movement, logcodec::Trigger::redirect, &redirectCommand);
+                console.post("Redirected to %c", movement);
+
+                // keep the remaining time if there is enough of it, never end with a lunge
+                int steps = std::max(nSteps - i, int(redirectMinTime_s * fs));
+                exerciseStartPos = endPoints[movement - 'x'];
+                blender.moveTo(exerciseStartPos, double(steps) / fs);
+                nSteps = i + steps;
+                redirected = true;
+                demonstrated = false;
+                status.movement = movement;
+            }
 
-            data = step2targetPosition(robotStartPosition, exerciseStartPos, i, nSteps);
-
-            auto overrides = data2override(data);
+            if (redirected) {
+                data = blender.next();
+            } else {
+                if (demonstrated) {
+                    data = demo.pose(i, robotStartPosition, fs);
+                } else {
+                    data = trajectory != nullptr ? trajectory[i] : jointtrajectory::step2targetPosition<Config>(robotStartPosition, exerciseStartPos, i, nSteps);
+                }
+                blender.track(data);
+            }
+            status.progress = double(i + 1) / nSteps;
 
-            left->setJointsOverride(overrides.leftOverrides);
-            right->setJointsOverride(overrides.rightOverrides);
+            sendOverrides(data);
+            if (i == 0) { controlMetrics.commandLatency.record(clock->monotonic_ns() - startCommand.rx_mono_ns); }
 
             if (i * T_ms % 1000 == 0) {
-                std::cout << ".";
-                std::cout.flush();
-
-                if (*UDPinput == 'e') {
-                    *UDPinput = 0;
-                    std::cout << "Exit detected";
-                    left->removeOverride();
-                    right->removeOverride();
+                if (commands.peek() == 'e') {
+                    UdpCommand exitCommand = commands.take();
+                    saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, movement, logcodec::Trigger::exit, &exitCommand);
+                    console.post("Exit detected");
+                    status.state = TrialState::exit;
+                    reportStatus();
+                    releaseOverrides();
 
                     return -1;
                 }
@@ -914,116 +4548,567 @@ int main() {
 
             prevData = data;
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(T_ms));
+            waitTick();
         }
-        std::cout << "EXERCISE DONE\n";
+        console.post("EXERCISE DONE");
 
         //     /*--------- Wait 5s before new command --------*/
 
-        std::cout << "Waiting time [" << waitBufferTime_s << "s]";
-        std::cout.flush();
+        console.post("Waiting time [%ds]", waitBufferTime_s);
 
-        nSteps = waitBufferTime_s * fs;
+        nSteps = skipped ? -1 : waitBufferTime_s * fs;
+        status.state = TrialState::rest; // progress stays where the movement ended
 
         for (int i = 0; i <= nSteps; i++) {
 
             if (i * T_ms % 1000 == 0) {
-                std::cout << ".";
-                std::cout.flush();
-
-                if (*UDPinput == 'e') {
-                    *UDPinput = 0;
-                    std::cout << "Exit detected";
-                    left->removeOverride();
-                    right->removeOverride();
+                if (commands.peek() == 'e') {
+                    UdpCommand exitCommand = commands.take();
+                    saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, movement, logcodec::Trigger::exit, &exitCommand);
+                    console.post("Exit detected");
+                    status.state = TrialState::exit;
+                    reportStatus();
+                    releaseOverrides();
 
                     return -1;
                 }
             }
 
-            // prevData = data;
-            std::this_thread::sleep_for(std::chrono::milliseconds(T_ms));
+            prevData = blender.next(); // hold position, or finish the stop
+            sendOverrides(prevData); // stiffness keeps adapting
+            waitTick();
+            if (commands.peek() == 'n') {
+                skipTrial(iterations, movement);
+                skipped = true;
+                break;
+            }
         }
 
-        std::cout << "WAIT DONE -- 1\n";
+        console.post("WAIT DONE -- 1");
 
         /*--------- Move Harmony back to start position --------*/
-        std::cout << "Moving Harmony back to starting position [" << back2StartBufferTime_s << "s]";
-        std::cout.flush();
+        console.post("Moving Harmony back to starting position [%ds]", back2StartBufferTime_s);
 
         nSteps = back2StartBufferTime_s * fs;
 
-        // std::array<double, nCols> data;
-        robotStartPosition = prevData; // getCurrentArmPositionsAsDataLine(&info);
-        exerciseStartPos = setSideArmActive(&info, side); // setHomePosition(&info);
+        // DataLine data;
+        exerciseStartPos = setSideArmActive<Config>(&info, side); // setHomePosition(&info);
+        status.state = TrialState::toHome;
+        blender.moveTo(exerciseStartPos, double(nSteps) / fs); // continues a movement cut short by n
 
         for (int i = 0; i <= nSteps; i++) {
-            data = step2targetPosition(robotStartPosition, exerciseStartPos, i, nSteps);
+            data = blender.next();
+            status.progress = double(i) / nSteps;
 
-            auto overrides = data2override(data);
-
-            left->setJointsOverride(overrides.leftOverrides);
-            right->setJointsOverride(overrides.rightOverrides);
-#ifdef TORSO_MODS
-            torso->setJointsOverride(overrides.torsoOverrides);
-#endif
+            sendOverrides(data);
 
             if (i * T_ms % 1000 == 0) {
-                std::cout << ".";
-                std::cout.flush();
-
-                if (*UDPinput == 'e') {
-                    *UDPinput = 0;
-                    std::cout << "Exit detected";
-                    left->removeOverride();
-                    right->removeOverride();
+                if (commands.peek() == 'e') {
+                    UdpCommand exitCommand = commands.take();
+                    saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, movement, logcodec::Trigger::exit, &exitCommand);
+                    console.post("Exit detected");
+                    status.state = TrialState::exit;
+                    reportStatus();
+                    releaseOverrides();
 
                     return -1;
                 }
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(T_ms));
+            waitTick();
             prevData = data;
         }
 
-        std::cout << "WE DID IT!" << std::endl;
+        console.post("WE DID IT!");
 
         /*--------- Wait 5s before new command --------*/
 
-        std::cout << "Waiting time at home -- 2[" << waitBufferTime2_s << "s]";
-        std::cout.flush();
+        console.post("Waiting time at home -- 2[%ds]", waitBufferTime2_s);
 
-        nSteps = waitBufferTime2_s * fs;
+        nSteps = skipped ? -1 : waitBufferTime2_s * fs;
+        status.state = TrialState::home;
 
         for (int i = 0; i <= nSteps; i++) {
 
             if (i * T_ms % 1000 == 0) {
-                std::cout << ".";
-                std::cout.flush();
-
-                if (*UDPinput == 'e') {
-                    *UDPinput = 0;
-                    std::cout << "Exit detected";
-                    left->removeOverride();
-                    right->removeOverride();
+                if (commands.peek() == 'e') {
+                    UdpCommand exitCommand = commands.take();
+                    saveDataInLogFile<Config>(&logFile, &info, &jointFilter, clock, iterations, movement, logcodec::Trigger::exit, &exitCommand);
+                    console.post("Exit detected");
+                    status.state = TrialState::exit;
+                    reportStatus();
+                    releaseOverrides();
 
                     return -1;
                 }
             }
 
+            sendOverrides(prevData); // hold position, stiffness keeps adapting
+            precompute(0);
             // prevData = data;
-            std::this_thread::sleep_for(std::chrono::milliseconds(T_ms));
+            waitTick();
+            if (commands.peek() == 'n') {
+                skipTrial(iterations, movement);
+                break;
+            }
         }
-        std::cout << "WAIT DONE -- 2\n";
+        console.post("WAIT DONE -- 2");
     } // end of trial loop!    
 
     /*--------- Close out --------*/
+    status.state = TrialState::done;
+    reportStatus();
 
-    left->removeOverride();
-    right->removeOverride();
-#ifdef TORSO_MODS
-    torso->removeOverride();
-#endif
-    close(sockfd);
+    releaseOverrides();
+
+    console.post("Safety: %llu ticks limited, %llu ticks held", (unsigned long long)safety.clampedTicks,
+        (unsigned long long)safety.holdTicks);
+    console.post("Trajectories ready at start: %llu, computed on demand: %llu", (unsigned long long)trajectories.hits,
+        (unsigned long long)trajectories.misses);
 
     return 0;
 }
+
+/**
+ * @brief Read the configuration of one robot of a multi-robot process
+ * Same format as readConfigFile. Keys: name, port, core, script, feedback, relay (repeatable) and the startup
+ * answers subject, online, session, run, side. Whatever is not given keeps the value of robot.
+ */
+bool readRobotFile(const std::string& path, RobotInstance& robot) {
+    std::vector<std::string> options;
+    if (!readConfigFile(path, options)) { return false; }
+    for (size_t i = 0; i + 1 < options.size(); i += 2) {
+        std::string key = options[i].substr(2), value = options[i + 1];
+        if (key == "name") {
+            robot.name = value;
+        } else if (key == "port") {
+            robot.port = std::atoi(value.c_str());
+        } else if (key == "core") {
+            robot.core = std::atoi(value.c_str());
+        } else if (key == "script") {
+            robot.scriptPath = value;
+        } else if (key == "feedback") {
+            robot.feedbackDestination = value;
+        } else if (key == "relay") {
+            robot.relays.push_back(value);
+        } else if (key == "subject" || key == "online" || key == "session" || key == "run" || key == "side") {
+            robot.presets[key] = value;
+        } else {
+            std::cerr << path << ": unknown key " << key << std::endl;
+            return false;
+        }
+    }
+    if (options.size() % 2 != 0) {
+        std::cerr << path << ": " << options.back().substr(2) << " needs a value" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Print how late the ticks of every robot finished after their deadline
+ */
+void printTickReport(const std::vector<std::unique_ptr<RobotInstance>>& robots) {
+    std::cout << "robot         core      ticks  overruns  late mean [us]  p99 [us]  max [us]\n";
+    for (const auto& robot : robots) {
+        const ControlMetrics& m = robot->control;
+        char line[160];
+        snprintf(line, sizeof(line), "%-12s %5d %10llu %9llu %15.1f %9.1f %9.1f", robot->name.c_str(), robot->core,
+            (unsigned long long)m.ticks.load(), (unsigned long long)m.overruns.load(), m.tickLatency.mean_ns() / 1000.0,
+            m.tickLatency.quantile_ns(0.99) / 1000.0, m.tickLatency.max_ns() / 1000.0);
+        std::cout << line << "\n";
+    }
+    std::cout.flush();
+}
+
+/******************************************************************************************
+ * Session benchmark
+ *  --bench runs a whole session on the real clock and writes how well it kept time as
+ *  JSON. With --bench-baseline the results are checked against a stored run and the
+ *  process fails if a metric got worse than the baseline's thresholds allow. A bench
+ *  file carries its thresholds, so a good run can be kept as the next baseline as it is.
+ *  Timing only compares on the same hardware: every bench file names the machine it was
+ *  recorded on, a baseline directory holds one file per machine (<host>.json, or the
+ *  --bench-machine name), and a baseline from another machine or CPU is refused.
+ *  bench_session.sh runs the whole check.
+ *****************************************************************************************/
+
+/**
+ * @brief The machine a benchmark ran on, baselines only compare on the same one
+ */
+struct BenchMachine {
+    std::string id; // host name or --bench-machine, also the baseline file name in a baseline directory
+    std::string cpu;
+    int cores = 0;
+    std::string kernel;
+};
+
+/**
+ * @param id name of the machine, empty for its host name (CI runners change host names)
+ */
+BenchMachine benchMachine(const std::string& id) {
+    BenchMachine machine;
+    char host[256] = {};
+    machine.id = id;
+    if (id.empty() && gethostname(host, sizeof(host) - 1) == 0) { machine.id = host; }
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    for (std::string line; machine.cpu.empty() && std::getline(cpuinfo, line);) {
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos) {
+            machine.cpu = line.substr(line.find(':') + 1);
+            machine.cpu.erase(0, machine.cpu.find_first_not_of(' '));
+        }
+    }
+    machine.cores = int(std::thread::hardware_concurrency());
+    utsname system;
+    if (uname(&system) == 0) { machine.kernel = system.release; }
+    return machine;
+}
+
+/**
+ * @brief One benchmark result and how much worse than its baseline it may get
+ * Allowed is value <= baseline * ratio + slack, or value >= baseline / ratio - slack
+ * for the metrics where lower is worse.
+ */
+struct BenchMetric {
+    const char* name;
+    bool lowerIsWorse;
+    double ratio;
+    double slack;
+    double value;
+};
+
+/**
+ * @brief Timing results of a finished session, with the default thresholds
+ */
+std::vector<BenchMetric> benchMetrics(const RobotInstance& robot) {
+    const ControlMetrics& m = robot.control;
+    double logBusy_s = robot.log.busy_ns * 1e-9;
+    return {
+        {"tick_period_error_mean_us", false, 2.0, 50.0, m.periodError.mean_ns() / 1000.0},
+        {"tick_period_error_p99_us", false, 2.0, 250.0, m.periodError.quantile_ns(0.99) / 1000.0},
+        {"tick_period_error_max_us", false, 3.0, 1000.0, m.periodError.max_ns() / 1000.0},
+        {"tick_overruns", false, 2.0, 10.0, double(m.overruns.load())},
+        {"tick_late_p99_us", false, 2.0, 250.0, m.tickLatency.quantile_ns(0.99) / 1000.0},
+        {"command_latency_mean_us", false, 2.0, 500.0, m.commandLatency.mean_ns() / 1000.0},
+        {"command_latency_max_us", false, 2.0, 1000.0, m.commandLatency.max_ns() / 1000.0},
+        {"read_to_command_p99_us", false, 2.0, 50.0, m.readToCommand.quantile_ns(0.99) / 1000.0},
+        {"log_frames_dropped", false, 1.0, 0.0, double(robot.log.dropped)},
+        {"log_writer_frames_per_s", true, 2.0, 0.0, logBusy_s > 0.0 ? robot.log.frames / logBusy_s : 0.0},
+    };
+}
+
+/**
+ * @brief Write the results of a benchmark session as JSON
+ */
+bool writeBenchReport(const std::string& path, const std::vector<BenchMetric>& metrics, const RobotInstance& robot,
+    const std::string& jointConfig, const BenchMachine& machine, double duration_s) {
+    auto quoted = [](const std::string& text) {
+        std::string out = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') { out += '\\'; }
+            if (c >= ' ') { out += c; }
+        }
+        return out + "\"";
+    };
+    std::ofstream out(path);
+    out << std::fixed << std::setprecision(3);
+    out << "{\n  \"benchmark\": \"bmi_exercise session\",\n"
+        << "  \"machine\": {\"id\": " << quoted(machine.id) << ", \"cpu\": " << quoted(machine.cpu) << ", \"cores\": " << machine.cores
+        << ", \"kernel\": " << quoted(machine.kernel) << "},\n"
+        << "  \"compiler\": " << quoted(__VERSION__) << ",\n"
+        << "  \"joints\": \"" << jointConfig << "\",\n"
+        << "  \"duration_s\": " << duration_s << ",\n"
+        << "  \"ticks\": " << robot.control.ticks.load() << ",\n"
+        << "  \"log_frames\": " << robot.log.frames << ",\n"
+        << "  \"log_bytes\": " << robot.log.bytes << ",\n"
+        << "  \"metrics\": {\n";
+    for (size_t i = 0; i < metrics.size(); i++) {
+        out << "    \"" << metrics[i].name << "\": " << metrics[i].value << (i + 1 < metrics.size() ? ",\n" : "\n");
+    }
+    out << "  },\n  \"thresholds\": {\n";
+    for (size_t i = 0; i < metrics.size(); i++) {
+        out << "    \"" << metrics[i].name << "\": {\"ratio\": " << metrics[i].ratio << ", \"slack\": " << metrics[i].slack << "}"
+            << (i + 1 < metrics.size() ? ",\n" : "\n");
+    }
+    out << "  }\n}\n";
+    return bool(out);
+}
+
+/**
+ * @brief Load the baseline of this machine, checked before the benchmark session runs
+ * @param path a bench file, or a directory with one per machine (<id>.json)
+ * @param baseline numbers of the baseline file
+ * @return empty if the baseline was recorded on this machine, otherwise why it can't be used
+ */
+std::string loadBenchBaseline(std::string path, const BenchMachine& machine, std::map<std::string, double>& baseline) {
+    struct stat info;
+    bool directory = stat(path.c_str(), &info) == 0 ? S_ISDIR(info.st_mode) : path.size() < 5 || path.compare(path.size() - 5, 5, ".json") != 0;
+    if (directory) { path += "/" + machine.id + ".json"; }
+    std::map<std::string, std::string> text;
+    if (!jsonreader::readJson(path, baseline, text)) {
+        return "no bench baseline " + path + " for this machine (" + machine.id + "), record one with --bench " + path;
+    }
+    if (text["machine.id"] != machine.id || text["machine.cpu"] != machine.cpu || baseline["machine.cores"] != machine.cores) {
+        std::ostringstream error;
+        error << "bench baseline " << path << " was recorded on " << text["machine.id"] << " (" << text["machine.cpu"] << ", "
+              << baseline["machine.cores"] << " cores), this is " << machine.id << " (" << machine.cpu << ", " << machine.cores
+              << " cores): timings only compare on the same machine";
+        return error.str();
+    }
+    return "";
+}
+
+/**
+ * @brief Check benchmark results against a baseline and print the comparison
+ * The baseline's thresholds replace the defaults, so they are carried into the report.
+ * @return number of metrics worse than allowed
+ */
+int compareBench(std::vector<BenchMetric>& metrics, std::map<std::string, double>& baseline) {
+    int regressions = 0;
+    std::cout << "metric                         baseline        value        limit\n";
+    for (BenchMetric& m : metrics) {
+        std::string key = m.name;
+        if (baseline.count("thresholds." + key + ".ratio")) { m.ratio = baseline["thresholds." + key + ".ratio"]; }
+        if (baseline.count("thresholds." + key + ".slack")) { m.slack = baseline["thresholds." + key + ".slack"]; }
+        char line[160];
+        auto base = baseline.find("metrics." + key);
+        if (base == baseline.end()) {
+            snprintf(line, sizeof(line), "%-28s %12s %12.1f", m.name, "-", m.value);
+            std::cout << line << "\n";
+            continue;
+        }
+        double limit = m.lowerIsWorse ? base->second / m.ratio - m.slack : base->second * m.ratio + m.slack;
+        bool worse = m.lowerIsWorse ? m.value < limit : m.value > limit;
+        snprintf(line, sizeof(line), "%-28s %12.1f %12.1f %12.1f%s", m.name, base->second, m.value, limit, worse ? "  REGRESSION" : "");
+        std::cout << line << "\n";
+        regressions += worse;
+    }
+    std::cout.flush();
+    return regressions;
+}
+
+int main(int argc, char** argv) {
+
+    /*--------- Command line --------*/
+    double clockSpeed = -1.0; // < 0: real clock
+    std::string scriptPath;
+    std::string jointConfig = DEFAULT_JOINT_CONFIG;
+    int core = -1; // control thread core of a single robot
+    int nRobots = 0; // --robots
+    std::vector<std::string> robotFiles; // --robot
+    int ioThreads = 2; // writer threads shared by the robots of a multi-robot process
+    std::string benchPath; // --bench
+    std::string benchBaseline; // --bench-baseline
+    std::string benchMachineId; // --bench-machine
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (size_t i = 0; i < args.size(); i++) {
+        std::string arg = args[i];
+        if (arg == "--config" && i + 1 < args.size()) {
+            // options from the file go before the rest of the command line, which overrides them
+            std::vector<std::string> options;
+            if (!readConfigFile(args[++i], options)) { return -1; }
+            args.insert(args.begin() + i + 1, options.begin(), options.end());
+        } else if ((arg == "--subject" || arg == "--online" || arg == "--session" || arg == "--run" || arg == "--side") &&
+                   i + 1 < args.size()) {
+            startupPresets[arg.substr(2)] = args[++i];
+        } else if (arg == "--ramp-time" && i + 1 < args.size()) {
+            ImpedenceBufferTime_s = std::atoi(args[++i].c_str());
+        } else if (arg == "--start-time" && i + 1 < args.size()) {
+            startPosBufferTime_s = std::atoi(args[++i].c_str());
+        } else if (arg == "--start-speed" && i + 1 < args.size()) {
+            startMoveSpeed_rad_s = std::atof(args[++i].c_str());
+        } else if (arg == "--script" && i + 1 < args.size()) {
+            scriptPath = args[++i];
+        } else if (arg == "--joints" && i + 1 < args.size()) {
+            jointConfig = args[++i];
+        } else if (arg == "--no-workspace-check") {
+            workspaceCheck = false;
+        } else if (arg == "--feedback" && i + 1 < args.size()) {
+            feedbackDestination = args[++i];
+        } else if (arg == "--group" && i + 1 < args.size()) {
+            commandGroup = args[++i];
+        } else if (arg == "--source" && i + 1 < args.size()) {
+            commandSources.push_back(args[++i]);
+        } else if (arg == "--group-interface" && i + 1 < args.size()) {
+            commandInterface = args[++i];
+        } else if (arg == "--relay" && i + 1 < args.size()) {
+            relayDestinations.push_back(args[++i]);
+        } else if (arg == "--feedback-rate" && i + 1 < args.size()) {
+            feedbackRate_Hz = std::atof(args[++i].c_str());
+        } else if (arg == "--metrics-port" && i + 1 < args.size()) {
+            metricsPort = std::atoi(args[++i].c_str());
+        } else if (arg == "--record" && i + 1 < args.size()) {
+            demoRecordPath = args[++i];
+        } else if (arg == "--demo" && i + 1 < args.size()) {
+            demoPlaybackPath = args[++i];
+        } else if (arg == "--mirror") {
+            mirrorMode = true;
+        } else if (arg == "--mirror-rate" && i + 1 < args.size()) {
+            mirrorRate_Hz = std::atof(args[++i].c_str());
+            if (!(mirrorRate_Hz > 0.0 && mirrorRate_Hz <= 1000.0)) {
+                std::cerr << "--mirror-rate must be in (0, 1000] Hz" << std::endl;
+                return -1;
+            }
+        } else if (arg == "--mirror-gain" && i + 1 < args.size()) {
+            double gain = std::atof(args[++i].c_str());
+            for (double& g : mirrorGain) { g = gain; }
+        } else if (arg == "--replay" && i + 1 < args.size()) {
+            replayPath = args[++i];
+        } else if (arg == "--print-journal" && i + 1 < args.size()) {
+            return printJournal(args[++i]);
+        } else if (arg == "--core" && i + 1 < args.size()) {
+            core = std::atoi(args[++i].c_str());
+        } else if (arg == "--robots" && i + 1 < args.size()) {
+            nRobots = std::atoi(args[++i].c_str());
+            if (nRobots < 1) {
+                std::cerr << "--robots needs at least 1 robot" << std::endl;
+                return -1;
+            }
+        } else if (arg == "--robot" && i + 1 < args.size()) {
+            robotFiles.push_back(args[++i]);
+        } else if (arg == "--io-threads" && i + 1 < args.size()) {
+            ioThreads = std::max(1, std::atoi(args[++i].c_str()));
+#ifdef SIM_BACKEND
+        } else if (arg == "--speed" && i + 1 < args.size()) {
+            clockSpeed = std::atof(args[++i].c_str());
+#endif
+#ifdef RT_ALLOC_CHECK
+        } else if (arg == "--alloc-fail") {
+            rtAllocFail = true;
+#endif
+        } else if (arg == "--bench" && i + 1 < args.size()) {
+            benchPath = args[++i];
+        } else if (arg == "--bench-baseline" && i + 1 < args.size()) {
+            benchBaseline = args[++i];
+        } else if (arg == "--bench-machine" && i + 1 < args.size()) {
+            benchMachineId = args[++i];
+        } else if (arg == "--bench-configs") {
+            benchmarkConfigs();
+            return 0;
+        } else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (jointConfig != "arms" && jointConfig != "torso" && jointConfig != "wrist" && jointConfig != "torso-wrist") {
+        printUsage(argv[0]);
+        return -1;
+    }
+    if ((jointConfig == "wrist" || jointConfig == "torso-wrist") && !WristMods::available) {
+        std::cerr << "The research interface has no wrist mod joints" << std::endl;
+        return -1;
+    }
+
+    /*--------- Robots: the command line describes one, --robots and --robot several --------*/
+    std::vector<std::unique_ptr<RobotInstance>> robots;
+    bool multiRobot = nRobots > 0 || !robotFiles.empty();
+    int nCores = std::max(1, int(std::thread::hardware_concurrency()));
+    for (int i = 0; i < std::max(1, nRobots + int(robotFiles.size())); i++) {
+        std::unique_ptr<RobotInstance> robot(new RobotInstance());
+        robot->scriptPath = scriptPath;
+        robot->feedbackDestination = feedbackDestination;
+        robot->relays = relayDestinations;
+        robot->presets = startupPresets;
+        robot->core = core;
+        if (multiRobot) {
+            // core 0 is left to the rest of the process while there are cores to spare
+            robot->name = "robot" + std::to_string(i);
+            robot->port = PORT + i;
+            robot->core = nCores > 1 ? 1 + i % (nCores - 1) : 0;
+        }
+        if (i >= nRobots && i - nRobots < int(robotFiles.size()) && !readRobotFile(robotFiles[i - nRobots], *robot)) { return -1; }
+        robots.push_back(std::move(robot));
+    }
+    if (multiRobot) {
+        if (!replayPath.empty() || !demoRecordPath.empty()) {
+            std::cerr << "--replay and --record run a single robot" << std::endl;
+            return -1;
+        }
+        for (size_t i = 0; i < robots.size(); i++) {
+            const RobotInstance& robot = *robots[i];
+            for (const char* key : {"subject", "online", "session", "run", "side"}) {
+                if (robot.presets.count(key) == 0) {
+                    std::cerr << "Robot " << robot.name << " needs --" << key << ", several robots cannot ask at the terminal" << std::endl;
+                    return -1;
+                }
+            }
+            for (size_t j = 0; j < i; j++) {
+                if (robots[j]->name == robot.name || robots[j]->port == robot.port) {
+                    std::cerr << "Robots " << robots[j]->name << " and " << robot.name << " share a name or a port" << std::endl;
+                    return -1;
+                }
+            }
+        }
+    }
+
+    bool bench = !benchPath.empty() || !benchBaseline.empty();
+    std::map<std::string, double> baselineNumbers; // --bench-baseline, checked up front
+    if (bench) {
+        if (multiRobot || !replayPath.empty() || !demoRecordPath.empty() || mirrorMode || clockSpeed >= 0.0) {
+            std::cerr << "--bench times one trial session on the real clock, without --robots, --replay, --record, --mirror or --speed" << std::endl;
+            return -1;
+        }
+        if (!benchBaseline.empty()) {
+            std::string error = loadBenchBaseline(benchBaseline, benchMachine(benchMachineId), baselineNumbers);
+            if (!error.empty()) {
+                std::cerr << "--bench-baseline: " << error << std::endl;
+                return -1;
+            }
+        }
+        // headless: startup answers not given on the command line get fixed ones
+        for (const auto& answer : std::map<std::string, std::string>{{"subject", "1"}, {"online", "0"}, {"session", "1"}, {"run", "1"}, {"side", "r"}}) {
+            robots[0]->presets.insert(answer);
+        }
+    }
+
+    // writer threads and the metrics endpoint are shared by all robots
+    std::unique_ptr<IoPool> io(multiRobot ? new IoPool(ioThreads) : nullptr);
+    MetricsRegistry metrics;
+    metrics::MetricsServer metricsServer(metricsPort, [&](std::ostream& out) { metrics.render(out); });
+    for (auto& robot : robots) {
+        robot->io = io.get();
+        robot->metrics = &metrics;
+    }
+
+    // the configuration is picked once here, everything below runs on fixed sizes
+    auto session = [&](RobotInstance& robot) -> int {
+        if (jointConfig == "arms") { return runSession<ArmsOnly>(clockSpeed, robot); }
+        if (jointConfig == "torso") { return runSession<ArmsTorso>(clockSpeed, robot); }
+        if (jointConfig == "wrist") { return runSession<WristMods>(clockSpeed, robot); }
+        return runSession<TorsoWristMods>(clockSpeed, robot);
+    };
+#ifdef RT_ALLOC_CHECK
+    rtalloc::prime();
+#endif
+    int result = 0;
+    if (!multiRobot) {
+        auto begin = std::chrono::steady_clock::now();
+        result = session(*robots[0]);
+        if (bench && result == 0) {
+            double duration_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            std::vector<BenchMetric> results = benchMetrics(*robots[0]);
+            int regressions = benchBaseline.empty() ? 0 : compareBench(results, baselineNumbers);
+            if (!benchPath.empty() && !writeBenchReport(benchPath, results, *robots[0], jointConfig, benchMachine(benchMachineId), duration_s)) {
+                std::cerr << "Failed to write " << benchPath << std::endl;
+                result = -1;
+            }
+            if (regressions > 0) {
+                std::cerr << regressions << " timing metric(s) worse than the baseline " << benchBaseline << " allows" << std::endl;
+                result = 4;
+            }
+        }
+    } else {
+        std::vector<std::thread> controlThreads;
+        for (auto& robot : robots) {
+            RobotInstance* instance = robot.get();
+            controlThreads.emplace_back([&session, instance] { instance->result = session(*instance); });
+        }
+        for (std::thread& thread : controlThreads) { thread.join(); }
+        printTickReport(robots);
+        for (auto& robot : robots) {
+            if (robot->result != 0) { result = robot->result; }
+        }
+    }
+    if (rtAllocReport(std::cout) > 0) { return 3; } // only with RT_ALLOC_CHECK
+    return result;
+}
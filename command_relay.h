@@ -0,0 +1,125 @@
+/**
+ * @file command_relay.h
+ * @brief forward the received command stream to local consumers (--relay)
+ * @version 0.1
+ *
+ * The relay is a dual stack UDP socket that sends every datagram the command socket
+ * receives on to a list of "host:port" consumers, IPv4 or IPv6, in one sendmmsg call.
+ */
+#pragma once
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+namespace commandrelay {
+
+/**
+ * @brief Parse an IPv4 or IPv6 address
+ * @param port port to fill in, in host byte order
+ * @return false if text is neither
+ */
+inline bool parseAddress(const std::string& text, int port, sockaddr_storage& addr) {
+    memset(&addr, 0, sizeof(addr));
+    sockaddr_in& v4 = (sockaddr_in&)addr;
+    sockaddr_in6& v6 = (sockaddr_in6&)addr;
+    if (inet_pton(AF_INET, text.c_str(), &v4.sin_addr) == 1) {
+        v4.sin_family = AF_INET;
+        v4.sin_port = htons(uint16_t(port));
+        return true;
+    }
+    if (inet_pton(AF_INET6, text.c_str(), &v6.sin6_addr) == 1) {
+        v6.sin6_family = AF_INET6;
+        v6.sin6_port = htons(uint16_t(port));
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Forwards the command stream to local consumers (--relay)
+ * Every datagram goes to all consumers with a single sendmmsg call. The messages of the
+ * call all point at the receive buffer, so the payload is not copied in user space and
+ * one more consumer costs one more entry of the call, not another syscall. The UDP thread
+ * forwards a packet only after it is in the robot's inbox, so consumers never delay it.
+ */
+class CommandRelay {
+public:
+    CommandRelay() {
+        sockfd_ = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int disable = 0;
+        if (sockfd_ >= 0) { setsockopt(sockfd_, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable)); }
+    }
+
+    ~CommandRelay() {
+        if (sockfd_ >= 0) { close(sockfd_); }
+        if (failed_ > 0) { std::cerr << "Relay could not forward " << failed_ << " datagrams" << std::endl; }
+    }
+
+    /**
+     * @param destination "host:port" or "[host]:port" for IPv6
+     */
+    bool add(const std::string& destination) {
+        size_t colon = destination.rfind(':');
+        std::string host = colon == std::string::npos ? "" : destination.substr(0, colon);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']') { host = host.substr(1, host.size() - 2); }
+        sockaddr_storage addr;
+        if (sockfd_ < 0 || colon == std::string::npos || !parseAddress(host, std::atoi(destination.c_str() + colon + 1), addr)) {
+            std::cerr << "Bad relay destination " << destination << std::endl;
+            return false;
+        }
+        // the socket is dual stack, IPv4 consumers are reached through v4-mapped addresses
+        sockaddr_in6 consumer = {};
+        if (addr.ss_family == AF_INET) {
+            const sockaddr_in& v4 = (const sockaddr_in&)addr;
+            consumer.sin6_family = AF_INET6;
+            consumer.sin6_port = v4.sin_port;
+            consumer.sin6_addr.s6_addr[10] = consumer.sin6_addr.s6_addr[11] = 0xff;
+            memcpy(consumer.sin6_addr.s6_addr + 12, &v4.sin_addr, 4);
+        } else {
+            consumer = (const sockaddr_in6&)addr;
+        }
+        consumers_.push_back(consumer);
+
+        // the message headers only change their payload length from one datagram to the next
+        messages_.assign(consumers_.size(), mmsghdr());
+        for (size_t i = 0; i < consumers_.size(); i++) {
+            messages_[i].msg_hdr.msg_name = &consumers_[i];
+            messages_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+            messages_[i].msg_hdr.msg_iov = &payload_;
+            messages_[i].msg_hdr.msg_iovlen = 1;
+        }
+        return true;
+    }
+
+    size_t consumers() const { return consumers_.size(); }
+
+    /**
+     * @brief Send a datagram to every consumer (UDP thread)
+     */
+    void forward(const char* data, size_t len) {
+        if (consumers_.empty()) { return; }
+        payload_.iov_base = (void*)data;
+        payload_.iov_len = len;
+        int sent = sendmmsg(sockfd_, messages_.data(), unsigned(messages_.size()), MSG_DONTWAIT);
+        failed_ += messages_.size() - size_t(std::max(sent, 0));
+    }
+
+private:
+    int sockfd_ = -1;
+    std::vector<sockaddr_in6> consumers_;
+    std::vector<mmsghdr> messages_;
+    iovec payload_ = {};
+    uint64_t failed_ = 0;
+};
+
+} // namespace commandrelay
@@ -0,0 +1,228 @@
+/**
+ * @file joint_trajectory.h
+ * @brief joint space trajectories of the exercise: minimum jerk moves, the blender that
+ * joins a new goal to the running motion, and the spline through demonstrated waypoints
+ * @version 0.1
+ *
+ * Nothing here touches the robot or the session settings; everything is templated on
+ * the joint configuration (Config::nCols columns of a DataLine, column 0 unused), so the
+ * controller and unit_tests.cpp share it.
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#ifndef UNROLL
+#define UNROLL _Pragma("GCC unroll 32")
+#endif
+
+namespace jointtrajectory {
+
+/**
+ * @brief Given an initial and target position, interpolate between the two
+ * Moves each joint towards the traget posiiton along a minimum jerk profile, starting and
+ * ending at rest, with the iter representing the current step taken out of nSteps. This
+ * function returns AllArmsOverrides to be pushed to Harmony
+ * @param initialOverride Initial position as AllArmsOverrides
+ * @param targetOverride Target Position as AllArmsOverrides
+ * @param iter iteration of interpolation
+ * @param nSteps number of steps to take between initial and target positions
+ * @return AllArmsOverrides the override command per the _iter_ step
+ */
+template <class Config>
+typename Config::DataLine step2targetPosition(const typename Config::DataLine& start,
+    const typename Config::DataLine& finish,
+    int iter,
+    int nSteps) {
+
+    typename Config::DataLine step;
+    step[0] = 0.;
+
+    double tau = double(iter) / nSteps;
+    double s = tau * tau * tau * (10.0 + tau * (-15.0 + 6.0 * tau));
+    UNROLL
+    for (int i = 1; i < Config::nCols; i++) {
+        step[i] = start[i] + (finish[i] - start[i]) * s;
+    }
+    return step;
+}
+
+/**
+ * @brief Joint command generator that can take a new goal at any tick
+ * Every joint follows a quintic from its current commanded position, velocity and
+ * acceleration to the goal at rest, so a goal given mid-motion (a redirect, a stop, a
+ * skipped trial heading home) joins the running motion with continuous velocity and
+ * acceleration, both arms and the torso together. Planning is closed form per joint and
+ * allocates nothing, it fits in the tick that receives the new goal.
+ *
+ * Poses commanded from elsewhere (cached trajectories, demonstrations) go through
+ * track(), which keeps the velocity and acceleration a new goal starts from.
+ */
+template <class Config>
+class TrajectoryBlender {
+public:
+    using DataLine = typename Config::DataLine;
+
+    /**
+     * @param dt_s control period
+     */
+    explicit TrajectoryBlender(double dt_s) : dt_s_(dt_s) {}
+
+    /**
+     * @brief Rest at pose
+     */
+    void hold(const DataLine& pose) {
+        position_ = pose;
+        velocity_ = {};
+        acceleration_ = {};
+        moving_ = false;
+    }
+
+    /**
+     * @brief Pose commanded this tick by someone else, velocity and acceleration by finite differences
+     */
+    void track(const DataLine& pose) {
+        UNROLL
+        for (int i = 1; i < Config::nCols; i++) {
+            double velocity = (pose[i] - position_[i]) / dt_s_;
+            acceleration_[i] = (velocity - velocity_[i]) / dt_s_;
+            velocity_[i] = velocity;
+        }
+        position_ = pose;
+        moving_ = false;
+    }
+
+    /**
+     * @brief Head for goal from the current state, arriving at rest after duration_s
+     */
+    void moveTo(const DataLine& goal, double duration_s) {
+        double T = std::max(duration_s, dt_s_);
+        // in normalised time u = t / T: q(u) = c0 + c1 u + ... + c5 u^5 with q, dq/du, d2q/du2
+        // matching the current state at u = 0 and the goal at rest at u = 1
+        UNROLL
+        for (int i = 1; i < Config::nCols; i++) {
+            double h = goal[i] - position_[i], v = velocity_[i] * T, a = acceleration_[i] * T * T;
+            c_[0][i] = position_[i];
+            c_[1][i] = v;
+            c_[2][i] = 0.5 * a;
+            c_[3][i] = 10.0 * h - 6.0 * v - 1.5 * a;
+            c_[4][i] = -15.0 * h + 8.0 * v + 1.5 * a;
+            c_[5][i] = 6.0 * h - 3.0 * v - 0.5 * a;
+        }
+        goal_ = goal;
+        duration_s_ = T;
+        elapsed_s_ = 0.0;
+        moving_ = true;
+    }
+
+    /**
+     * @brief Come to rest over duration_s, without reversing any joint
+     * The rest pose is where the motion would stop with peak deceleration 1.5 v / duration_s.
+     */
+    void stop(double duration_s) {
+        DataLine rest = position_;
+        UNROLL
+        for (int i = 1; i < Config::nCols; i++) {
+            rest[i] += velocity_[i] * duration_s / 2.0 + acceleration_[i] * duration_s * duration_s / 12.0;
+        }
+        moveTo(rest, duration_s);
+    }
+
+    /**
+     * @brief Advance one tick and return the pose to command
+     */
+    const DataLine& next() {
+        if (!moving_) {
+            velocity_ = {};
+            acceleration_ = {};
+            return position_;
+        }
+        elapsed_s_ += dt_s_;
+        if (elapsed_s_ > duration_s_ - 0.5 * dt_s_) { elapsed_s_ = duration_s_; } // summed ticks drift, end on the last one
+        double u = elapsed_s_ / duration_s_, T = duration_s_;
+        UNROLL
+        for (int i = 1; i < Config::nCols; i++) {
+            position_[i] = c_[0][i] + u * (c_[1][i] + u * (c_[2][i] + u * (c_[3][i] + u * (c_[4][i] + u * c_[5][i]))));
+            velocity_[i] = (c_[1][i] + u * (2.0 * c_[2][i] + u * (3.0 * c_[3][i] + u * (4.0 * c_[4][i] + u * 5.0 * c_[5][i])))) / T;
+            acceleration_[i] = (2.0 * c_[2][i] + u * (6.0 * c_[3][i] + u * (12.0 * c_[4][i] + u * 20.0 * c_[5][i]))) / (T * T);
+        }
+        if (elapsed_s_ >= duration_s_) { hold(goal_); }
+        return position_;
+    }
+
+    bool moving() const { return moving_; }
+    double progress() const { return moving_ ? elapsed_s_ / duration_s_ : 1.0; }
+    const DataLine& pose() const { return position_; }
+
+private:
+    double dt_s_;
+    DataLine position_{};
+    DataLine velocity_{};
+    DataLine acceleration_{};
+    DataLine goal_{};
+    std::array<DataLine, 6> c_{};
+    double duration_s_ = 0.0;
+    double elapsed_s_ = 0.0;
+    bool moving_ = false;
+};
+
+/**
+ * @brief Tabulate the clamped cubic spline through timed waypoints at fs
+ * One spline per joint with zero velocity at both ends, evaluated at nSteps + 1 evenly
+ * spaced times from the first waypoint to the last (see Demonstration).
+ * @param times waypoint times, increasing
+ * @param poses receives the tabulated poses, empty with fewer than two waypoints
+ */
+template <class Config>
+void clampedSpline(const std::vector<double>& times, const std::vector<typename Config::DataLine>& waypoints, double fs,
+    std::vector<typename Config::DataLine>& poses) {
+    using DataLine = typename Config::DataLine;
+    int m = int(times.size()) - 1;
+    poses.clear();
+    if (m < 1) { return; }
+    double duration_s = times.back() - times.front();
+
+    // second derivatives of the clamped spline of every joint (tridiagonal system, Thomas algorithm)
+    std::vector<DataLine> M(m + 1, DataLine{});
+    std::vector<double> c(m + 1);
+    std::vector<DataLine> rhs(m + 1, DataLine{});
+    for (int k = 0; k <= m; k++) {
+        double hPrev = k > 0 ? times[k] - times[k - 1] : 0.0;
+        double hNext = k < m ? times[k + 1] - times[k] : 0.0;
+        double diag = 2.0 * (hPrev + hNext);
+        double cPrev = k > 0 ? c[k - 1] : 0.0;
+        double denom = diag - hPrev * cPrev;
+        c[k] = hNext / denom;
+        for (int i = 1; i < Config::nCols; i++) {
+            double slopeNext = k < m ? (waypoints[k + 1][i] - waypoints[k][i]) / hNext : 0.0;
+            double slopePrev = k > 0 ? (waypoints[k][i] - waypoints[k - 1][i]) / hPrev : 0.0;
+            double d = 6.0 * (slopeNext - slopePrev);
+            rhs[k][i] = (d - hPrev * (k > 0 ? rhs[k - 1][i] : 0.0)) / denom;
+        }
+    }
+    M[m] = rhs[m];
+    for (int k = m - 1; k >= 0; k--) {
+        for (int i = 1; i < Config::nCols; i++) { M[k][i] = rhs[k][i] - c[k] * M[k + 1][i]; }
+    }
+
+    int nSteps = std::max(1, int(std::lround(duration_s * fs)));
+    poses.resize(nSteps + 1);
+    int k = 0;
+    for (int step = 0; step <= nSteps; step++) {
+        double t = times[0] + duration_s * step / nSteps;
+        while (k < m - 1 && t > times[k + 1]) { k++; }
+        double h = times[k + 1] - times[k];
+        double a = (times[k + 1] - t) / h, b = (t - times[k]) / h;
+        DataLine& pose = poses[step];
+        pose[0] = 0.0;
+        for (int i = 1; i < Config::nCols; i++) {
+            pose[i] = a * waypoints[k][i] + b * waypoints[k + 1][i] +
+                ((a * a * a - a) * M[k][i] + (b * b * b - b) * M[k + 1][i]) * h * h / 6.0;
+        }
+    }
+}
+
+} // namespace jointtrajectory
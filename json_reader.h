@@ -0,0 +1,100 @@
+/**
+ * @file json_reader.h
+ * @brief flat reader for the small JSON files of the session benchmark
+ * @version 0.1
+ *
+ * Every number and string of a document is stored under its dotted path, which is all
+ * the bench files (see writeBenchReport in bmi_exercise.cpp) need.
+ */
+#pragma once
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+namespace jsonreader {
+
+/**
+ * @brief Reads the numbers and strings of a JSON document, keyed by their path
+ * ("metrics.tick_overruns", "machine.id"). Booleans and nulls are skipped, arrays do
+ * not occur in bench files.
+ */
+struct JsonReader {
+    const char* p;
+    std::map<std::string, double>& numbers;
+    std::map<std::string, std::string>& strings;
+
+    void space() {
+        while (*p != 0 && isspace((unsigned char)*p)) { p++; }
+    }
+
+    bool string(std::string* text) {
+        if (*p != '"') { return false; }
+        for (p++; *p != 0 && *p != '"'; p++) {
+            if (*p == '\\' && p[1] != 0) { p++; }
+            if (text != nullptr) { text->push_back(*p); }
+        }
+        if (*p != '"') { return false; }
+        p++;
+        return true;
+    }
+
+    bool value(const std::string& path) {
+        space();
+        if (*p == '{') {
+            p++;
+            space();
+            if (*p == '}') {
+                p++;
+                return true;
+            }
+            while (true) {
+                std::string key;
+                space();
+                if (!string(&key)) { return false; }
+                space();
+                if (*p++ != ':') { return false; }
+                if (!value(path.empty() ? key : path + "." + key)) { return false; }
+                space();
+                if (*p == ',') {
+                    p++;
+                    continue;
+                }
+                if (*p != '}') { return false; }
+                p++;
+                return true;
+            }
+        }
+        if (*p == '"') { return string(&strings[path]); }
+        for (const char* word : {"true", "false", "null"}) {
+            if (strncmp(p, word, strlen(word)) == 0) {
+                p += strlen(word);
+                return true;
+            }
+        }
+        char* end;
+        double number = strtod(p, &end);
+        if (end == p) { return false; }
+        numbers[path] = number;
+        p = end;
+        return true;
+    }
+};
+
+inline bool readJson(const std::string& path, std::map<std::string, double>& numbers, std::map<std::string, std::string>& strings) {
+    std::ifstream file(path);
+    if (!file) { return false; }
+    std::stringstream text;
+    text << file.rdbuf();
+    std::string json = text.str();
+    JsonReader reader{json.c_str(), numbers, strings};
+    if (!reader.value("")) { return false; }
+    reader.space();
+    return *reader.p == 0;
+}
+
+} // namespace jsonreader
@@ -0,0 +1,373 @@
+/**
+ * @file log_codec.h
+ * @brief compact encoding of session log frames (quantize, delta, varint)
+ * @version 0.1
+ *
+ * A compressed log (.bmz) is a sequence of blocks. The first block is a header block
+ * holding the text header of the normal log, every following block holds a run of
+ * frames. Each frame block starts from zero, so any block can be decoded on its own.
+ *
+ * header block : "BMZH" | uint32 text length | text
+ * frame block  : "BMZ1" | uint32 payload length | uint32 frame count | uint16 column count
+ *                | column count x float64 resolution | payload
+ *
+ * In the payload every field of a frame is written as a zigzag varint of its difference
+ * to the previous frame of the block. Timestamps use the difference of differences, so a
+ * steady sample rate costs a byte or two. Columns are quantized to their resolution first.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <cstdlib>
+#include <iomanip>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace logcodec {
+
+constexpr int maxColumns = 64;
+constexpr size_t blockHeaderBytes = 14;
+constexpr size_t maxBlockBytes = size_t(64) << 20; // far above any block the writer makes (logBlockFrames frames)
+
+/**
+ * @brief What a log row was written for
+ */
+enum class Trigger : uint8_t { none = 0, start, moving, stop, select, exit, pause, resume, skip, side, redirect };
+
+inline const char* triggerName(Trigger trigger) {
+    switch (trigger) {
+        case Trigger::start: return "START";
+        case Trigger::moving: return "MOVING";
+        case Trigger::stop: return "STOP";
+        case Trigger::select: return "SELECT";
+        case Trigger::exit: return "EXIT";
+        case Trigger::pause: return "PAUSE";
+        case Trigger::resume: return "RESUME";
+        case Trigger::skip: return "SKIP";
+        case Trigger::side: return "SIDE";
+        case Trigger::redirect: return "REDIRECT";
+        default: return "";
+    }
+}
+
+/**
+ * @brief One log row, everything the text log prints for it
+ */
+struct Frame {
+    int64_t mono_ns = 0;
+    int64_t real_ns = 0;
+    int64_t rx_mono_ns = 0;
+    int64_t rx_real_ns = 0;
+    int32_t iteration = 0;
+    char movement = 0;
+    Trigger trigger = Trigger::none;
+    int nColumns = 0;
+    double columns[maxColumns];
+};
+
+inline uint64_t zigzag(int64_t v) { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+inline int64_t unzigzag(uint64_t v) { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+inline void putVarint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(uint8_t(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+}
+
+inline bool getVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        v |= uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) { return true; }
+    }
+    return false;
+}
+
+inline void putU32(uint8_t* p, uint32_t v) { memcpy(p, &v, 4); }
+inline uint32_t getU32(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+/**
+ * @brief Previous frame state shared by the encoder and decoder of one block
+ */
+struct DeltaState {
+    int64_t mono_ns = 0, mono_step = 0;
+    int64_t real_ns = 0, real_step = 0;
+    int64_t rx_mono_ns = 0;
+    int64_t rx_real_ns = 0;
+    int64_t iteration = 0;
+    int64_t movement = 0;
+    int64_t trigger = 0;
+    int64_t columns[maxColumns] = {};
+};
+
+/**
+ * @brief Builds frame blocks. Not thread safe, meant to live on the log writer thread.
+ */
+class BlockEncoder {
+public:
+    /**
+     * @param resolutions quantization step of every column (same unit as the column)
+     */
+    explicit BlockEncoder(const std::vector<double>& resolutions) : resolutions_(resolutions) {
+        for (double r : resolutions_) { inverse_.push_back(1.0 / r); }
+        payload_.reserve(1 << 16);
+        reset();
+    }
+
+    void add(const Frame& frame) {
+        putTimestamp(frame.mono_ns, prev_.mono_ns, prev_.mono_step);
+        putTimestamp(frame.real_ns, prev_.real_ns, prev_.real_step);
+        putDelta(frame.rx_mono_ns, prev_.rx_mono_ns);
+        putDelta(frame.rx_real_ns, prev_.rx_real_ns);
+        putDelta(frame.iteration, prev_.iteration);
+        putDelta(frame.movement, prev_.movement);
+        putDelta(int64_t(frame.trigger), prev_.trigger);
+        for (size_t i = 0; i < resolutions_.size(); i++) {
+            putDelta(std::llround(frame.columns[i] * inverse_[i]), prev_.columns[i]);
+        }
+        frames_++;
+    }
+
+    uint32_t frames() const { return frames_; }
+
+    /**
+     * @brief Append the finished block to out and start a new one
+     */
+    void finish(std::vector<uint8_t>& out) {
+        if (frames_ == 0) { return; }
+        size_t start = out.size();
+        out.resize(start + blockHeaderBytes + 8 * resolutions_.size());
+        uint8_t* p = out.data() + start;
+        memcpy(p, "BMZ1", 4);
+        putU32(p + 4, uint32_t(payload_.size()));
+        putU32(p + 8, frames_);
+        uint16_t nColumns = uint16_t(resolutions_.size());
+        memcpy(p + 12, &nColumns, 2);
+        memcpy(p + blockHeaderBytes, resolutions_.data(), 8 * resolutions_.size());
+        out.insert(out.end(), payload_.begin(), payload_.end());
+        reset();
+    }
+
+private:
+    void reset() {
+        payload_.clear();
+        prev_ = DeltaState();
+        frames_ = 0;
+    }
+
+    void putDelta(int64_t value, int64_t& prev) {
+        putVarint(payload_, zigzag(value - prev));
+        prev = value;
+    }
+
+    void putTimestamp(int64_t value, int64_t& prev, int64_t& step) {
+        int64_t delta = value - prev;
+        putVarint(payload_, zigzag(delta - step));
+        step = delta;
+        prev = value;
+    }
+
+    std::vector<double> resolutions_;
+    std::vector<double> inverse_;
+    std::vector<uint8_t> payload_;
+    DeltaState prev_;
+    uint32_t frames_ = 0;
+};
+
+/**
+ * @brief Append the header block holding the text header of the log
+ */
+inline void writeHeaderBlock(std::vector<uint8_t>& out, const std::string& text) {
+    size_t start = out.size();
+    out.resize(start + 8);
+    memcpy(out.data() + start, "BMZH", 4);
+    putU32(out.data() + start + 4, uint32_t(text.size()));
+    out.insert(out.end(), text.begin(), text.end());
+}
+
+/**
+ * @brief Decode one block starting at data
+ * @param header receives the text of a header block
+ * @param frames receives the frames of a frame block
+ * @return number of bytes the block used, 0 if the block is truncated or corrupt
+ */
+inline size_t decodeBlock(const uint8_t* data, size_t len, std::string& header, std::vector<Frame>& frames) {
+    if (len < 8) { return 0; }
+    uint32_t size = getU32(data + 4);
+
+    if (memcmp(data, "BMZH", 4) == 0) {
+        if (len < 8 + size_t(size)) { return 0; }
+        header.assign((const char*)data + 8, size);
+        return 8 + size_t(size);
+    }
+    if (memcmp(data, "BMZ1", 4) != 0 || len < blockHeaderBytes) { return 0; }
+
+    uint32_t nFrames = getU32(data + 8);
+    uint16_t nColumns;
+    memcpy(&nColumns, data + 12, 2);
+    if (nColumns > maxColumns) { return 0; }
+    size_t total = blockHeaderBytes + 8 * size_t(nColumns) + size;
+    if (len < total) { return 0; }
+
+    double resolutions[maxColumns];
+    memcpy(resolutions, data + blockHeaderBytes, 8 * size_t(nColumns));
+
+    const uint8_t* p = data + blockHeaderBytes + 8 * size_t(nColumns);
+    const uint8_t* end = data + total;
+    DeltaState prev;
+    uint64_t v;
+    std::vector<Frame> decoded;
+    decoded.reserve(std::min<size_t>(nFrames, size));
+
+    auto delta = [&](int64_t& state) -> bool {
+        if (!getVarint(p, end, v)) { return false; }
+        state += unzigzag(v);
+        return true;
+    };
+    auto timestamp = [&](int64_t& state, int64_t& step) -> bool {
+        if (!getVarint(p, end, v)) { return false; }
+        step += unzigzag(v);
+        state += step;
+        return true;
+    };
+
+    for (uint32_t f = 0; f < nFrames; f++) {
+        Frame frame;
+        if (!timestamp(prev.mono_ns, prev.mono_step) || !timestamp(prev.real_ns, prev.real_step) ||
+            !delta(prev.rx_mono_ns) || !delta(prev.rx_real_ns) || !delta(prev.iteration) ||
+            !delta(prev.movement) || !delta(prev.trigger)) {
+            return 0;
+        }
+        for (int i = 0; i < nColumns; i++) {
+            if (!delta(prev.columns[i])) { return 0; }
+            frame.columns[i] = double(prev.columns[i]) * resolutions[i];
+        }
+        frame.mono_ns = prev.mono_ns;
+        frame.real_ns = prev.real_ns;
+        frame.rx_mono_ns = prev.rx_mono_ns;
+        frame.rx_real_ns = prev.rx_real_ns;
+        frame.iteration = int32_t(prev.iteration);
+        frame.movement = char(prev.movement);
+        frame.trigger = Trigger(prev.trigger);
+        frame.nColumns = nColumns;
+        decoded.push_back(frame);
+    }
+    frames.insert(frames.end(), decoded.begin(), decoded.end());
+    return total;
+}
+
+/**
+ * @brief Read the next whole block of a .bmz stream into block
+ * The block header is checked before anything is allocated for the block, a damaged
+ * header is reported as corrupt rather than trusted.
+ * @param truncated set when the stream ends in the middle of a block
+ * @param corrupt set (if given) when the block header is not one the writer makes
+ * @return false at the end of the stream, on a truncated or on a corrupt block
+ */
+inline bool readBlock(std::istream& in, std::vector<uint8_t>& block, bool& truncated, bool* corrupt = nullptr) {
+    if (corrupt != nullptr) { *corrupt = false; }
+    block.resize(blockHeaderBytes);
+    in.read((char*)block.data(), 8);
+    truncated = in.gcount() != 0 && in.gcount() != 8;
+    if (in.gcount() != 8) { return false; }
+
+    bool header = memcmp(block.data(), "BMZH", 4) == 0;
+    size_t have = 8;
+    size_t total = 8 + size_t(getU32(block.data() + 4));
+    if (!header) {
+        if (memcmp(block.data(), "BMZ1", 4) != 0) {
+            if (corrupt != nullptr) { *corrupt = true; }
+            return false;
+        }
+        in.read((char*)block.data() + 8, blockHeaderBytes - 8);
+        if (in.gcount() != std::streamsize(blockHeaderBytes - 8)) {
+            truncated = true;
+            return false;
+        }
+        uint16_t nColumns;
+        memcpy(&nColumns, block.data() + 12, 2);
+        if (nColumns > maxColumns) {
+            if (corrupt != nullptr) { *corrupt = true; }
+            return false;
+        }
+        have = blockHeaderBytes;
+        total = blockHeaderBytes + 8 * size_t(nColumns) + getU32(block.data() + 4);
+    }
+    if (total > maxBlockBytes) {
+        if (corrupt != nullptr) { *corrupt = true; }
+        return false;
+    }
+
+    block.resize(total);
+    in.read((char*)block.data() + have, total - have);
+    truncated = !in;
+    return !truncated;
+}
+
+/**
+ * @brief Print a frame as one row of the normal tab separated log
+ */
+inline void writeTextRow(std::ostream& out, const Frame& frame) {
+    std::time_t timePoint = std::time_t(frame.real_ns / 1000000000LL);
+    int64_t ms = (frame.real_ns / 1000000LL) % 1000;
+    std::tm timeinfo;
+    localtime_r(&timePoint, &timeinfo);
+
+    out << std::put_time(&timeinfo, "%H:%M:%S") << "." << std::setfill('0') << std::setw(3) << ms << "\t"
+        << frame.iteration << "\t" << frame.movement << "\t" << triggerName(frame.trigger);
+    for (int i = 0; i < frame.nColumns; i++) { out << "\t" << frame.columns[i]; }
+    out << "\t" << frame.mono_ns << "\t" << frame.real_ns << "\t" << frame.rx_mono_ns << "\t" << frame.rx_real_ns;
+    out << "\n\n";
+}
+
+/**
+ * @brief Parse one row of the normal tab separated log, the reverse of writeTextRow
+ * The wall clock string of the TIME column is skipped, real_ns holds the same time.
+ * @return false for the blank lines between rows and for anything that is not a row
+ */
+inline bool parseTextRow(const std::string& line, Frame& frame) {
+    const char* p = line.c_str();
+    const char* tab = strchr(p, '\t');
+    if (tab == nullptr) { return false; }
+    char* end;
+    frame.iteration = int32_t(strtol(tab + 1, &end, 10));
+    if (end == tab + 1 || *end != '\t') { return false; }
+    frame.movement = end[1] == '\t' ? 0 : end[1];
+    p = strchr(end + 1, '\t');
+    if (p == nullptr) { return false; }
+    const char* triggerEnd = strchr(p + 1, '\t');
+    if (triggerEnd == nullptr) { return false; }
+    std::string trigger(p + 1, triggerEnd);
+    frame.trigger = Trigger::none;
+    for (uint8_t k = 1; k <= uint8_t(Trigger::redirect); k++) {
+        if (trigger == triggerName(Trigger(k))) { frame.trigger = Trigger(k); }
+    }
+
+    // data columns, then the four timestamps
+    const char* fields[maxColumns + 4];
+    int n = 0;
+    for (p = triggerEnd; p != nullptr && n < maxColumns + 4; p = strchr(p + 1, '\t')) { fields[n++] = p + 1; }
+    if (n < 4) { return false; }
+    frame.nColumns = n - 4;
+    for (int i = 0; i < frame.nColumns; i++) {
+        frame.columns[i] = strtod(fields[i], &end);
+        if (end == fields[i]) { return false; }
+    }
+    int64_t* stamps[4] = {&frame.mono_ns, &frame.real_ns, &frame.rx_mono_ns, &frame.rx_real_ns};
+    for (int i = 0; i < 4; i++) {
+        *stamps[i] = strtoll(fields[frame.nColumns + i], &end, 10);
+        if (end == fields[frame.nColumns + i]) { return false; }
+    }
+    return true;
+}
+
+} // namespace logcodec
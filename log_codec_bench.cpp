@@ -0,0 +1,120 @@
+/**
+ * @file log_codec_bench.cpp
+ * @brief compression ratio and encode cost of the compressed session log
+ *
+ * usage: log_codec_bench [frames] [out.bmz]
+ * Generates a synthetic session (14 joints + 2 end effector positions, logged at
+ * 100 Hz like bmi_exercise) and compares the text log against the .bmz encoding.
+ * The optional .bmz output can be checked with log_decode.
+ */
+
+#include "log_codec.h"
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#define N_JOINTS 14
+#define N_COLS N_JOINTS + 6
+
+int main(int argc, char** argv) {
+    int nFrames = argc > 1 ? std::atoi(argv[1]) : 360000; // one hour at 100 Hz
+    double jointResolution_deg = 0.001;
+    double poseResolution_mm = 0.01;
+    int blockFrames = 2000;
+
+    // slow reaching movements plus sensor noise
+    std::mt19937 rng(7);
+    std::normal_distribution<double> noise(0.0, 0.02);
+    std::vector<logcodec::Frame> frames(nFrames);
+    int64_t t0 = 1700000000LL * 1000000000LL;
+    for (int f = 0; f < nFrames; f++) {
+        logcodec::Frame& frame = frames[f];
+        double t = f * 0.01;
+        frame.mono_ns = int64_t(t * 1e9) + (rng() % 50000);
+        frame.real_ns = t0 + frame.mono_ns;
+        frame.iteration = 1 + f / 1700;
+        frame.movement = "xyz"[frame.iteration % 3];
+        frame.trigger = logcodec::Trigger::moving;
+        frame.nColumns = N_COLS;
+        for (int j = 0; j < N_JOINTS; j++) {
+            frame.columns[j] = 30.0 * std::sin(0.4 * t + j) + noise(rng);
+        }
+        for (int j = N_JOINTS; j < N_COLS; j++) {
+            frame.columns[j] = 300.0 * std::sin(0.4 * t + j) + 10 * noise(rng);
+        }
+    }
+
+    // text log, as written today
+    std::ostringstream text;
+    auto textStart = std::chrono::steady_clock::now();
+    for (const auto& frame : frames) { logcodec::writeTextRow(text, frame); }
+    auto textEnd = std::chrono::steady_clock::now();
+
+    // compressed log
+    std::vector<double> resolutions(N_JOINTS, jointResolution_deg);
+    for (int j = N_JOINTS; j < N_COLS; j++) { resolutions.push_back(poseResolution_mm); }
+    logcodec::BlockEncoder encoder(resolutions);
+    std::vector<uint8_t> out;
+    logcodec::writeHeaderBlock(out, "bench\n");
+
+    auto encodeStart = std::chrono::steady_clock::now();
+    for (const auto& frame : frames) {
+        encoder.add(frame);
+        if (int(encoder.frames()) >= blockFrames) { encoder.finish(out); }
+    }
+    encoder.finish(out);
+    auto encodeEnd = std::chrono::steady_clock::now();
+
+    // decode back and check the quantization error
+    std::vector<logcodec::Frame> decoded;
+    std::string header;
+    auto decodeStart = std::chrono::steady_clock::now();
+    for (size_t pos = 0; pos < out.size();) {
+        size_t used = logcodec::decodeBlock(out.data() + pos, out.size() - pos, header, decoded);
+        if (used == 0) {
+            std::cerr << "decode failed at byte " << pos << std::endl;
+            return 1;
+        }
+        pos += used;
+    }
+    auto decodeEnd = std::chrono::steady_clock::now();
+
+    if (int(decoded.size()) != nFrames) {
+        std::cerr << "decoded " << decoded.size() << " of " << nFrames << " frames" << std::endl;
+        return 1;
+    }
+    double maxError = 0;
+    for (int f = 0; f < nFrames; f++) {
+        if (decoded[f].mono_ns != frames[f].mono_ns || decoded[f].real_ns != frames[f].real_ns) {
+            std::cerr << "timestamp mismatch at frame " << f << std::endl;
+            return 1;
+        }
+        for (int j = 0; j < N_COLS; j++) {
+            double error = std::fabs(decoded[f].columns[j] - frames[f].columns[j]) / resolutions[j];
+            if (error > maxError) { maxError = error; }
+        }
+    }
+
+    auto ns = [](auto a, auto b) { return double(std::chrono::duration_cast<std::chrono::nanoseconds>(b - a).count()); };
+    double textBytes = double(text.str().size());
+    double bmzBytes = double(out.size());
+
+    std::cout << "frames               : " << nFrames << "\n";
+    std::cout << "text bytes/frame     : " << textBytes / nFrames << "\n";
+    std::cout << "bmz bytes/frame      : " << bmzBytes / nFrames << "\n";
+    std::cout << "compression ratio    : " << textBytes / bmzBytes << "\n";
+    std::cout << "text format ns/frame : " << ns(textStart, textEnd) / nFrames << "\n";
+    std::cout << "encode ns/frame      : " << ns(encodeStart, encodeEnd) / nFrames << "\n";
+    std::cout << "decode ns/frame      : " << ns(decodeStart, decodeEnd) / nFrames << "\n";
+    std::cout << "max error [steps]    : " << maxError << "\n";
+
+    if (argc > 2) {
+        std::ofstream file(argv[2], std::ios::binary);
+        file.write((const char*)out.data(), out.size());
+    }
+    return maxError <= 0.5 + 1e-6 ? 0 : 1;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file log_decode.cpp
+ * @brief turn a compressed session log (_log.bmz) back into the normal tab separated log
+ *
+ * usage: log_decode <file_log.bmz> [out_log.txt]
+ * Writes to stdout when no output file is given. Blocks are decoded one at a time,
+ * a corrupt or truncated block ends the output with a warning.
+ */
+
+#include "log_codec.h"
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <file_log.bmz> [out_log.txt]" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "cannot open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    std::ofstream outFile;
+    if (argc > 2) { outFile.open(argv[2]); }
+    std::ostream& out = argc > 2 ? outFile : std::cout;
+
+    std::vector<uint8_t> block;
+    std::vector<logcodec::Frame> frames;
+    std::string header;
+    size_t nBlocks = 0, nFrames = 0;
+    bool truncated = false, corrupt = false;
+
+    while (logcodec::readBlock(in, block, truncated, &corrupt)) {
+        header.clear();
+        frames.clear();
+        if (logcodec::decodeBlock(block.data(), block.size(), header, frames) == 0) {
+            std::cerr << "corrupt block " << nBlocks << ", stopping" << std::endl;
+            break;
+        }
+        out << header;
+        for (const auto& frame : frames) { logcodec::writeTextRow(out, frame); }
+        nBlocks++;
+        nFrames += frames.size();
+    }
+    if (truncated) { std::cerr << "truncated block " << nBlocks << ", stopping" << std::endl; }
+    if (corrupt) { std::cerr << "corrupt block header " << nBlocks << ", stopping" << std::endl; }
+
+    std::cerr << nBlocks << " blocks, " << nFrames << " frames" << std::endl;
+    return 0;
+}
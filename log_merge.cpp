@@ -0,0 +1,524 @@
+/**
+ * @file log_merge.cpp
+ * @brief align session logs with EEG event markers and cut merged per-trial epochs
+ *
+ * usage: log_merge [options] <run_log.txt|run_log.bmz> <markers.tsv> [<log> <markers> ...]
+ *   -j n               runs processed in parallel (default: number of cores)
+ *   --eeg-rate hz      sample rate of the EEG recording, if the marker file does not give it
+ *   --events list      trigger names matched between robot and EEG (default START,STOP)
+ *   --tolerance ms     largest mismatch of a matched event pair after alignment (default 50)
+ *   --pre s, --post s  epoch window before START and after the last row of the trial (default 0.5)
+ *   --max-gap ms       robot rows further apart than this are not interpolated across (default 50)
+ *   --columns list     robot columns to export, comma separated (default all)
+ *   --out dir          where the epoch files go (default next to each log)
+ *
+ * Marker file, a stand-in for the event export of the EEG recorder, tab or comma separated:
+ *   # fs 500           sample rate of the recording, required unless --eeg-rate gives it
+ *   sample  marker     header: "sample" (EEG sample index) or "time_s" (seconds), and "marker"
+ *   10230   START
+ *   11830   STOP
+ *
+ * For every run the monotonic clock of the robot is fitted to the EEG clock from the
+ * matched events, robot_s = offset_s + (1 + drift) * eeg_s. A trigger row is timed by the
+ * receive time of its command when it has one, which is closest to when the EEG side sent
+ * it. Each trial (its START up to its last row) becomes an epoch: the robot columns,
+ * linearly interpolated at every EEG sample of the trial window, go to <prefix>_epochs.tsv.
+ * Windows are clipped halfway between trials so that epochs never overlap.
+ *
+ * The log is read twice, once for the trigger rows and once for the resampling, which
+ * only keeps the two rows around the current EEG sample, so memory does not grow with
+ * the length of a run. Runs are independent and are shared out over the threads.
+ */
+
+#include "log_codec.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options {
+    double eegRate_Hz = 0.0; // 0: from the marker file
+    std::vector<std::string> events = {"START", "STOP"};
+    double tolerance_s = 0.050;
+    double pre_s = 0.5;
+    double post_s = 0.5;
+    double maxGap_s = 0.050;
+    std::vector<std::string> columns; // empty: all
+    std::string outDir;
+};
+
+/**
+ * @brief A trigger, on the robot or the EEG clock
+ */
+struct Event {
+    double time_s;
+    std::string label;
+};
+
+/**
+ * @brief robot_s = offset_s + slope * eeg_s, fitted from matched events
+ */
+struct Alignment {
+    double offset_s = 0.0;
+    double slope = 1.0;
+    int matched = 0;
+    double rms_ms = 0.0;
+    double max_ms = 0.0;
+
+    double robotTime(double eeg_s) const { return offset_s + slope * eeg_s; }
+    double eegTime(double robot_s) const { return (robot_s - offset_s) / slope; }
+};
+
+/**
+ * @brief One trial of a run and the EEG samples its epoch covers
+ */
+struct Epoch {
+    int trial;
+    char movement;
+    double start_s; // START row, robot clock
+    double end_s; // last row of the trial, robot clock
+    double begin_s, finish_s; // window, robot clock
+    int64_t first, last; // EEG samples
+};
+
+std::vector<std::string> split(const std::string& text, char delimiter) {
+    std::vector<std::string> fields;
+    std::stringstream ss(text);
+    std::string field;
+    while (std::getline(ss, field, delimiter)) { fields.push_back(field); }
+    return fields;
+}
+
+/**
+ * @brief Reads the rows of a text (_log.txt) or compressed (_log.bmz) session log in order
+ */
+class LogReader {
+public:
+    bool open(const std::string& path, std::string& error) {
+        compressed_ = path.size() > 4 && path.compare(path.size() - 4, 4, ".bmz") == 0;
+        in_.open(path, std::ios::binary);
+        if (!in_) {
+            error = "cannot open " + path;
+            return false;
+        }
+        std::string header;
+        if (compressed_) {
+            bool truncated;
+            if (!logcodec::readBlock(in_, block_, truncated) ||
+                logcodec::decodeBlock(block_.data(), block_.size(), header, frames_) == 0 || header.empty()) {
+                error = path + " does not start with a header block";
+                return false;
+            }
+        } else if (!std::getline(in_, header)) {
+            error = path + " is empty";
+            return false;
+        }
+        // TIME ITERATION MOV TRIGGER <columns> MONO_NS REALTIME_NS RX_MONO_NS RX_REALTIME_NS
+        std::vector<std::string> names = split(header.substr(0, header.find('\n')), '\t');
+        if (names.size() < 8 || names[0] != "TIME") {
+            error = path + " has no session log header";
+            return false;
+        }
+        columns_.assign(names.begin() + 4, names.end() - 4);
+        return true;
+    }
+
+    const std::vector<std::string>& columns() const { return columns_; }
+
+    bool next(logcodec::Frame& frame) {
+        if (!compressed_) {
+            while (std::getline(in_, line_)) {
+                if (logcodec::parseTextRow(line_, frame)) { return true; }
+            }
+            return false;
+        }
+        while (index_ >= frames_.size()) {
+            bool truncated;
+            std::string header;
+            frames_.clear();
+            index_ = 0;
+            if (!logcodec::readBlock(in_, block_, truncated) ||
+                logcodec::decodeBlock(block_.data(), block_.size(), header, frames_) == 0) {
+                return false;
+            }
+        }
+        frame = frames_[index_++];
+        return true;
+    }
+
+private:
+    std::ifstream in_;
+    bool compressed_ = false;
+    std::vector<std::string> columns_;
+    std::string line_;
+    std::vector<uint8_t> block_;
+    std::vector<logcodec::Frame> frames_;
+    size_t index_ = 0;
+};
+
+/**
+ * @brief Read an EEG marker file (see the file comment)
+ * @param fs sample rate, set from a "# fs" line if there is one; the epochs are
+ *        resampled at this rate, so there is no run without it
+ */
+bool readMarkers(const std::string& path, std::vector<Event>& markers, double& fs, std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::string line;
+    std::vector<std::pair<double, std::string>> raw;
+    int timeColumn = -1, markerColumn = -1;
+    bool samples = false;
+    char delimiter = '\t';
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') { line.pop_back(); }
+        if (line.empty()) { continue; }
+        if (line[0] == '#') {
+            std::istringstream comment(line.substr(1));
+            std::string key;
+            double value;
+            if (comment >> key >> value && key == "fs" && fs <= 0.0) { fs = value; }
+            continue;
+        }
+        if (markerColumn < 0) {
+            delimiter = line.find('\t') != std::string::npos ? '\t' : ',';
+            std::vector<std::string> names = split(line, delimiter);
+            for (int i = 0; i < int(names.size()); i++) {
+                if (names[i] == "sample" || names[i] == "time_s") {
+                    timeColumn = i;
+                    samples = names[i] == "sample";
+                }
+                if (names[i] == "marker") { markerColumn = i; }
+            }
+            if (timeColumn < 0 || markerColumn < 0) {
+                error = path + ": header needs a sample or time_s column and a marker column";
+                return false;
+            }
+            continue;
+        }
+        std::vector<std::string> fields = split(line, delimiter);
+        if (int(fields.size()) <= std::max(timeColumn, markerColumn)) { continue; }
+        raw.emplace_back(std::atof(fields[timeColumn].c_str()), fields[markerColumn]);
+    }
+    if (!(fs > 0.0)) {
+        error = path + ": no EEG sample rate, give it with --eeg-rate or a \"# fs\" line";
+        return false;
+    }
+    for (const auto& marker : raw) { markers.push_back({samples ? marker.first / fs : marker.first, marker.second}); }
+    return true;
+}
+
+/**
+ * @brief Pair every robot event with the nearest EEG event of the same label, if close enough
+ * @param eeg EEG events sorted by time
+ */
+std::vector<std::pair<double, double>> matchEvents(const std::vector<Event>& robot, const std::vector<Event>& eeg,
+    const Alignment& fit, double tolerance_s) {
+    std::vector<std::pair<double, double>> pairs; // eeg_s, robot_s
+    std::vector<bool> used(eeg.size(), false);
+    for (const Event& r : robot) {
+        double expected_s = fit.eegTime(r.time_s);
+        int best = -1;
+        auto j = std::lower_bound(eeg.begin(), eeg.end(), expected_s - tolerance_s,
+            [](const Event& e, double time_s) { return e.time_s < time_s; });
+        for (; j != eeg.end() && j->time_s <= expected_s + tolerance_s; ++j) {
+            int k = int(j - eeg.begin());
+            if (used[k] || j->label != r.label) { continue; }
+            if (best < 0 || std::fabs(j->time_s - expected_s) < std::fabs(eeg[best].time_s - expected_s)) { best = k; }
+        }
+        if (best >= 0) {
+            used[best] = true;
+            pairs.emplace_back(eeg[best].time_s, r.time_s);
+        }
+    }
+    return pairs;
+}
+
+/**
+ * @brief Fit the robot clock to the EEG clock
+ * The offset is first found by voting: every same-label pair of an early robot event and
+ * an EEG event proposes one, the one that lines up most events wins. Missing and extra
+ * markers on either side are tolerated. Offset and drift are then fitted by least squares
+ * on the matched pairs, twice, matching again with the refined fit in between.
+ */
+bool alignClocks(const std::vector<Event>& robot, const std::vector<Event>& eeg, double tolerance_s, Alignment& fit) {
+    const size_t candidates = 16; // robot events that propose offsets
+    int bestCount = 0;
+    for (size_t i = 0; i < std::min(robot.size(), candidates); i++) {
+        for (const Event& e : eeg) {
+            if (e.label != robot[i].label) { continue; }
+            Alignment trial;
+            trial.offset_s = robot[i].time_s - e.time_s;
+            int count = int(matchEvents(robot, eeg, trial, tolerance_s).size());
+            if (count > bestCount) {
+                bestCount = count;
+                fit = trial;
+            }
+        }
+    }
+    if (bestCount == 0) { return false; }
+
+    for (int pass = 0; pass < 2; pass++) {
+        std::vector<std::pair<double, double>> pairs = matchEvents(robot, eeg, fit, tolerance_s);
+        double meanEeg = 0.0, meanRobot = 0.0;
+        for (const auto& p : pairs) {
+            meanEeg += p.first / pairs.size();
+            meanRobot += p.second / pairs.size();
+        }
+        double covariance = 0.0, variance = 0.0;
+        for (const auto& p : pairs) {
+            covariance += (p.first - meanEeg) * (p.second - meanRobot);
+            variance += (p.first - meanEeg) * (p.first - meanEeg);
+        }
+        fit.slope = pairs.size() > 1 && variance > 0.0 ? covariance / variance : 1.0;
+        fit.offset_s = meanRobot - fit.slope * meanEeg;
+        fit.matched = int(pairs.size());
+        fit.rms_ms = fit.max_ms = 0.0;
+        for (const auto& p : pairs) {
+            double residual_ms = (p.second - fit.robotTime(p.first)) * 1e3;
+            fit.rms_ms += residual_ms * residual_ms / pairs.size();
+            fit.max_ms = std::max(fit.max_ms, std::fabs(residual_ms));
+        }
+        fit.rms_ms = std::sqrt(fit.rms_ms);
+    }
+    return true;
+}
+
+/**
+ * @brief Epoch file of a log: <prefix>_epochs.tsv next to it, or in outDir
+ */
+std::string epochPath(const std::string& logPath, const std::string& outDir) {
+    std::string base = logPath;
+    for (const char* suffix : {"_log.txt", "_log.bmz"}) {
+        size_t n = strlen(suffix);
+        if (base.size() > n && base.compare(base.size() - n, n, suffix) == 0) { base.resize(base.size() - n); }
+    }
+    if (!outDir.empty()) {
+        size_t slash = base.rfind('/');
+        base = outDir + "/" + (slash == std::string::npos ? base : base.substr(slash + 1));
+    }
+    return base + "_epochs.tsv";
+}
+
+/**
+ * @brief Align one run and write its epochs
+ * @param report receives a summary line, or the reason the run failed
+ */
+bool mergeRun(const std::string& logPath, const std::string& markerPath, const Options& options, std::string& report) {
+    std::string error;
+    double fs = options.eegRate_Hz;
+    std::vector<Event> eegEvents;
+    if (!readMarkers(markerPath, eegEvents, fs, error)) {
+        report = error;
+        return false;
+    }
+
+    /*--------- Pass 1: trigger rows and trial boundaries --------*/
+    LogReader reader;
+    if (!reader.open(logPath, error)) {
+        report = error;
+        return false;
+    }
+    std::vector<Event> robotEvents;
+    std::vector<Epoch> epochs;
+    logcodec::Frame frame;
+    int64_t rows = 0;
+    while (reader.next(frame)) {
+        rows++;
+        double time_s = frame.mono_ns * 1e-9;
+        const char* trigger = logcodec::triggerName(frame.trigger);
+        if (std::find(options.events.begin(), options.events.end(), trigger) != options.events.end()) {
+            robotEvents.push_back({(frame.rx_mono_ns != 0 ? frame.rx_mono_ns : frame.mono_ns) * 1e-9, trigger});
+        }
+        if (frame.trigger == logcodec::Trigger::start) {
+            epochs.push_back({frame.iteration, frame.movement, time_s, time_s, 0.0, 0.0, 0, -1});
+        } else if (!epochs.empty() && epochs.back().trial == frame.iteration) {
+            epochs.back().end_s = time_s;
+        }
+    }
+    std::vector<Event> eegMatched;
+    for (const Event& e : eegEvents) {
+        if (std::find(options.events.begin(), options.events.end(), e.label) != options.events.end()) { eegMatched.push_back(e); }
+    }
+    std::stable_sort(eegMatched.begin(), eegMatched.end(), [](const Event& a, const Event& b) { return a.time_s < b.time_s; });
+
+    Alignment fit;
+    if (!alignClocks(robotEvents, eegMatched, options.tolerance_s, fit)) {
+        report = logPath + ": no robot trigger lines up with an EEG marker (" + std::to_string(robotEvents.size()) + " robot, " +
+                 std::to_string(eegMatched.size()) + " EEG events)";
+        return false;
+    }
+
+    // windows, clipped halfway between neighbouring trials
+    for (size_t k = 0; k < epochs.size(); k++) {
+        Epoch& epoch = epochs[k];
+        epoch.begin_s = epoch.start_s - options.pre_s;
+        epoch.finish_s = epoch.end_s + options.post_s;
+        if (k > 0) { epoch.begin_s = std::max(epoch.begin_s, 0.5 * (epochs[k - 1].end_s + epoch.start_s)); }
+        if (k + 1 < epochs.size()) { epoch.finish_s = std::min(epoch.finish_s, 0.5 * (epoch.end_s + epochs[k + 1].start_s)); }
+        epoch.first = int64_t(std::ceil(fit.eegTime(epoch.begin_s) * fs));
+        epoch.last = int64_t(std::floor(fit.eegTime(epoch.finish_s) * fs));
+        // the halfway point can fall on a sample, which then belongs to the earlier epoch
+        if (k > 0 && epoch.first <= epochs[k - 1].last) { epoch.first = epochs[k - 1].last + 1; }
+    }
+
+    std::vector<int> columns;
+    for (const std::string& name : options.columns) {
+        auto found = std::find(reader.columns().begin(), reader.columns().end(), name);
+        if (found == reader.columns().end()) {
+            report = logPath + ": no column " + name;
+            return false;
+        }
+        columns.push_back(int(found - reader.columns().begin()));
+    }
+    if (options.columns.empty()) {
+        for (int i = 0; i < int(reader.columns().size()); i++) { columns.push_back(i); }
+    }
+
+    /*--------- Pass 2: resample onto the EEG samples of every epoch --------*/
+    std::string outPath = epochPath(logPath, options.outDir);
+    std::ofstream out(outPath);
+    if (!out) {
+        report = "cannot write " + outPath;
+        return false;
+    }
+    out << "# log " << logPath << ", markers " << markerPath << ", fs " << fs << "\n";
+    out << "# robot_s = " << std::setprecision(12) << fit.offset_s << " + " << fit.slope << " * eeg_s\n" << std::setprecision(6);
+    out << "TRIAL\tMOV\tEEG_SAMPLE\tEEG_TIME_S\tEPOCH_TIME_S";
+    for (int c : columns) { out << "\t" << reader.columns()[c]; }
+    out << "\n";
+
+    LogReader rows2;
+    rows2.open(logPath, error);
+    logcodec::Frame previous, current;
+    bool havePrevious = false, haveCurrent = rows2.next(current);
+    int64_t samples = 0;
+    for (const Epoch& epoch : epochs) {
+        double eegStart_s = fit.eegTime(epoch.start_s);
+        for (int64_t n = epoch.first; n <= epoch.last; n++) {
+            double eeg_s = n / fs;
+            double robot_s = fit.robotTime(eeg_s);
+            // move the row pair forward until it brackets the sample
+            while (haveCurrent && current.mono_ns * 1e-9 < robot_s) {
+                previous = current;
+                havePrevious = true;
+                haveCurrent = rows2.next(current);
+            }
+            out << epoch.trial << "\t" << (epoch.movement != 0 ? epoch.movement : '-') << "\t" << n << "\t"
+                << std::setprecision(9) << eeg_s << "\t" << std::setprecision(6) << eeg_s - eegStart_s;
+
+            double t0_s = havePrevious ? previous.mono_ns * 1e-9 : 0.0;
+            double t1_s = haveCurrent ? current.mono_ns * 1e-9 : 0.0;
+            bool exact = haveCurrent && t1_s == robot_s;
+            bool bracketed = havePrevious && haveCurrent && t1_s - t0_s <= options.maxGap_s;
+            double w = bracketed ? (robot_s - t0_s) / (t1_s - t0_s) : 0.0;
+            for (int c : columns) {
+                if (exact) {
+                    out << "\t" << current.columns[c];
+                } else if (bracketed) {
+                    out << "\t" << previous.columns[c] + w * (current.columns[c] - previous.columns[c]);
+                } else {
+                    out << "\tnan";
+                }
+            }
+            out << "\n";
+            samples++;
+        }
+    }
+    out.close();
+    if (!out) {
+        report = "failed writing " + outPath;
+        return false;
+    }
+
+    std::ostringstream summary;
+    summary << logPath << ": " << rows << " rows, " << epochs.size() << " epochs, " << samples << " samples -> " << outPath
+            << "\n    " << fit.matched << "/" << robotEvents.size() << " robot events matched to " << eegMatched.size()
+            << " EEG markers, offset " << std::fixed << std::setprecision(6) << fit.offset_s << " s, drift "
+            << std::setprecision(2) << (fit.slope - 1.0) * 1e6 << " ppm, residual rms " << std::setprecision(3) << fit.rms_ms
+            << " ms, max " << fit.max_ms << " ms";
+    report = summary.str();
+    return true;
+}
+
+void printUsage(const char* exeName) {
+    std::cerr << "usage: " << exeName << " [options] <run_log.txt|run_log.bmz> <markers.tsv> [<log> <markers> ...]\n"
+              << "  -j n               runs processed in parallel (default: number of cores)\n"
+              << "  --eeg-rate hz      EEG sample rate, if the marker file has no \"# fs\" line\n"
+              << "  --events list      trigger names matched between robot and EEG (default START,STOP)\n"
+              << "  --tolerance ms     largest mismatch of a matched event pair after alignment (default 50)\n"
+              << "  --pre s, --post s  epoch window before START and after the end of the trial (default 0.5)\n"
+              << "  --max-gap ms       do not interpolate across robot rows further apart (default 50)\n"
+              << "  --columns list     robot columns to export, comma separated (default all)\n"
+              << "  --out dir          directory of the _epochs.tsv files (default next to each log)\n";
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    int nThreads = std::max(1, int(std::thread::hardware_concurrency()));
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool value = i + 1 < argc;
+        if (arg == "-j" && value) {
+            nThreads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--eeg-rate" && value) {
+            options.eegRate_Hz = std::atof(argv[++i]);
+        } else if (arg == "--events" && value) {
+            options.events = split(argv[++i], ',');
+        } else if (arg == "--tolerance" && value) {
+            options.tolerance_s = std::atof(argv[++i]) / 1e3;
+        } else if (arg == "--pre" && value) {
+            options.pre_s = std::atof(argv[++i]);
+        } else if (arg == "--post" && value) {
+            options.post_s = std::atof(argv[++i]);
+        } else if (arg == "--max-gap" && value) {
+            options.maxGap_s = std::atof(argv[++i]) / 1e3;
+        } else if (arg == "--columns" && value) {
+            options.columns = split(argv[++i], ',');
+        } else if (arg == "--out" && value) {
+            options.outDir = argv[++i];
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.empty() || files.size() % 2 != 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    size_t nRuns = files.size() / 2;
+    std::vector<std::string> reports(nRuns);
+    std::vector<char> merged(nRuns, 0);
+    std::atomic<size_t> nextRun{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < std::min<int>(nThreads, int(nRuns)); t++) {
+        workers.emplace_back([&] {
+            for (size_t r; (r = nextRun.fetch_add(1)) < nRuns;) {
+                merged[r] = mergeRun(files[2 * r], files[2 * r + 1], options, reports[r]);
+            }
+        });
+    }
+    for (std::thread& worker : workers) { worker.join(); }
+
+    int failed = 0;
+    for (size_t r = 0; r < nRuns; r++) {
+        (merged[r] ? std::cout : std::cerr) << reports[r] << std::endl;
+        failed += !merged[r];
+    }
+    if (failed > 0) { std::cerr << failed << " of " << nRuns << " runs failed" << std::endl; }
+    return failed > 0 ? 1 : 0;
+}
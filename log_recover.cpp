@@ -0,0 +1,65 @@
+/**
+ * @file log_recover.cpp
+ * @brief rebuild a session log from the segment files of an interrupted session
+ *
+ * usage: log_recover <./log/<prefix>_log | any of its .segNNNN files> [out file]
+ * Without an output file the log is written next to the segments as _log.txt
+ * (or _log.bmz for compressed sessions), an existing file is never overwritten.
+ * Segments are left in place.
+ */
+
+#include "log_segment.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <./log/<prefix>_log | <prefix>_log.segNNNN> [out file]" << std::endl;
+        return 1;
+    }
+
+    std::string base = argv[1];
+    size_t seg = base.rfind(".seg");
+    if (seg != std::string::npos && seg + 8 == base.size()) { base = base.substr(0, seg); }
+
+    std::string tmpPath = base + ".recovering";
+    std::ofstream out(tmpPath, std::ios::out | std::ios::binary);
+    if (!out) {
+        std::cerr << "cannot write " << tmpPath << std::endl;
+        return 1;
+    }
+
+    logsegment::RecoveryResult result;
+    bool recovered = logsegment::recover(base, out, result);
+    out.close();
+    if (!recovered) {
+        std::remove(tmpPath.c_str());
+        std::cerr << result.message << std::endl;
+        return 1;
+    }
+
+    std::string outPath = argc > 2 ? argv[2] : base + ((result.flags & logsegment::flagCompressed) ? ".bmz" : ".txt");
+    struct stat st;
+    if (argc <= 2 && stat(outPath.c_str(), &st) == 0) {
+        outPath = base + ".recovered" + ((result.flags & logsegment::flagCompressed) ? ".bmz" : ".txt");
+    }
+    if (std::rename(tmpPath.c_str(), outPath.c_str()) != 0) {
+        std::cerr << "cannot write " << outPath << ", recovered log left in " << tmpPath << std::endl;
+        return 1;
+    }
+
+    std::cout << "segments : " << result.segments << "\n";
+    std::cout << "records  : " << result.records << "\n";
+    std::cout << "bytes    : " << result.bytes << "\n";
+    std::cout << "written  : " << outPath << "\n";
+    if (!result.clean) {
+        std::cout << "stopped early: " << result.message << "\n";
+        if (result.flags & logsegment::flagCompressed) {
+            std::cout << "the last .bmz block may be cut short, log_decode stops there\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,306 @@
+/**
+ * @file log_segment.h
+ * @brief crash safe session log storage in preallocated, checksummed segment files
+ * @version 0.1
+ *
+ * The log is written as a byte stream split into records. Records go into fixed size
+ * segment files (<base>.seg0000, <base>.seg0001, ...) that are preallocated with
+ * fallocate when opened, and a background thread fdatasyncs the open segment
+ * periodically. If the process dies, everything up to the last synced record can be
+ * rebuilt with recover() (see log_recover.cpp).
+ *
+ * segment : header (32 bytes) | record | record | ... | zero fill
+ * header  : "BMSG" | uint32 version | uint32 index | uint32 flags | uint64 session id
+ *           | uint32 segment size | uint32 crc32 of the previous 28 bytes
+ * record  : "BMRC" | uint32 sequence | uint32 payload length | uint32 crc32(payload) | payload
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace logsegment {
+
+constexpr size_t segmentHeaderBytes = 32;
+constexpr size_t recordHeaderBytes = 16;
+constexpr uint32_t version = 1;
+constexpr uint32_t flagCompressed = 1; // payload is a .bmz stream instead of text
+
+inline uint32_t crc32(const void* data, size_t len, uint32_t crc = 0) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) { c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1; }
+            t[i] = c;
+        }
+        return t;
+    }();
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) { crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8); }
+    return ~crc;
+}
+
+inline std::string segmentPath(const std::string& base, uint32_t index) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".seg%04u", index);
+    return base + suffix;
+}
+
+/**
+ * @brief Open file descriptor, closed when the last user lets go of it
+ */
+struct SegmentFile {
+    int fd = -1;
+    ~SegmentFile() {
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+    }
+};
+
+/**
+ * @brief Appends records to rotating, preallocated segment files
+ * append() is meant to be called from one thread (the log writer). A second thread
+ * owned by this object calls fdatasync on the open segment every syncInterval_ms.
+ */
+class SegmentWriter {
+public:
+    SegmentWriter(const std::string& base, uint32_t flags, size_t segmentBytes, int syncInterval_ms)
+        : base_(base), flags_(flags), segmentBytes_(segmentBytes), syncInterval_ms_(syncInterval_ms) {
+        sessionId_ = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        ok_ = openSegment(0);
+        syncThread_ = std::thread(&SegmentWriter::syncLoop, this);
+    }
+
+    ~SegmentWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        syncThread_.join();
+    }
+
+    bool ok() const { return ok_; }
+    uint32_t segments() const { return index_ + 1; }
+    uint64_t bytesWritten() const { return bytesWritten_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Append data to the log, split over as many records as needed
+     */
+    bool append(const void* data, size_t len) {
+        const uint8_t* p = (const uint8_t*)data;
+        while (ok_ && len > 0) {
+            size_t room = segmentBytes_ - offset_;
+            if (room <= recordHeaderBytes) {
+                ok_ = openSegment(index_ + 1);
+                continue;
+            }
+            size_t chunk = std::min(len, room - recordHeaderBytes);
+
+            uint8_t header[recordHeaderBytes];
+            uint32_t length = uint32_t(chunk);
+            uint32_t crc = crc32(p, chunk);
+            memcpy(header, "BMRC", 4);
+            memcpy(header + 4, &sequence_, 4);
+            memcpy(header + 8, &length, 4);
+            memcpy(header + 12, &crc, 4);
+
+            // payload first, header last: a record only becomes valid once complete
+            if (pwrite(file_->fd, p, chunk, off_t(offset_ + recordHeaderBytes)) != ssize_t(chunk) ||
+                pwrite(file_->fd, header, recordHeaderBytes, off_t(offset_)) != ssize_t(recordHeaderBytes)) {
+                ok_ = false;
+                break;
+            }
+            offset_ += recordHeaderBytes + chunk;
+            sequence_++;
+            p += chunk;
+            len -= chunk;
+            bytesWritten_.fetch_add(chunk, std::memory_order_relaxed);
+            dirty_.store(true, std::memory_order_release);
+        }
+        return ok_;
+    }
+
+private:
+    bool openSegment(uint32_t index) {
+        auto file = std::make_shared<SegmentFile>();
+        file->fd = open(segmentPath(base_, index).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (file->fd < 0) { return false; }
+        if (fallocate(file->fd, 0, 0, off_t(segmentBytes_)) != 0 && ftruncate(file->fd, off_t(segmentBytes_)) != 0) {
+            return false;
+        }
+
+        uint8_t header[segmentHeaderBytes] = {};
+        uint32_t size = uint32_t(segmentBytes_);
+        memcpy(header, "BMSG", 4);
+        memcpy(header + 4, &version, 4);
+        memcpy(header + 8, &index, 4);
+        memcpy(header + 12, &flags_, 4);
+        memcpy(header + 16, &sessionId_, 8);
+        memcpy(header + 24, &size, 4);
+        uint32_t crc = crc32(header, 28);
+        memcpy(header + 28, &crc, 4);
+        if (pwrite(file->fd, header, segmentHeaderBytes, 0) != ssize_t(segmentHeaderBytes)) { return false; }
+
+        // the previous segment is synced and closed by whoever drops it last
+        std::lock_guard<std::mutex> lock(mutex_);
+        file_ = file;
+        index_ = index;
+        offset_ = segmentHeaderBytes;
+        return true;
+    }
+
+    void syncLoop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            wake_.wait_for(lock, std::chrono::milliseconds(syncInterval_ms_));
+            if (!dirty_.exchange(false, std::memory_order_acq_rel)) { continue; }
+            std::shared_ptr<SegmentFile> file = file_;
+            lock.unlock();
+            if (file) { fdatasync(file->fd); }
+            lock.lock();
+        }
+        file_.reset();
+    }
+
+    std::string base_;
+    uint32_t flags_;
+    size_t segmentBytes_;
+    int syncInterval_ms_;
+    uint64_t sessionId_ = 0;
+    bool ok_ = false;
+
+    std::shared_ptr<SegmentFile> file_;
+    uint32_t index_ = 0;
+    size_t offset_ = 0;
+    uint32_t sequence_ = 0;
+    std::atomic<uint64_t> bytesWritten_{0};
+    std::atomic<bool> dirty_{false};
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    std::thread syncThread_;
+};
+
+/**
+ * @brief What recover() found
+ */
+struct RecoveryResult {
+    uint32_t flags = 0;
+    uint32_t segments = 0;
+    uint32_t records = 0;
+    uint64_t bytes = 0;
+    bool clean = true; // false if a damaged record or segment was found before the end
+    std::string message;
+};
+
+/**
+ * @brief Rebuild the log stream from the segments of base
+ * Records are copied to out in sequence order until the first record that is missing,
+ * torn or fails its checksum. Segments from a different session are ignored.
+ */
+inline bool recover(const std::string& base, std::ostream& out, RecoveryResult& result) {
+    uint64_t sessionId = 0;
+    uint32_t expected = 0;
+    std::vector<uint8_t> payload;
+
+    for (uint32_t index = 0;; index++) {
+        int fd = open(segmentPath(base, index).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { break; }
+
+        uint8_t header[segmentHeaderBytes];
+        uint32_t headerCrc, segmentBytes, headerIndex;
+        uint64_t headerSession;
+        if (pread(fd, header, segmentHeaderBytes, 0) != ssize_t(segmentHeaderBytes) || memcmp(header, "BMSG", 4) != 0) {
+            close(fd);
+            result.clean = false;
+            result.message = "bad header in " + segmentPath(base, index);
+            break;
+        }
+        memcpy(&headerIndex, header + 8, 4);
+        memcpy(&headerSession, header + 16, 8);
+        memcpy(&segmentBytes, header + 24, 4);
+        memcpy(&headerCrc, header + 28, 4);
+        off_t fileBytes = lseek(fd, 0, SEEK_END);
+        if (fileBytes >= 0 && uint64_t(fileBytes) < segmentBytes) { segmentBytes = uint32_t(fileBytes); } // truncated file
+        if (headerCrc != crc32(header, 28) || headerIndex != index || (index > 0 && headerSession != sessionId)) {
+            close(fd);
+            result.clean = false;
+            result.message = "segment " + segmentPath(base, index) + " does not belong to this session";
+            break;
+        }
+        if (index == 0) {
+            sessionId = headerSession;
+            memcpy(&result.flags, header + 12, 4);
+        }
+        result.segments++;
+
+        size_t offset = segmentHeaderBytes;
+        bool segmentDone = false;
+        while (!segmentDone && offset + recordHeaderBytes <= segmentBytes) {
+            uint8_t record[recordHeaderBytes];
+            uint32_t sequence, length, crc;
+            if (pread(fd, record, recordHeaderBytes, off_t(offset)) != ssize_t(recordHeaderBytes) ||
+                memcmp(record, "BMRC", 4) != 0) {
+                break; // end of the written part of this segment
+            }
+            memcpy(&sequence, record + 4, 4);
+            memcpy(&length, record + 8, 4);
+            memcpy(&crc, record + 12, 4);
+
+            // bounds first: the length of a damaged record can be anything
+            bool inBounds = sequence == expected && offset + recordHeaderBytes + uint64_t(length) <= segmentBytes;
+            if (inBounds) { payload.resize(length); }
+            if (!inBounds || pread(fd, payload.data(), length, off_t(offset + recordHeaderBytes)) != ssize_t(length) ||
+                crc32(payload.data(), length) != crc) {
+                result.clean = false;
+                result.message = "record " + std::to_string(expected) + " missing or damaged, stopped in " + segmentPath(base, index);
+                segmentDone = true;
+                break;
+            }
+            out.write((const char*)payload.data(), length);
+            result.records++;
+            result.bytes += length;
+            expected++;
+            offset += recordHeaderBytes + length;
+        }
+        close(fd);
+        if (segmentDone) { break; }
+    }
+
+    if (result.segments == 0) {
+        result.clean = false;
+        if (result.message.empty()) { result.message = "no segments found for " + base; }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Delete the segment files of base
+ */
+inline void removeSegments(const std::string& base) {
+    for (uint32_t index = 0; unlink(segmentPath(base, index).c_str()) == 0; index++) {}
+}
+
+} // namespace logsegment
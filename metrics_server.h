@@ -0,0 +1,96 @@
+/**
+ * @file metrics_server.h
+ * @brief loopback HTTP endpoint for Prometheus scrapes of the session metrics
+ * @version 0.1
+ *
+ * The server knows nothing about the metrics themselves: it calls a render function
+ * for every GET and sends back what it wrote, in the text exposition format
+ * (see renderMetrics in bmi_exercise.cpp).
+ */
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace metrics {
+
+/**
+ * @brief Minimal HTTP/1.0 server on the loopback interface that answers every GET
+ * with the current metrics. Runs on its own thread; the metrics are only read, and
+ * only while a scrape is being answered.
+ */
+class MetricsServer {
+public:
+    MetricsServer(int port, std::function<void(std::ostream&)> render) : render_(render) {
+        if (port <= 0) { return; }
+        sockfd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(uint16_t(port));
+        if (sockfd_ < 0 || bind(sockfd_, (const sockaddr*)&addr, sizeof(addr)) < 0 || listen(sockfd_, 4) < 0) {
+            std::cerr << "Metrics endpoint unavailable on port " << port << std::endl;
+            if (sockfd_ >= 0) { close(sockfd_); }
+            sockfd_ = -1;
+            return;
+        }
+        thread_ = std::thread(&MetricsServer::run, this);
+    }
+
+    ~MetricsServer() {
+        if (!thread_.joinable()) { return; }
+        stopping_.store(true);
+        thread_.join();
+        close(sockfd_);
+    }
+
+private:
+    void run() {
+        char request[1024];
+        while (!stopping_.load()) {
+            pollfd pfd = {sockfd_, POLLIN, 0};
+            if (poll(&pfd, 1, 200) <= 0) { continue; }
+            int client = accept4(sockfd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) { continue; }
+
+            // one request per connection, wait briefly for it
+            pollfd cfd = {client, POLLIN, 0};
+            ssize_t n = poll(&cfd, 1, 1000) > 0 ? recv(client, request, sizeof(request) - 1, 0) : 0;
+            std::string response;
+            if (n > 0 && strncmp(request, "GET ", 4) == 0) {
+                std::ostringstream body;
+                render_(body);
+                std::string text = body.str();
+                response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                    std::to_string(text.size()) + "\r\nConnection: close\r\n\r\n" + text;
+            } else {
+                response = "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            }
+            for (size_t sent = 0; sent < response.size();) {
+                ssize_t k = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (k <= 0) { break; }
+                sent += size_t(k);
+            }
+            close(client);
+        }
+    }
+
+    std::function<void(std::ostream&)> render_;
+    int sockfd_ = -1;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+
+} // namespace metrics
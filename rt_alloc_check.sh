@@ -0,0 +1,44 @@
+#!/bin/bash
+# Real-time allocation check: build the simulation with -DRT_ALLOC_CHECK, run scripted
+# sessions on a virtual clock and fail if any control tick touched the heap.
+# usage: ./rt_alloc_check.sh [work dir]   (default: a temporary directory, kept only on failure)
+set -u
+
+src="$(cd "$(dirname "$0")" && pwd)"
+work="${1:-}"
+if [ -z "$work" ]; then
+    work="$(mktemp -d)"
+    trap 'rm -rf "$work"' EXIT
+fi
+mkdir -p "$work/log"
+
+echo "Building $work/bmi_exercise_rt"
+g++ -std=c++17 -O0 -g -DSIM_BACKEND -DRT_ALLOC_CHECK -rdynamic "$src/bmi_exercise.cpp" -o "$work/bmi_exercise_rt" -pthread || exit 1
+
+answers="--subject 1 --online 0 --session 1 --run 1 --side r"
+failed=0
+run() {
+    local name="$1"
+    shift
+    echo "== $name"
+    (cd "$work" && ./bmi_exercise_rt --script "$src/sim_session.txt" --speed 0 --feedback off --metrics-port 0 $answers "$@" \
+        </dev/null >"$work/$name.out" 2>&1)
+    local status=$?
+    grep "Real-time allocation check" "$work/$name.out"
+    if [ $status -ne 0 ]; then
+        echo "FAILED: exit status $status (3: allocations in a control tick), output in $work/$name.out"
+        grep -A 40 "Real-time allocation check" "$work/$name.out" | tail -n +2
+        failed=1
+    fi
+}
+
+run arms --joints arms
+run torso --joints torso
+run robots --joints arms --robots 2
+
+if [ $failed -ne 0 ]; then
+    trap - EXIT
+    echo "Real-time allocation check FAILED"
+    exit 1
+fi
+echo "Real-time allocation check passed"
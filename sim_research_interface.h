@@ -0,0 +1,275 @@
+/**
+ * @file sim_research_interface.h
+ * @brief simulated stand-in for the Harmony research interface (build with -DSIM_BACKEND)
+ * @version 0.1
+ *
+ * Provides the part of the harmony:: API that bmi_exercise uses, backed by a simple
+ * model instead of the robot:
+ *  - every joint follows its JointOverride with first order dynamics,
+ *    damping * dq/dt = stiffness * (target - q), integrated exactly between queries
+ *  - reported torque is the spring torque stiffness * (target - q)
+ *  - without an override (harmony mode) joints stay where they are
+ *  - end effector positions come from a coarse two link arm model
+ *
+ * Time comes from a pluggable source (setTimeSource) so the model can run on a
+ * virtual clock, faster than real time and fully deterministic.
+ */
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace harmony {
+
+constexpr int armJointCount = 7;
+constexpr int torsoJointCount = 2;
+
+enum class ArmJoint {
+    shoulderElevation,
+    shoulderProtraction,
+    shoulderAbduction,
+    shoulderRotation,
+    shoulderFlexion,
+    elbowFlexion,
+    wristPronation
+};
+
+struct JointState {
+    double position_rad = 0.0;
+    double torque_Nm = 0.0;
+};
+
+struct JointOverride {
+    double position_rad = 0.0;
+    double stiffness_Nm_p_rad = 0.0;
+};
+
+struct ArmJointsOverride {
+    ArmJointsOverride(const std::array<JointOverride, armJointCount>& joints) : joints(joints) {}
+    std::array<JointOverride, armJointCount> joints;
+};
+
+struct TorsoJointsOverride {
+    TorsoJointsOverride(const std::array<JointOverride, torsoJointCount>& joints) : joints(joints) {}
+    std::array<JointOverride, torsoJointCount> joints;
+};
+
+struct Vector3 {
+    double x = 0.0;
+    double y = 0.0;
+    double z = 0.0;
+};
+
+struct Pose {
+    Vector3 position_mm;
+};
+
+template <int N>
+struct JointStates {
+    std::array<JointState, N> states;
+    std::array<JointState, N> getOrderedStates() const { return states; }
+};
+
+struct Joints {
+    JointStates<armJointCount> leftArm;
+    JointStates<armJointCount> rightArm;
+    JointStates<torsoJointCount> torso;
+};
+
+struct Poses {
+    Pose leftEndEffector;
+    Pose rightEndEffector;
+};
+
+namespace sim {
+
+/**
+ * @brief State of one simulated joint group (an arm or the torso)
+ */
+template <int N>
+struct Group {
+    std::array<double, N> position{};
+    std::array<double, N> target{};
+    std::array<double, N> stiffness{};
+    std::array<double, N> damping{};
+    bool overridden = false;
+
+    void advance(double dt_s) {
+        for (int i = 0; i < N; i++) {
+            if (!overridden || stiffness[i] <= 0.0) { continue; }
+            position[i] += (target[i] - position[i]) * (1.0 - std::exp(-stiffness[i] / damping[i] * dt_s));
+        }
+    }
+
+    std::array<JointState, N> states() const {
+        std::array<JointState, N> out;
+        for (int i = 0; i < N; i++) {
+            out[i].position_rad = position[i];
+            out[i].torque_Nm = overridden ? stiffness[i] * (target[i] - position[i]) : 0.0;
+        }
+        return out;
+    }
+
+    template <typename Override>
+    void set(const Override& o) {
+        for (int i = 0; i < N; i++) {
+            target[i] = o.joints[i].position_rad;
+            stiffness[i] = o.joints[i].stiffness_Nm_p_rad;
+        }
+        overridden = true;
+    }
+};
+
+/**
+ * @brief Whole robot model shared by the interface and its controllers
+ */
+struct Robot {
+    std::mutex mutex;
+    std::function<int64_t()> now_ns;
+    int64_t last_ns = 0;
+    Group<armJointCount> left;
+    Group<armJointCount> right;
+    Group<torsoJointCount> torso;
+
+    Robot() {
+        now_ns = [] {
+            return int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        };
+        // arms hang relaxed, wrist joints are much lighter than the rest
+        for (int i = 0; i < armJointCount; i++) {
+            double damping = i == int(ArmJoint::wristPronation) ? 0.1 : 1.0;
+            left.damping[i] = right.damping[i] = damping;
+        }
+        torso.damping.fill(2.0);
+        last_ns = now_ns();
+    }
+
+    /**
+     * @brief Integrate the model up to the current time, call with mutex held
+     */
+    void update() {
+        int64_t now = now_ns();
+        double dt_s = (now - last_ns) * 1e-9;
+        last_ns = now;
+        if (dt_s <= 0.0) { return; }
+        left.advance(dt_s);
+        right.advance(dt_s);
+        torso.advance(dt_s);
+    }
+};
+
+/**
+ * @brief Hand position of the coarse arm model, same model as the workspace table
+ * @param sign 1 for the right arm, -1 for the left arm (mirrored joints)
+ */
+inline Pose handPose(const std::array<double, armJointCount>& q, double sign) {
+    const double upperArm_mm = 300.0, forearm_mm = 280.0, shoulderWidth_mm = 200.0;
+    double qa = sign * q[int(ArmJoint::shoulderAbduction)], qb = sign * q[int(ArmJoint::shoulderFlexion)];
+    double qc = sign * q[int(ArmJoint::elbowFlexion)];
+    double x = upperArm_mm * std::sin(qb) + forearm_mm * std::sin(qb - qc);
+    double z = -upperArm_mm * std::cos(qb) - forearm_mm * std::cos(qb - qc);
+    Pose pose;
+    pose.position_mm.x = x;
+    pose.position_mm.y = sign * (shoulderWidth_mm - z * std::sin(qa));
+    pose.position_mm.z = z * std::cos(qa);
+    return pose;
+}
+
+} // namespace sim
+
+class ArmController {
+public:
+    enum class Mode { harmony, jointsOverride };
+
+    ArmController(std::shared_ptr<sim::Robot> robot, bool isLeft) : robot_(robot), isLeft_(isLeft) {}
+
+    bool init() { return true; }
+
+    void setJointsOverride(const ArmJointsOverride& joints) {
+        std::lock_guard<std::mutex> lock(robot_->mutex);
+        robot_->update();
+        (isLeft_ ? robot_->left : robot_->right).set(joints);
+    }
+
+    void removeOverride() {
+        std::lock_guard<std::mutex> lock(robot_->mutex);
+        robot_->update();
+        (isLeft_ ? robot_->left : robot_->right).overridden = false;
+    }
+
+private:
+    std::shared_ptr<sim::Robot> robot_;
+    bool isLeft_;
+};
+
+class TorsoController {
+public:
+    explicit TorsoController(std::shared_ptr<sim::Robot> robot) : robot_(robot) {}
+
+    bool init() { return true; }
+
+    void setJointsOverride(const TorsoJointsOverride& joints) {
+        std::lock_guard<std::mutex> lock(robot_->mutex);
+        robot_->update();
+        robot_->torso.set(joints);
+    }
+
+    void removeOverride() {
+        std::lock_guard<std::mutex> lock(robot_->mutex);
+        robot_->update();
+        robot_->torso.overridden = false;
+    }
+
+private:
+    std::shared_ptr<sim::Robot> robot_;
+};
+
+class ResearchInterface {
+public:
+    ResearchInterface() : robot_(std::make_shared<sim::Robot>()) {}
+
+    bool init() { return true; }
+
+    /**
+     * @brief Drive the model from another clock, e.g. a virtual one (simulation only)
+     * @param now_ns returns the current time in nanoseconds
+     */
+    void setTimeSource(std::function<int64_t()> now_ns) {
+        std::lock_guard<std::mutex> lock(robot_->mutex);
+        robot_->now_ns = now_ns;
+        robot_->last_ns = now_ns();
+    }
+
+    std::shared_ptr<ArmController> makeLeftArmController() { return std::make_shared<ArmController>(robot_, true); }
+    std::shared_ptr<ArmController> makeRightArmController() { return std::make_shared<ArmController>(robot_, false); }
+    std::shared_ptr<TorsoController> makeTorsoController() { return std::make_shared<TorsoController>(robot_); }
+
+    Joints joints() {
+        std::lock_guard<std::mutex> lock(robot_->mutex);
+        robot_->update();
+        Joints joints;
+        joints.leftArm.states = robot_->left.states();
+        joints.rightArm.states = robot_->right.states();
+        joints.torso.states = robot_->torso.states();
+        return joints;
+    }
+
+    Poses poses() {
+        std::lock_guard<std::mutex> lock(robot_->mutex);
+        robot_->update();
+        Poses poses;
+        poses.leftEndEffector = sim::handPose(robot_->left.position, -1.0);
+        poses.rightEndEffector = sim::handPose(robot_->right.position, 1.0);
+        return poses;
+    }
+
+private:
+    std::shared_ptr<sim::Robot> robot_;
+};
+
+} // namespace harmony
@@ -3,11 +3,13 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <cstring>
+#include <cstdlib>
 
 #define PORT 8080
 #define MAX_BUFFER_SIZE 1024
 
-int main() {
+int main(int argc, char** argv) {
+    int port = argc > 1 ? std::atoi(argv[1]) : PORT; // e.g. 8081 to watch the bmi_exercise feedback
     int sockfd, buffer_len;
     char buffer[MAX_BUFFER_SIZE];
     struct sockaddr_in servaddr, cliaddr;
@@ -28,7 +30,7 @@ int main() {
     // Filling server information
     servaddr.sin_family = AF_INET; // IPv4
     servaddr.sin_addr.s_addr = INADDR_ANY;
-    servaddr.sin_port = htons(PORT);
+    servaddr.sin_port = htons(port);
 
     // Bind the socket with the server address
     if (bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
@@ -0,0 +1,418 @@
+/**
+ * @file unit_tests.cpp
+ * @brief unit tests of the pure parts: log segment recovery, the .bmz block codec and
+ * the joint trajectories (minimum jerk moves, the blender, the demonstration spline)
+ *
+ * usage: unit_tests [work dir]   (run by unit_tests.sh; segment files go to the work
+ * dir, default /tmp). Prints every failed check and exits with the number of failures.
+ */
+
+#include "joint_trajectory.h"
+#include "log_codec.h"
+#include "log_segment.h"
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(condition)                                                                      \
+    do {                                                                                      \
+        checks++;                                                                             \
+        if (!(condition)) {                                                                   \
+            failures++;                                                                       \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": FAILED " << #condition << std::endl; \
+        }                                                                                     \
+    } while (0)
+
+#define CHECK_NEAR(a, b, tolerance) CHECK(std::fabs(double(a) - double(b)) <= (tolerance))
+
+/**
+ * @brief Three joints, column 0 unused like the robot configurations
+ */
+struct TestConfig {
+    static constexpr int nCols = 4;
+    using DataLine = std::array<double, nCols>;
+};
+using DataLine = TestConfig::DataLine;
+
+/******************************************************************************************
+ * Log segments
+ *****************************************************************************************/
+#define RECORD_BYTES 100 // payload of every test record
+#define SEGMENT_BYTES 960 // exactly 8 records after the segment header, none split
+
+/**
+ * @brief Write n records of RECORD_BYTES to fresh segments of base, record k filled with byte k
+ */
+std::string writeSegments(const std::string& base, int n) {
+    logsegment::removeSegments(base);
+    std::string written;
+    logsegment::SegmentWriter writer(base, 0, SEGMENT_BYTES, 1000);
+    for (int k = 0; k < n; k++) {
+        std::string record(RECORD_BYTES, char('a' + k % 26));
+        writer.append(record.data(), record.size());
+        written += record;
+    }
+    return written;
+}
+
+/**
+ * @brief File offset of record k of segment 0
+ */
+size_t recordOffset(int k) {
+    return logsegment::segmentHeaderBytes + size_t(k) * (logsegment::recordHeaderBytes + RECORD_BYTES);
+}
+
+void patch(const std::string& path, size_t offset, const void* bytes, size_t len) {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(std::streamoff(offset));
+    file.write((const char*)bytes, std::streamsize(len));
+}
+
+void testRecover(const std::string& dir) {
+    std::string base = dir + "/unit_tests_log";
+    std::string segment0 = logsegment::segmentPath(base, 0);
+
+    // intact: every record back, across the segment boundary
+    {
+        std::string written = writeSegments(base, 12);
+        std::ostringstream out;
+        logsegment::RecoveryResult result;
+        CHECK(logsegment::recover(base, out, result));
+        CHECK(result.clean);
+        CHECK(result.segments == 2);
+        CHECK(result.records == 12);
+        CHECK(out.str() == written);
+    }
+
+    // torn record: the file ends inside the payload of record 3
+    {
+        std::string written = writeSegments(base, 5);
+        CHECK(truncate(segment0.c_str(), off_t(recordOffset(3) + logsegment::recordHeaderBytes + RECORD_BYTES / 2)) == 0);
+        std::ostringstream out;
+        logsegment::RecoveryResult result;
+        CHECK(logsegment::recover(base, out, result));
+        CHECK(!result.clean);
+        CHECK(result.records == 3);
+        CHECK(out.str() == written.substr(0, 3 * RECORD_BYTES));
+    }
+
+    // bad checksum: one payload byte of record 1 flipped
+    {
+        std::string written = writeSegments(base, 5);
+        char flipped = 'X';
+        patch(segment0, recordOffset(1) + logsegment::recordHeaderBytes + 7, &flipped, 1);
+        std::ostringstream out;
+        logsegment::RecoveryResult result;
+        CHECK(logsegment::recover(base, out, result));
+        CHECK(!result.clean);
+        CHECK(result.records == 1);
+        CHECK(out.str() == written.substr(0, RECORD_BYTES));
+    }
+
+    // oversized length: record 2 claims far more than the segment holds
+    {
+        std::string written = writeSegments(base, 5);
+        uint32_t length = 0xfffffff0u;
+        patch(segment0, recordOffset(2) + 8, &length, 4);
+        std::ostringstream out;
+        logsegment::RecoveryResult result;
+        CHECK(logsegment::recover(base, out, result));
+        CHECK(!result.clean);
+        CHECK(result.records == 2);
+        CHECK(out.str() == written.substr(0, 2 * RECORD_BYTES));
+    }
+
+    // segment 1 from another session: only segment 0 is recovered
+    {
+        std::string other = dir + "/unit_tests_other";
+        writeSegments(other, 12);
+        std::string written = writeSegments(base, 12);
+        CHECK(rename(logsegment::segmentPath(other, 1).c_str(), logsegment::segmentPath(base, 1).c_str()) == 0);
+        std::ostringstream out;
+        logsegment::RecoveryResult result;
+        CHECK(logsegment::recover(base, out, result));
+        CHECK(!result.clean);
+        CHECK(result.segments == 1);
+        CHECK(result.records == 8);
+        CHECK(out.str() == written.substr(0, 8 * RECORD_BYTES));
+        logsegment::removeSegments(other);
+    }
+
+    // no segments at all
+    {
+        logsegment::removeSegments(base);
+        std::ostringstream out;
+        logsegment::RecoveryResult result;
+        CHECK(!logsegment::recover(base, out, result));
+        CHECK(!result.clean);
+    }
+}
+
+/******************************************************************************************
+ * Block codec
+ *****************************************************************************************/
+void testCodec() {
+    const std::vector<double> resolutions = {0.001, 0.001, 0.01};
+    std::vector<logcodec::Frame> frames(300);
+    for (int f = 0; f < int(frames.size()); f++) {
+        logcodec::Frame& frame = frames[f];
+        frame.mono_ns = 1000000000LL + f * 10000000LL + (f % 7) * 1000;
+        frame.real_ns = 1700000000000000000LL + frame.mono_ns;
+        frame.rx_mono_ns = f % 50 == 0 ? frame.mono_ns - 20000 : 0;
+        frame.iteration = f / 100;
+        frame.movement = "xyz"[f % 3];
+        frame.trigger = f % 100 == 0 ? logcodec::Trigger::start : logcodec::Trigger::moving;
+        frame.nColumns = 3;
+        frame.columns[0] = 0.001 * std::lround(1000 * std::sin(0.01 * f));
+        frame.columns[1] = -0.001 * f;
+        frame.columns[2] = 0.01 * (f % 13);
+    }
+
+    // header block and two frame blocks, as the log writer makes them
+    std::vector<uint8_t> bytes;
+    logcodec::writeHeaderBlock(bytes, "HEADER\tLINE\n");
+    logcodec::BlockEncoder encoder(resolutions);
+    for (int f = 0; f < int(frames.size()); f++) {
+        encoder.add(frames[f]);
+        if (f == 199) { encoder.finish(bytes); }
+    }
+    encoder.finish(bytes);
+
+    std::istringstream in(std::string(bytes.begin(), bytes.end()));
+    std::vector<uint8_t> block;
+    std::string header;
+    std::vector<logcodec::Frame> decoded;
+    bool truncated = false, corrupt = false;
+    int blocks = 0;
+    while (logcodec::readBlock(in, block, truncated, &corrupt)) {
+        CHECK(logcodec::decodeBlock(block.data(), block.size(), header, decoded) == block.size());
+        blocks++;
+    }
+    CHECK(!truncated && !corrupt);
+    CHECK(blocks == 3);
+    CHECK(header == "HEADER\tLINE\n");
+    CHECK(decoded.size() == frames.size());
+    for (size_t f = 0; f < std::min(decoded.size(), frames.size()); f++) {
+        const logcodec::Frame &a = frames[f], &b = decoded[f];
+        CHECK(a.mono_ns == b.mono_ns && a.real_ns == b.real_ns && a.rx_mono_ns == b.rx_mono_ns && a.rx_real_ns == b.rx_real_ns);
+        CHECK(a.iteration == b.iteration && a.movement == b.movement && a.trigger == b.trigger && b.nColumns == 3);
+        for (int i = 0; i < 3; i++) { CHECK_NEAR(a.columns[i], b.columns[i], resolutions[i] / 2); }
+    }
+
+    // cut inside the last block: truncated, the blocks before it still read
+    {
+        std::istringstream cut(std::string(bytes.begin(), bytes.end() - 5));
+        int whole = 0;
+        while (logcodec::readBlock(cut, block, truncated, &corrupt)) { whole++; }
+        CHECK(whole == 2);
+        CHECK(truncated && !corrupt);
+    }
+
+    // damaged headers are corrupt, and nothing is allocated for them
+    auto damaged = [&](size_t offset, const void* patch, size_t len) {
+        std::vector<uint8_t> copy(bytes.begin() + 20, bytes.end()); // starts at the first frame block
+        memcpy(copy.data() + offset, patch, len);
+        std::istringstream bad(std::string(copy.begin(), copy.end()));
+        bool isTruncated = false, isCorrupt = false;
+        bool read = logcodec::readBlock(bad, block, isTruncated, &isCorrupt);
+        return !read && isCorrupt && block.size() <= logcodec::blockHeaderBytes;
+    };
+    uint16_t columns = 60000;
+    uint32_t payload = 0xfffffff0u;
+    CHECK(damaged(0, "BMQ1", 4));
+    CHECK(damaged(12, &columns, 2));
+    CHECK(damaged(4, &payload, 4));
+
+    // decodeBlock itself refuses a block shorter than it claims
+    std::vector<logcodec::Frame> none;
+    CHECK(logcodec::decodeBlock(bytes.data() + 20, 30, header, none) == 0);
+    CHECK(none.empty());
+}
+
+/******************************************************************************************
+ * Joint trajectories
+ *****************************************************************************************/
+void testMinimumJerk() {
+    DataLine start = {0.0, 0.0, 1.0, -0.5};
+    DataLine finish = {0.0, 2.0, 1.0, 0.5};
+    const int nSteps = 400;
+    const double dt_s = 0.005, T = nSteps * dt_s;
+    DataLine first = jointtrajectory::step2targetPosition<TestConfig>(start, finish, 0, nSteps);
+    DataLine last = jointtrajectory::step2targetPosition<TestConfig>(start, finish, nSteps, nSteps);
+    DataLine middle = jointtrajectory::step2targetPosition<TestConfig>(start, finish, nSteps / 2, nSteps);
+    for (int i = 1; i < TestConfig::nCols; i++) {
+        CHECK_NEAR(first[i], start[i], 1e-12);
+        CHECK_NEAR(last[i], finish[i], 1e-12);
+        CHECK_NEAR(middle[i], 0.5 * (start[i] + finish[i]), 1e-12);
+    }
+
+    // monotonic, at rest at both ends, peak speed 1.875 d / T at the middle
+    double peak = 0.0, previous = start[1];
+    bool monotonic = true;
+    for (int k = 1; k <= nSteps; k++) {
+        double q = jointtrajectory::step2targetPosition<TestConfig>(start, finish, k, nSteps)[1];
+        monotonic &= q >= previous;
+        peak = std::max(peak, (q - previous) / dt_s);
+        previous = q;
+    }
+    CHECK(monotonic);
+    CHECK_NEAR(peak, 1.875 * 2.0 / T, 0.01);
+    double firstStep = jointtrajectory::step2targetPosition<TestConfig>(start, finish, 1, nSteps)[1] - start[1];
+    CHECK(firstStep / dt_s < 1e-3);
+}
+
+void testBlender() {
+    const double dt_s = 0.005;
+    DataLine rest = {0.0, 0.0, 1.0, -0.5};
+    DataLine goal = {0.0, 2.0, 1.0, 0.5};
+    DataLine other = {0.0, -1.0, 0.0, 0.5};
+
+    // from rest it is the minimum jerk move
+    {
+        jointtrajectory::TrajectoryBlender<TestConfig> blender(dt_s);
+        blender.hold(rest);
+        blender.moveTo(goal, 2.0);
+        double worst = 0.0;
+        for (int k = 1; k <= 400; k++) {
+            const DataLine& q = blender.next();
+            DataLine expected = jointtrajectory::step2targetPosition<TestConfig>(rest, goal, k, 400);
+            for (int i = 1; i < TestConfig::nCols; i++) { worst = std::max(worst, std::fabs(q[i] - expected[i])); }
+        }
+        CHECK(worst < 1e-9);
+        CHECK(!blender.moving());
+        CHECK(blender.pose() == goal);
+        CHECK(blender.next() == goal);
+    }
+
+    // a new goal mid-motion: velocity stays continuous, arrives at the new goal at rest
+    {
+        jointtrajectory::TrajectoryBlender<TestConfig> blender(dt_s);
+        blender.hold(rest);
+        blender.moveTo(goal, 2.0);
+        DataLine previous = rest, velocity{};
+        double worstJump = 0.0, peakAcceleration = 0.0;
+        for (int k = 1; k <= 600; k++) {
+            if (k == 150) { blender.moveTo(other, 1.5); }
+            const DataLine& q = blender.next();
+            for (int i = 1; i < TestConfig::nCols; i++) {
+                double v = (q[i] - previous[i]) / dt_s;
+                worstJump = std::max(worstJump, std::fabs(v - velocity[i]));
+                peakAcceleration = std::max(peakAcceleration, std::fabs(v - velocity[i]) / dt_s);
+                velocity[i] = v;
+            }
+            previous = q;
+        }
+        CHECK(worstJump < 0.1); // a jump in velocity would be the 1.6 rad/s the joint was moving at
+        CHECK(peakAcceleration < 20.0);
+        CHECK(previous == other);
+        CHECK(!blender.moving());
+    }
+
+    // stop: comes to rest without reversing a joint
+    {
+        jointtrajectory::TrajectoryBlender<TestConfig> blender(dt_s);
+        blender.hold(rest);
+        blender.moveTo(goal, 2.0);
+        for (int k = 0; k < 200; k++) { blender.next(); }
+        DataLine before = blender.pose();
+        blender.stop(0.3);
+        DataLine previous = before;
+        bool reversed = false;
+        for (int k = 0; k < 60; k++) {
+            const DataLine& q = blender.next();
+            reversed |= q[1] < previous[1] || q[3] < previous[3];
+            previous = q;
+        }
+        CHECK(!reversed);
+        CHECK(!blender.moving());
+        CHECK(previous[1] > before[1] && previous[1] < goal[1]);
+    }
+
+    // track: a pose commanded elsewhere, then a goal that continues its motion
+    {
+        jointtrajectory::TrajectoryBlender<TestConfig> blender(dt_s);
+        blender.hold(rest);
+        DataLine q = rest;
+        for (int k = 0; k < 10; k++) {
+            q[1] += 0.5 * dt_s;
+            blender.track(q);
+        }
+        blender.moveTo(goal, 2.0);
+        double step = blender.next()[1] - q[1];
+        CHECK_NEAR(step / dt_s, 0.5, 0.01);
+    }
+}
+
+void testSpline() {
+    const double fs = 200.0;
+
+    // two waypoints: the clamped cubic is the smoothstep between them
+    {
+        std::vector<double> times = {0.0, 2.0};
+        std::vector<DataLine> waypoints = {{0.0, 0.0, 1.0, -1.0}, {0.0, 1.0, 1.0, 1.0}};
+        std::vector<DataLine> poses;
+        jointtrajectory::clampedSpline<TestConfig>(times, waypoints, fs, poses);
+        CHECK(poses.size() == 401);
+        for (int step = 0; step < int(poses.size()); step += 40) {
+            double s = step / 400.0;
+            for (int i = 1; i < TestConfig::nCols; i++) {
+                CHECK_NEAR(poses[step][i], waypoints[0][i] + (waypoints[1][i] - waypoints[0][i]) * s * s * (3.0 - 2.0 * s), 1e-9);
+            }
+        }
+    }
+
+    // through every waypoint, at rest at both ends, continuous velocity in between
+    {
+        std::vector<double> times = {0.0, 0.5, 1.25, 2.0, 3.0};
+        std::vector<DataLine> waypoints = {
+            {0.0, 0.0, 0.0, 0.0}, {0.0, 0.4, -0.2, 0.1}, {0.0, 0.9, 0.3, 0.1}, {0.0, 0.5, 0.2, -0.4}, {0.0, 0.2, 0.0, 0.0}};
+        std::vector<DataLine> poses;
+        jointtrajectory::clampedSpline<TestConfig>(times, waypoints, fs, poses);
+        CHECK(poses.size() == 601);
+        for (size_t k = 0; k < times.size(); k++) {
+            const DataLine& pose = poses[size_t(std::lround(times[k] * fs))];
+            for (int i = 1; i < TestConfig::nCols; i++) { CHECK_NEAR(pose[i], waypoints[k][i], 1e-9); }
+        }
+        double worstJump = 0.0;
+        for (size_t k = 2; k < poses.size(); k++) {
+            for (int i = 1; i < TestConfig::nCols; i++) {
+                double step = poses[k][i] - poses[k - 1][i], lastStep = poses[k - 1][i] - poses[k - 2][i];
+                worstJump = std::max(worstJump, std::fabs(step - lastStep) * fs);
+            }
+        }
+        CHECK(worstJump < 0.1);
+        for (int i = 1; i < TestConfig::nCols; i++) {
+            CHECK(std::fabs(poses[1][i] - poses[0][i]) * fs < 0.05);
+            CHECK(std::fabs(poses[600][i] - poses[599][i]) * fs < 0.05);
+        }
+    }
+
+    // fewer than two waypoints: nothing to play
+    {
+        std::vector<double> times = {0.0};
+        std::vector<DataLine> waypoints = {{0.0, 1.0, 1.0, 1.0}};
+        std::vector<DataLine> poses(3);
+        jointtrajectory::clampedSpline<TestConfig>(times, waypoints, fs, poses);
+        CHECK(poses.empty());
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp";
+    testRecover(dir);
+    testCodec();
+    testMinimumJerk();
+    testBlender();
+    testSpline();
+    std::cout << checks - failures << " of " << checks << " checks passed" << std::endl;
+    return failures;
+}
@@ -0,0 +1,17 @@
+#!/bin/bash
+# Unit tests of the log segment recovery, the .bmz block codec and the joint trajectories
+# (unit_tests.cpp), built with the address and undefined behaviour sanitizers.
+# usage: ./unit_tests.sh
+set -u
+
+src="$(cd "$(dirname "$0")" && pwd)"
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+echo "Building $work/unit_tests"
+g++ -std=c++17 -Wall -O1 -g -fsanitize=address,undefined -fno-sanitize-recover=undefined "$src/unit_tests.cpp" \
+    -o "$work/unit_tests" -pthread || exit 1
+"$work/unit_tests" "$work"
+status=$?
+[ $status -eq 0 ] && echo "Unit tests passed" || echo "Unit tests FAILED"
+exit $status